@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <dlfcn.h>
+#include <sched.h>
 #include <sys/resource.h>
 #include <sys/prctl.h>
 
@@ -44,6 +45,9 @@
 #include <system/thread_defs.h>
 #include <audio_effects/effect_aec.h>
 #include <audio_effects/effect_ns.h>
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "audio_hw.h"
 
 #include "sound/compress_params.h"
@@ -53,6 +57,13 @@
 #define MIXER_CTL_CODEC_VMIXER_CODEC_SWITCH "Codec VMixer Codec Switch"
 #define MIXER_CTL_SPK_VMIXER_SPK_SWITCH "SPK VMixer SPK Switch"
 
+static const char * const mixer_ctl_names[MIXER_CTL_ID_MAX] = {
+    [MIXER_CTL_ID_COMPRESS_PLAYBACK_VOLUME] = MIXER_CTL_COMPRESS_PLAYBACK_VOLUME,
+    [MIXER_CTL_ID_HEADPHONE_JACK_SWITCH] = MIXER_CTL_HEADPHONE_JACK_SWITCH,
+    [MIXER_CTL_ID_CODEC_VMIXER_CODEC_SWITCH] = MIXER_CTL_CODEC_VMIXER_CODEC_SWITCH,
+    [MIXER_CTL_ID_SPK_VMIXER_SPK_SWITCH] = MIXER_CTL_SPK_VMIXER_SPK_SWITCH,
+};
+
 /* TODO: the following PCM device profiles could be read from a config file */
 static struct pcm_device_profile pcm_device_playback = {
     .config = {
@@ -130,7 +141,7 @@ static struct pcm_device_profile pcm_device_capture_loopback_aec = {
 
 static struct pcm_device_profile pcm_device_playback_sco = {
     .config = {
-        .channels = SCO_DEFAULT_CHANNEL_COUNT,
+        .channels = SCO_PLAYBACK_CHANNEL_COUNT,
         .rate = SCO_DEFAULT_SAMPLING_RATE,
         .period_size = SCO_PERIOD_SIZE,
         .period_count = SCO_PERIOD_COUNT,
@@ -209,15 +220,26 @@ static const char * const use_case_table[AUDIO_USECASE_MAX] = {
 
 static unsigned int audio_device_ref_count;
 
+static struct pcm_config pcm_config_hdmi_multi = {
+    .channels = PLAYBACK_HDMI_MULTI_DEFAULT_CHANNEL_COUNT,
+    .rate = DEEP_BUFFER_OUTPUT_SAMPLING_RATE,
+    .period_size = PLAYBACK_HDMI_MULTI_PERIOD_SIZE,
+    .period_count = PLAYBACK_HDMI_MULTI_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = PLAYBACK_HDMI_MULTI_START_THRESHOLD,
+    .stop_threshold = PLAYBACK_HDMI_MULTI_STOP_THRESHOLD,
+    .avail_min = PLAYBACK_HDMI_MULTI_AVAILABLE_MIN,
+};
+
 static struct pcm_config pcm_config_deep_buffer = {
     .channels = 2,
     .rate = DEEP_BUFFER_OUTPUT_SAMPLING_RATE,
     .period_size = DEEP_BUFFER_OUTPUT_PERIOD_SIZE,
     .period_count = DEEP_BUFFER_OUTPUT_PERIOD_COUNT,
     .format = PCM_FORMAT_S16_LE,
-    .start_threshold = DEEP_BUFFER_OUTPUT_PERIOD_SIZE / 4,
+    .start_threshold = DEEP_BUFFER_OUTPUT_PERIOD_SIZE * 2,
     .stop_threshold = INT_MAX,
-    .avail_min = DEEP_BUFFER_OUTPUT_PERIOD_SIZE / 4,
+    .avail_min = DEEP_BUFFER_OUTPUT_PERIOD_SIZE,
 };
 
 struct string_to_enum {
@@ -231,7 +253,513 @@ static const struct string_to_enum out_channels_name_to_enum_table[] = {
     STRING_TO_ENUM(AUDIO_CHANNEL_OUT_7POINT1),
 };
 
+static uint32_t route_cmd_post(struct audio_device *adev, int command, int data0, int data1);
+static void adev_init_wait(struct audio_device *adev);
+static void dummybuf_thread_open(struct audio_device *adev);
+static bool dummybuf_thread_wait_active(struct audio_device *adev, int timeout_ms);
 static void dummybuf_thread_close(struct audio_device *adev);
+static void tfa9895_preempt_dummybuf_l(struct stream_out *out);
+static void *latency_test_thread_loop(void *context);
+
+static int64_t get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Scheduling of each thread role. Fast roles are AudioFlinger threads that
+ * already run SCHED_FIFO: only their affinity is changed, to the CPU handling
+ * the audio interrupt. HAL workers get a nice level and a cgroup.
+ */
+#define THREAD_SCHED_KEEP (-1)
+
+struct thread_role_policy {
+    const char *name;
+    bool irq_affinity;              /* pin to the CPU of the audio IRQ */
+    int sched_policy;               /* SCHED_OTHER, SCHED_FIFO or THREAD_SCHED_KEEP */
+    int priority;                   /* nice for SCHED_OTHER, RT priority for SCHED_FIFO */
+    SchedPolicy cgroup;
+};
+
+static const struct thread_role_policy thread_role_policies[THREAD_ROLE_MAX] = {
+    [THREAD_ROLE_FAST_MIXER] = { "fast mixer", true, THREAD_SCHED_KEEP, 0, SP_FOREGROUND },
+    [THREAD_ROLE_FAST_CAPTURE] = { "fast capture", true, THREAD_SCHED_KEEP, 0, SP_FOREGROUND },
+    [THREAD_ROLE_OFFLOAD_CALLBACK] = { "offload callback", false, SCHED_OTHER,
+                                       ANDROID_PRIORITY_AUDIO, SP_FOREGROUND },
+    [THREAD_ROLE_OFFLOAD_VOLUME] = { "offload volume", false, SCHED_OTHER,
+                                     ANDROID_PRIORITY_AUDIO, SP_FOREGROUND },
+    [THREAD_ROLE_ROUTING] = { "routing", false, SCHED_OTHER,
+                              ANDROID_PRIORITY_AUDIO, SP_FOREGROUND },
+    [THREAD_ROLE_TFA9895] = { "tfa9895 config", false, SCHED_OTHER,
+                              ANDROID_PRIORITY_AUDIO, SP_FOREGROUND },
+    [THREAD_ROLE_DUMMYBUF] = { "dummybuf", false, SCHED_OTHER,
+                               ANDROID_PRIORITY_AUDIO, SP_FOREGROUND },
+    [THREAD_ROLE_OUT_STANDBY] = { "output standby", false, SCHED_OTHER,
+                                  ANDROID_PRIORITY_NORMAL, SP_FOREGROUND },
+    [THREAD_ROLE_PCM_TAP] = { "pcm tap writer", false, SCHED_OTHER,
+                              ANDROID_PRIORITY_BACKGROUND, SP_BACKGROUND },
+    [THREAD_ROLE_INIT] = { "init", false, SCHED_OTHER,
+                           ANDROID_PRIORITY_NORMAL, SP_BACKGROUND },
+    [THREAD_ROLE_LATENCY_TEST] = { "latency test", false, SCHED_OTHER,
+                                   ANDROID_PRIORITY_BACKGROUND, SP_BACKGROUND },
+};
+
+static void thread_policy_init(struct audio_device *adev)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    pthread_mutex_init(&adev->thread_policy_lock, (const pthread_mutexattr_t *) NULL);
+    property_get("audio_hal.procfs_root", value, PROCFS_ROOT_DEFAULT);
+    snprintf(adev->procfs_root, sizeof(adev->procfs_root), "%s", value);
+    adev->irq_cpu = -1;
+}
+
+/* Called with thread_policy_lock held */
+static int thread_policy_read_irq_cpu_l(struct audio_device *adev)
+{
+    char path[PATH_MAX];
+    FILE *fp;
+    int cpu;
+
+    snprintf(path, sizeof(path), "%s/asound/irq_affinity", adev->procfs_root);
+    if ((fp = fopen(path, "r")) == NULL) {
+        ALOGW("Procfs node %s not found", path);
+        return -1;
+    }
+    if (fscanf(fp, "%d", &cpu) != 1 || cpu < 0 || cpu >= CPU_SETSIZE) {
+        ALOGW("Couldn't read CPU id from procfs node %s", path);
+        cpu = -1;
+    }
+    fclose(fp);
+    adev->irq_cpu = cpu;
+    return cpu;
+}
+
+static int thread_policy_set_cpu(pid_t tid, int cpu)
+{
+    cpu_set_t cpu_set;
+
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    return sched_setaffinity(tid, sizeof(cpu_set), &cpu_set) == 0 ? 0 : errno;
+}
+
+/* Applies the policy of role to the calling thread */
+static void thread_policy_apply(struct audio_device *adev, int role)
+{
+    const struct thread_role_policy *policy = &thread_role_policies[role];
+    struct sched_param param;
+    pid_t tid = gettid();
+    int cpu = -1;
+    int error = 0;
+
+    if (policy->sched_policy == SCHED_FIFO) {
+        param.sched_priority = policy->priority;
+        if (sched_setscheduler(tid, SCHED_FIFO, &param) != 0)
+            error = errno;
+    } else if (policy->sched_policy == SCHED_OTHER) {
+        if (setpriority(PRIO_PROCESS, tid, policy->priority) != 0)
+            error = errno;
+        set_sched_policy(tid, policy->cgroup);
+    }
+
+    pthread_mutex_lock(&adev->thread_policy_lock);
+    if (policy->irq_affinity) {
+        cpu = adev->irq_cpu;
+        if (cpu < 0)
+            cpu = thread_policy_read_irq_cpu_l(adev);
+        if (cpu >= 0 && (error = thread_policy_set_cpu(tid, cpu)) != 0) {
+            /* the CPU went offline or the IRQ moved since it was read */
+            cpu = thread_policy_read_irq_cpu_l(adev);
+            if (cpu >= 0)
+                error = thread_policy_set_cpu(tid, cpu);
+        }
+        if (error != 0) {
+            ALOGW("Couldn't set affinity for tid %d; error %d", tid, error);
+            cpu = -1;
+        }
+    }
+    adev->thread_placement[role].tid = tid;
+    adev->thread_placement[role].cpu = cpu;
+    adev->thread_placement[role].error = error;
+    pthread_mutex_unlock(&adev->thread_policy_lock);
+}
+
+/* Prints the placement the kernel reports for the last thread of each role */
+static void thread_policy_dump(struct audio_device *adev, int fd)
+{
+    struct thread_placement placement;
+    cpu_set_t cpu_set;
+    unsigned long mask;
+    int role, policy, nice, cpu;
+
+    dprintf(fd, "  Threads:\n");
+    for (role = 0; role < THREAD_ROLE_MAX; role++) {
+        pthread_mutex_lock(&adev->thread_policy_lock);
+        placement = adev->thread_placement[role];
+        pthread_mutex_unlock(&adev->thread_policy_lock);
+        if (placement.tid == 0)
+            continue;
+
+        policy = sched_getscheduler(placement.tid);
+        if (policy < 0) {
+            dprintf(fd, "    %s: tid %d exited\n", thread_role_policies[role].name,
+                    placement.tid);
+            continue;
+        }
+        errno = 0;
+        nice = getpriority(PRIO_PROCESS, placement.tid);
+        mask = 0;
+        if (sched_getaffinity(placement.tid, sizeof(cpu_set), &cpu_set) == 0) {
+            for (cpu = 0; cpu < (int)(sizeof(mask) * 8) && cpu < CPU_SETSIZE; cpu++)
+                if (CPU_ISSET(cpu, &cpu_set))
+                    mask |= 1UL << cpu;
+        }
+        dprintf(fd, "    %s: tid %d, policy %d, nice %d, cpus %#lx, pinned %d, error %d\n",
+                thread_role_policies[role].name, placement.tid, policy, nice, mask,
+                placement.cpu, placement.error);
+    }
+}
+
+static const char * const pcm_tap_names[PCM_TAP_MAX] = {
+    [PCM_TAP_PRE_RESAMPLER] = "pre_resampler",
+    [PCM_TAP_POST_RESAMPLER] = "post_resampler",
+    [PCM_TAP_PRE_PROCESSING] = "pre_processing",
+    [PCM_TAP_POST_PROCESSING] = "post_processing",
+    [PCM_TAP_ECHO_REFERENCE] = "echo_reference",
+    [PCM_TAP_HOTWORD_DSP] = "hotword_dsp",
+};
+
+/*
+ * Copies 16 bit frames to a tap. Called from the stream threads: never blocks
+ * nor allocates, frames that do not fit in the ring are dropped.
+ */
+static void pcm_tap_write(struct audio_device *adev, int id, const int16_t *buffer,
+                          size_t frames, unsigned int channels, unsigned int rate)
+{
+    struct pcm_tap *tap = &adev->pcm_taps[id];
+    int32_t format = (int32_t)(rate * 16 + channels);
+    uint32_t wr, space, offset, count, bytes;
+
+    if (!android_atomic_acquire_load(&tap->enabled) || frames == 0)
+        return;
+    if (tap->format != format) {
+        if (tap->format != 0) {
+            /* one file per format */
+            android_atomic_add(frames, &tap->frames_dropped);
+            return;
+        }
+        android_atomic_release_store(format, &tap->format);
+    }
+
+    bytes = frames * channels * sizeof(int16_t);
+    wr = (uint32_t)tap->wr;
+    space = PCM_TAP_RING_SIZE - (wr - (uint32_t)android_atomic_acquire_load(&tap->rd));
+    if (bytes > space) {
+        android_atomic_add(frames, &tap->frames_dropped);
+        return;
+    }
+    offset = wr & (PCM_TAP_RING_SIZE - 1);
+    count = PCM_TAP_RING_SIZE - offset;
+    if (count > bytes)
+        count = bytes;
+    memcpy(tap->ring + offset, buffer, count);
+    memcpy(tap->ring, (const char *)buffer + count, bytes - count);
+    android_atomic_release_store((int32_t)(wr + bytes), &tap->wr);
+}
+
+static void pcm_tap_write_wav_header(FILE *file, uint32_t data_bytes, unsigned int rate,
+                                     unsigned int channels)
+{
+    uint32_t header[11];
+
+    header[0] = 0x46464952;                     /* "RIFF" */
+    header[1] = 36 + data_bytes;
+    header[2] = 0x45564157;                     /* "WAVE" */
+    header[3] = 0x20746d66;                     /* "fmt " */
+    header[4] = 16;
+    header[5] = 1 | (channels << 16);           /* PCM */
+    header[6] = rate;
+    header[7] = rate * channels * sizeof(int16_t);
+    header[8] = (channels * sizeof(int16_t)) | (16 << 16);
+    header[9] = 0x61746164;                     /* "data" */
+    header[10] = data_bytes;
+    fseek(file, 0, SEEK_SET);
+    fwrite(header, sizeof(header), 1, file);
+    fseek(file, 0, SEEK_END);
+}
+
+static void pcm_tap_close_file(struct pcm_tap *tap)
+{
+    int32_t format = tap->format;
+
+    if (tap->file == NULL)
+        return;
+    pcm_tap_write_wav_header(tap->file, tap->data_bytes, format / 16, format % 16);
+    fclose(tap->file);
+    tap->file = NULL;
+}
+
+/* Moves the ring content to the tap file. Returns false if the file cannot be opened. */
+static bool pcm_tap_drain(struct audio_device *adev, int id)
+{
+    struct pcm_tap *tap = &adev->pcm_taps[id];
+    int32_t format = android_atomic_acquire_load(&tap->format);
+    uint32_t rd = (uint32_t)tap->rd, wr, offset, count, bytes;
+    char path[PATH_MAX];
+
+    wr = (uint32_t)android_atomic_acquire_load(&tap->wr);
+    if (wr == rd)
+        return true;
+    if (tap->file == NULL) {
+        snprintf(path, sizeof(path), "%s/tap_%s_%u.wav", adev->pcm_tap_dir,
+                 pcm_tap_names[id], tap->file_count++);
+        tap->file = fopen(path, "wb");
+        if (tap->file == NULL) {
+            ALOGE("%s: cannot open %s: %s", __func__, path, strerror(errno));
+            return false;
+        }
+        tap->data_bytes = 0;
+        pcm_tap_write_wav_header(tap->file, 0, format / 16, format % 16);
+        ALOGI("%s: writing tap %s to %s", __func__, pcm_tap_names[id], path);
+    }
+    bytes = wr - rd;
+    offset = rd & (PCM_TAP_RING_SIZE - 1);
+    count = PCM_TAP_RING_SIZE - offset;
+    if (count > bytes)
+        count = bytes;
+    fwrite(tap->ring + offset, count, 1, tap->file);
+    if (bytes > count)
+        fwrite(tap->ring, bytes - count, 1, tap->file);
+    tap->data_bytes += bytes;
+    tap->frames_written += bytes / (sizeof(int16_t) * (format % 16));
+    android_atomic_release_store((int32_t)wr, &tap->rd);
+    return true;
+}
+
+static void *pcm_tap_thread_loop(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct pcm_tap *tap;
+    uint32_t requested;
+    struct timespec ts;
+    int id;
+
+    thread_policy_apply(adev, THREAD_ROLE_PCM_TAP);
+    prctl(PR_SET_NAME, (unsigned long)"PCM Tap Writer", 0, 0, 0);
+
+    pthread_mutex_lock(&adev->pcm_tap_lock);
+    while (!adev->pcm_tap_exit) {
+        requested = adev->pcm_tap_requested;
+        pthread_mutex_unlock(&adev->pcm_tap_lock);
+
+        for (id = 0; id < PCM_TAP_MAX; id++) {
+            tap = &adev->pcm_taps[id];
+            if ((requested & (1 << id)) && !tap->enabled) {
+                if (tap->ring == NULL)
+                    tap->ring = (char *)malloc(PCM_TAP_RING_SIZE);
+                if (tap->ring == NULL)
+                    continue;
+                /* discard what was left from a previous capture */
+                android_atomic_release_store(android_atomic_acquire_load(&tap->wr), &tap->rd);
+                tap->format = 0;
+                android_atomic_release_store(1, &tap->enabled);
+            } else if (!(requested & (1 << id)) && tap->enabled) {
+                android_atomic_release_store(0, &tap->enabled);
+                pcm_tap_drain(adev, id);
+                pcm_tap_close_file(tap);
+                ALOGI("%s: tap %s: %lld frames written, %d dropped", __func__,
+                      pcm_tap_names[id], (long long)tap->frames_written, tap->frames_dropped);
+                continue;
+            }
+            if (tap->enabled && !pcm_tap_drain(adev, id)) {
+                pthread_mutex_lock(&adev->pcm_tap_lock);
+                adev->pcm_tap_requested &= ~(1 << id);
+                pthread_mutex_unlock(&adev->pcm_tap_lock);
+            }
+        }
+
+        pthread_mutex_lock(&adev->pcm_tap_lock);
+        if (adev->pcm_tap_exit || adev->pcm_tap_requested != requested)
+            continue;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_nsec += PCM_TAP_WRITER_PERIOD_MS * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_nsec -= 1000000000;
+            ts.tv_sec++;
+        }
+        pthread_cond_timedwait(&adev->pcm_tap_cond, &adev->pcm_tap_lock, &ts);
+    }
+    pthread_mutex_unlock(&adev->pcm_tap_lock);
+
+    for (id = 0; id < PCM_TAP_MAX; id++) {
+        android_atomic_release_store(0, &adev->pcm_taps[id].enabled);
+        pcm_tap_close_file(&adev->pcm_taps[id]);
+    }
+    return NULL;
+}
+
+/* "off", "all" or a comma separated list of tap names */
+static void pcm_tap_set(struct audio_device *adev, char *value)
+{
+    uint32_t requested = 0;
+    char *name, *saveptr = NULL;
+    pthread_condattr_t attr;
+    int id;
+
+    if (strcmp(value, "all") == 0) {
+        requested = (1 << PCM_TAP_MAX) - 1;
+    } else if (strcmp(value, "off") != 0) {
+        for (name = strtok_r(value, ",", &saveptr); name != NULL;
+                name = strtok_r(NULL, ",", &saveptr)) {
+            for (id = 0; id < PCM_TAP_MAX; id++)
+                if (strcmp(name, pcm_tap_names[id]) == 0)
+                    break;
+            if (id == PCM_TAP_MAX)
+                ALOGW("%s: unknown tap %s", __func__, name);
+            else
+                requested |= 1 << id;
+        }
+    }
+
+    pthread_mutex_lock(&adev->pcm_tap_lock);
+    adev->pcm_tap_requested = requested;
+    if (requested != 0 && adev->pcm_tap_thread == 0) {
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&adev->pcm_tap_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        adev->pcm_tap_exit = false;
+        if (pthread_create(&adev->pcm_tap_thread, (const pthread_attr_t *) NULL,
+                           pcm_tap_thread_loop, adev) != 0) {
+            ALOGE("%s: tap writer thread create fail", __func__);
+            pthread_cond_destroy(&adev->pcm_tap_cond);
+            adev->pcm_tap_thread = 0;
+        }
+    } else if (adev->pcm_tap_thread != 0) {
+        pthread_cond_signal(&adev->pcm_tap_cond);
+    }
+    pthread_mutex_unlock(&adev->pcm_tap_lock);
+}
+
+static void pcm_tap_init(struct audio_device *adev)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    pthread_mutex_init(&adev->pcm_tap_lock, (const pthread_mutexattr_t *) NULL);
+    property_get("audio_hal.pcm_tap_dir", value, PCM_TAP_DIR_DEFAULT);
+    snprintf(adev->pcm_tap_dir, sizeof(adev->pcm_tap_dir), "%s", value);
+}
+
+static void pcm_tap_close(struct audio_device *adev)
+{
+    int id;
+
+    if (adev->pcm_tap_thread != 0) {
+        pthread_mutex_lock(&adev->pcm_tap_lock);
+        adev->pcm_tap_exit = true;
+        pthread_cond_signal(&adev->pcm_tap_cond);
+        pthread_mutex_unlock(&adev->pcm_tap_lock);
+        pthread_join(adev->pcm_tap_thread, (void **) NULL);
+        pthread_cond_destroy(&adev->pcm_tap_cond);
+        adev->pcm_tap_thread = 0;
+    }
+    for (id = 0; id < PCM_TAP_MAX; id++)
+        free(adev->pcm_taps[id].ring);
+    pthread_mutex_destroy(&adev->pcm_tap_lock);
+}
+
+static void pcm_tap_dump(struct audio_device *adev, int fd)
+{
+    struct pcm_tap *tap;
+    int id;
+
+    for (id = 0; id < PCM_TAP_MAX; id++) {
+        tap = &adev->pcm_taps[id];
+        if (tap->ring == NULL)
+            continue;
+        dprintf(fd, "  PCM tap %s: %s, %lld frames written, %d dropped, %u files\n",
+                pcm_tap_names[id], tap->enabled ? "on" : "off",
+                (long long)tap->frames_written,
+                android_atomic_acquire_load(&tap->frames_dropped), tap->file_count);
+    }
+}
+
+static int stream_stats_bucket(int64_t ns)
+{
+    int64_t limit_ns = STREAM_STATS_BUCKET_US * 1000LL;
+    int i;
+
+    for (i = 0; i < STREAM_STATS_BUCKETS - 1; i++, limit_ns <<= 1) {
+        if (ns < limit_ns)
+            break;
+    }
+    return i;
+}
+
+/* Called by the stream's audio thread at the end of out_write()/in_read() */
+static void stream_stats_update(struct stream_stats *stats, int64_t start_ns, int64_t end_ns,
+                                size_t bytes, int64_t audio_ns)
+{
+    int64_t duration_ns = end_ns - start_ns;
+    int64_t jitter_ns;
+
+    android_atomic_inc(&stats->ops);
+    stats->bytes += bytes;
+    if (duration_ns > stats->duration_max_ns)
+        stats->duration_max_ns = duration_ns;
+    android_atomic_inc(&stats->duration_hist[stream_stats_bucket(duration_ns)]);
+    /* jitter: deviation of the call interval from the audio duration of the previous call */
+    if (stats->last_op_ns != 0) {
+        jitter_ns = start_ns - stats->last_op_ns - stats->last_op_audio_ns;
+        if (jitter_ns < 0)
+            jitter_ns = -jitter_ns;
+        android_atomic_inc(&stats->jitter_hist[stream_stats_bucket(jitter_ns)]);
+    }
+    stats->last_op_ns = start_ns;
+    stats->last_op_audio_ns = audio_ns;
+}
+
+static void stream_stats_standby(struct stream_stats *stats)
+{
+    android_atomic_inc(&stats->standby);
+    stats->last_op_ns = 0;
+}
+
+static void stream_stats_dump(const struct stream_stats *stats, int fd, const char *op)
+{
+    int i;
+
+    dprintf(fd, "      %s: %d, bytes: %lld, errors: %d, xruns: %d, standby: %d, resampled: %d\n",
+            op, stats->ops, (long long)stats->bytes, stats->errors, stats->xruns,
+            stats->standby, stats->resampled);
+    dprintf(fd, "      max duration: %lld us\n", (long long)(stats->duration_max_ns / 1000));
+    dprintf(fd, "      duration/jitter histogram:\n");
+    for (i = 0; i < STREAM_STATS_BUCKETS; i++) {
+        if (i < STREAM_STATS_BUCKETS - 1)
+            dprintf(fd, "        < %6d us: %8d %8d\n", STREAM_STATS_BUCKET_US << i,
+                    stats->duration_hist[i], stats->jitter_hist[i]);
+        else
+            dprintf(fd, "       >= %6d us: %8d %8d\n", STREAM_STATS_BUCKET_US << (i - 1),
+                    stats->duration_hist[i], stats->jitter_hist[i]);
+    }
+}
+
+/*
+ * Capture does not report overruns: the buffer must have overflowed if the
+ * previous read started longer ago than the buffer lasts. No driver call.
+ */
+static bool in_overrun_likely(const struct stream_stats *stats, struct pcm *pcm,
+                              unsigned int rate, int64_t now_ns)
+{
+    if (stats->last_op_ns == 0 || pcm == NULL)
+        return false;
+    return now_ns - stats->last_op_ns >
+            (int64_t)pcm_get_buffer_size(pcm) * 1000000000LL / rate;
+}
 
 static bool is_supported_format(audio_format_t format)
 {
@@ -260,6 +788,62 @@ static int get_snd_codec_id(audio_format_t format)
     return id;
 }
 
+/* Fixed compress fragment configurations, checked before the computed one */
+struct compress_fragment_override {
+    audio_format_t format;          /* main format */
+    uint32_t min_bit_rate;
+    uint32_t max_bit_rate;
+    uint32_t fragment_size;
+    uint32_t fragments;
+};
+
+static const struct compress_fragment_override compress_fragment_overrides[] = {
+    /* bit rate not provided by the extractor */
+    { AUDIO_FORMAT_MP3, 0, 0, COMPRESS_OFFLOAD_FRAGMENT_SIZE, COMPRESS_OFFLOAD_NUM_FRAGMENTS },
+    { AUDIO_FORMAT_AAC, 0, 0, COMPRESS_OFFLOAD_FRAGMENT_SIZE, COMPRESS_OFFLOAD_NUM_FRAGMENTS },
+};
+
+/*
+ * Sizes the compress fragments so that one fragment lasts about
+ * COMPRESS_OFFLOAD_WAKEUP_MS at the stream bit rate, and uses as many fragments
+ * as fit in COMPRESS_OFFLOAD_BUFFER_BUDGET. Fragments are never smaller than
+ * COMPRESS_OFFLOAD_FRAGMENT_SIZE: low bit rates must not wake the AP more often.
+ */
+static void get_compress_fragments(audio_format_t format, uint32_t bit_rate,
+                                   uint32_t *fragment_size, uint32_t *fragments)
+{
+    const struct compress_fragment_override *ovr;
+    uint64_t size;
+    uint32_t count;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(compress_fragment_overrides); i++) {
+        ovr = &compress_fragment_overrides[i];
+        if (ovr->format == (format & AUDIO_FORMAT_MAIN_MASK) &&
+                bit_rate >= ovr->min_bit_rate && bit_rate <= ovr->max_bit_rate) {
+            *fragment_size = ovr->fragment_size;
+            *fragments = ovr->fragments;
+            return;
+        }
+    }
+
+    size = (uint64_t)bit_rate / 8 * COMPRESS_OFFLOAD_WAKEUP_MS / 1000;
+    size = (size + COMPRESS_OFFLOAD_FRAGMENT_ALIGN - 1) & ~(COMPRESS_OFFLOAD_FRAGMENT_ALIGN - 1);
+    if (size < COMPRESS_OFFLOAD_FRAGMENT_SIZE)
+        size = COMPRESS_OFFLOAD_FRAGMENT_SIZE;
+    else if (size > COMPRESS_OFFLOAD_FRAGMENT_SIZE_MAX)
+        size = COMPRESS_OFFLOAD_FRAGMENT_SIZE_MAX;
+
+    count = COMPRESS_OFFLOAD_BUFFER_BUDGET / size;
+    if (count < COMPRESS_OFFLOAD_NUM_FRAGMENTS_MIN)
+        count = COMPRESS_OFFLOAD_NUM_FRAGMENTS_MIN;
+    else if (count > COMPRESS_OFFLOAD_NUM_FRAGMENTS_MAX)
+        count = COMPRESS_OFFLOAD_NUM_FRAGMENTS_MAX;
+
+    *fragment_size = (uint32_t)size;
+    *fragments = count;
+}
+
 /* Array to store sound devices */
 static const char * const device_table[SND_DEVICE_MAX] = {
     [SND_DEVICE_NONE] = "none",
@@ -315,6 +899,18 @@ static struct mixer_card *adev_get_mixer_for_card(struct audio_device *adev, int
     return NULL;
 }
 
+/* Returns the cached control, NULL if the card or the control does not exist */
+static struct mixer_ctl *adev_get_mixer_ctl(struct audio_device *adev, int card, int id)
+{
+    struct mixer_card *mixer_card = adev_get_mixer_for_card(adev, card);
+
+    if (mixer_card == NULL || mixer_card->ctls[id] == NULL) {
+        ALOGE("%s: Could not get ctl for mixer cmd - %s", __func__, mixer_ctl_names[id]);
+        return NULL;
+    }
+    return mixer_card->ctls[id];
+}
+
 static struct mixer_card *uc_get_mixer_for_card(struct audio_usecase *usecase, int card)
 {
     struct mixer_card *mixer_card;
@@ -344,9 +940,10 @@ static void free_mixer_list(struct audio_device *adev)
 
 static int mixer_init(struct audio_device *adev)
 {
-    int i;
+    int i, j;
     int card;
-    int retry_num;
+    int retry_us;
+    int waited_us;
     struct mixer *mixer;
     struct audio_route *audio_route;
     char mixer_path[PATH_MAX];
@@ -358,16 +955,21 @@ static int mixer_init(struct audio_device *adev)
     for (i = 0; pcm_devices[i] != NULL; i++) {
         card = pcm_devices[i]->card;
         if (adev_get_mixer_for_card(adev, card) == NULL) {
-            retry_num = 0;
+            /* the card may not be registered yet on boot: poll with a growing
+               delay bounded by RETRY_NUMBER * RETRY_US in total */
+            retry_us = MIXER_RETRY_MIN_US;
+            waited_us = 0;
             do {
                 mixer = mixer_open(card);
                 if (mixer == NULL) {
-                    if (++retry_num > RETRY_NUMBER) {
+                    if (waited_us >= RETRY_NUMBER * RETRY_US) {
                         ALOGE("%s unable to open the mixer for--card %d, aborting.",
                               __func__, card);
                         goto error;
                     }
-                    usleep(RETRY_US);
+                    usleep(retry_us);
+                    waited_us += retry_us;
+                    retry_us = retry_us * 2 < RETRY_US ? retry_us * 2 : RETRY_US;
                 }
             } while (mixer == NULL);
 
@@ -382,6 +984,8 @@ static int mixer_init(struct audio_device *adev)
             mixer_card->card = card;
             mixer_card->mixer = mixer;
             mixer_card->audio_route = audio_route;
+            for (j = 0; j < MIXER_CTL_ID_MAX; j++)
+                mixer_card->ctls[j] = mixer_get_ctl_by_name(mixer, mixer_ctl_names[j]);
             list_add_tail(&adev->mixer_list, &mixer_card->adev_list_node);
         }
     }
@@ -750,8 +1354,10 @@ static int enable_snd_device(struct audio_device *adev,
     list_for_each(node, &uc_info->mixer_list) {
         mixer_card = node_to_item(node, struct mixer_card, uc_list_node[uc_info->id]);
         audio_route_apply_path(mixer_card->audio_route, snd_device_name);
-        if (update_mixer)
+        if (update_mixer) {
             audio_route_update_mixer(mixer_card->audio_route);
+            android_atomic_inc(&adev->mixer_ops);
+        }
     }
 
     return 0;
@@ -787,13 +1393,144 @@ static int disable_snd_device(struct audio_device *adev,
         list_for_each(node, &uc_info->mixer_list) {
             mixer_card = node_to_item(node, struct mixer_card, uc_list_node[uc_info->id]);
             audio_route_reset_path(mixer_card->audio_route, snd_device_name);
-            if (update_mixer)
+            if (update_mixer) {
                 audio_route_update_mixer(mixer_card->audio_route);
+                android_atomic_inc(&adev->mixer_ops);
+            }
         }
     }
     return 0;
 }
 
+static int get_snd_device_components(snd_device_t snd_device,
+                                     snd_device_t components[SND_DEVICE_COMPONENTS_MAX])
+{
+    if (snd_device == SND_DEVICE_NONE)
+        return 0;
+
+    if (snd_device == SND_DEVICE_OUT_SPEAKER_AND_HEADPHONES) {
+        components[0] = SND_DEVICE_OUT_SPEAKER;
+        components[1] = SND_DEVICE_OUT_HEADPHONES;
+        return 2;
+    }
+    components[0] = snd_device;
+    return 1;
+}
+
+/*
+ * Returns the cached path changes for switching a usecase from snd device
+ * "from" to snd device "to", computing them on first use.
+ */
+static struct snd_device_transition *get_snd_device_transition(struct audio_device *adev,
+                                                               snd_device_t from,
+                                                               snd_device_t to)
+{
+    struct snd_device_transition *t;
+    snd_device_t from_c[SND_DEVICE_COMPONENTS_MAX];
+    snd_device_t to_c[SND_DEVICE_COMPONENTS_MAX];
+    bool to_kept[SND_DEVICE_COMPONENTS_MAX] = { false };
+    int num_from, num_to;
+    int i, j;
+
+    if (adev->snd_dev_transitions == NULL ||
+            from < SND_DEVICE_NONE || from >= SND_DEVICE_MAX ||
+            to < SND_DEVICE_NONE || to >= SND_DEVICE_MAX)
+        return NULL;
+
+    t = &adev->snd_dev_transitions[from * SND_DEVICE_MAX + to];
+    if (t->valid)
+        return t;
+
+    num_from = get_snd_device_components(from, from_c);
+    num_to = get_snd_device_components(to, to_c);
+
+    for (i = 0; i < num_from; i++) {
+        /* component present on both sides: nothing to do */
+        for (j = 0; j < num_to; j++) {
+            if (!to_kept[j] && from_c[i] == to_c[j])
+                break;
+        }
+        if (j < num_to) {
+            to_kept[j] = true;
+            continue;
+        }
+        /* different snd device using the same mixer path: only move the ref count */
+        for (j = 0; j < num_to; j++) {
+            if (!to_kept[j] && strcmp(device_table[from_c[i]], device_table[to_c[j]]) == 0)
+                break;
+        }
+        if (j < num_to) {
+            to_kept[j] = true;
+            t->move_from[t->num_move] = from_c[i];
+            t->move_to[t->num_move] = to_c[j];
+            t->num_move++;
+            continue;
+        }
+        t->disable[t->num_disable++] = from_c[i];
+    }
+    for (j = 0; j < num_to; j++) {
+        if (!to_kept[j])
+            t->enable[t->num_enable++] = to_c[j];
+    }
+    t->valid = true;
+
+    ALOGV("%s: %s -> %s: disable %d, enable %d, move %d", __func__,
+          device_table[from], device_table[to], t->num_disable, t->num_enable, t->num_move);
+    return t;
+}
+
+/*
+ * Applies the disable (and ref count move) or the enable half of a transition
+ * without updating the mixer. Returns true if a mixer path was reset or applied.
+ */
+static bool apply_snd_device_transition(struct audio_device *adev,
+                                        struct audio_usecase *uc_info,
+                                        const struct snd_device_transition *t,
+                                        bool enable)
+{
+    bool mixer_dirty = false;
+    int i;
+
+    if (enable) {
+        for (i = 0; i < t->num_enable; i++) {
+            if (adev->snd_dev_ref_cnt[t->enable[i]] == 0)
+                mixer_dirty = true;
+            enable_snd_device(adev, uc_info, t->enable[i], false);
+        }
+        return mixer_dirty;
+    }
+
+    for (i = 0; i < t->num_disable; i++) {
+        if (adev->snd_dev_ref_cnt[t->disable[i]] == 1)
+            mixer_dirty = true;
+        disable_snd_device(adev, uc_info, t->disable[i], false);
+    }
+    for (i = 0; i < t->num_move; i++) {
+        if (adev->snd_dev_ref_cnt[t->move_from[i]] <= 0) {
+            ALOGE("%s: device ref cnt is already 0", __func__);
+            if (adev->snd_dev_ref_cnt[t->move_to[i]] == 0)
+                mixer_dirty = true;
+            enable_snd_device(adev, uc_info, t->move_to[i], false);
+            continue;
+        }
+        adev->snd_dev_ref_cnt[t->move_from[i]]--;
+        adev->snd_dev_ref_cnt[t->move_to[i]]++;
+    }
+    return mixer_dirty;
+}
+
+static void update_snd_device_transition_stats(struct snd_device_transition *t,
+                                               bool mixer_dirty,
+                                               uint32_t elapsed_us)
+{
+    t->count++;
+    if (mixer_dirty)
+        t->mixer_updates++;
+    t->total_us += elapsed_us;
+    if (elapsed_us > t->max_us)
+        t->max_us = elapsed_us;
+}
+
 static int select_devices(struct audio_device *adev,
                           audio_usecase_t uc_id)
 {
@@ -805,6 +1542,11 @@ static int select_devices(struct audio_device *adev,
     struct stream_in *active_input = NULL;
     struct stream_out *active_out;
     struct mixer_card *mixer_card;
+    struct snd_device_transition *out_transition;
+    struct snd_device_transition *in_transition;
+    bool mixer_dirty;
+    int64_t start_ns;
+    uint32_t elapsed_us;
 
     ALOGV("%s: usecase(%d)", __func__, uc_id);
 
@@ -877,39 +1619,51 @@ static int select_devices(struct audio_device *adev,
           out_snd_device, get_snd_device_display_name(out_snd_device),
           in_snd_device,  get_snd_device_display_name(in_snd_device));
 
+    start_ns = get_time_ns();
 
-    /* Disable current sound devices */
-    if (usecase->out_snd_device != SND_DEVICE_NONE) {
-        pthread_mutex_lock(&adev->tfa9895_lock);
-        disable_snd_device(adev, usecase, usecase->out_snd_device, false);
-        pthread_mutex_unlock(&adev->tfa9895_lock);
-    }
 
-    if (usecase->in_snd_device != SND_DEVICE_NONE) {
-        disable_snd_device(adev, usecase, usecase->in_snd_device, false);
+    out_transition = get_snd_device_transition(adev, usecase->out_snd_device, out_snd_device);
+    in_transition = get_snd_device_transition(adev, usecase->in_snd_device, in_snd_device);
+    if (out_transition == NULL || in_transition == NULL) {
+        ALOGE("%s: invalid snd device transition", __func__);
+        return -EINVAL;
     }
 
-    /* Enable new sound devices */
-    if (out_snd_device != SND_DEVICE_NONE) {
-        enable_snd_device(adev, usecase, out_snd_device, false);
-    }
+    /* Disable current sound devices */
+    pthread_mutex_lock(&adev->tfa9895_lock);
+    mixer_dirty = apply_snd_device_transition(adev, usecase, out_transition, false);
+    pthread_mutex_unlock(&adev->tfa9895_lock);
+    mixer_dirty |= apply_snd_device_transition(adev, usecase, in_transition, false);
 
-    if (in_snd_device != SND_DEVICE_NONE) {
-        enable_snd_device(adev, usecase, in_snd_device, false);
+    /* Enable new sound devices */
+    mixer_dirty |= apply_snd_device_transition(adev, usecase, out_transition, true);
+    mixer_dirty |= apply_snd_device_transition(adev, usecase, in_transition, true);
+
+    if (mixer_dirty) {
+        list_for_each(node, &usecase->mixer_list) {
+             mixer_card = node_to_item(node, struct mixer_card, uc_list_node[usecase->id]);
+             audio_route_update_mixer(mixer_card->audio_route);
+             android_atomic_inc(&adev->mixer_ops);
+        }
     }
 
-    list_for_each(node, &usecase->mixer_list) {
-         mixer_card = node_to_item(node, struct mixer_card, uc_list_node[usecase->id]);
-         audio_route_update_mixer(mixer_card->audio_route);
-    }
+    elapsed_us = (uint32_t)((get_time_ns() - start_ns) / 1000);
+    if (out_snd_device != usecase->out_snd_device)
+        update_snd_device_transition_stats(out_transition, mixer_dirty, elapsed_us);
+    if (in_snd_device != usecase->in_snd_device)
+        update_snd_device_transition_stats(in_transition, mixer_dirty, elapsed_us);
+    ALOGV("%s: switch took %u us, mixer %s", __func__, elapsed_us,
+          mixer_dirty ? "updated" : "unchanged");
 
     usecase->in_snd_device = in_snd_device;
     usecase->out_snd_device = out_snd_device;
 
+    /* amp I2C is done by the routing worker, outside of adev->lock */
     if (out_snd_device != SND_DEVICE_NONE)
         if (usecase->devices & (AUDIO_DEVICE_OUT_WIRED_HEADSET | AUDIO_DEVICE_OUT_WIRED_HEADPHONE))
             if (adev->htc_acoustic_set_rt5506_amp != NULL)
-                adev->htc_acoustic_set_rt5506_amp(adev->mode, usecase->devices);
+                adev->route_amp_seq = route_cmd_post(adev, ROUTE_CMD_SET_RT5506_AMP,
+                                                     adev->mode, usecase->devices);
     return 0;
 }
 
@@ -958,6 +1712,87 @@ static void get_capture_reference_delay(struct stream_in *in,
            buffer->time_stamp.tv_sec , buffer->time_stamp.tv_nsec, kernel_frames, buffer->delay_ns, frames);
 }
 
+/* Grows the ring to hold at least size frames, keeping the frames it contains */
+static void frame_ring_reserve(struct frame_ring *ring, size_t size, size_t channels)
+{
+    int16_t *buf;
+    size_t first;
+
+    if (ring->channels != channels) {
+        ring->channels = channels;
+        ring->size = 0;
+        ring->rd = 0;
+        ring->frames = 0;
+    }
+    if (ring->size >= size)
+        return;
+
+    buf = (int16_t *)malloc(size * channels * sizeof(int16_t));
+    ALOG_ASSERT((buf != NULL), "frame_ring_reserve() failed to allocate ring");
+    /* linearize the frames being kept */
+    first = ring->size - ring->rd < ring->frames ? ring->size - ring->rd : ring->frames;
+    if (first > 0)
+        memcpy(buf, ring->buf + ring->rd * channels, first * channels * sizeof(int16_t));
+    if (ring->frames > first)
+        memcpy(buf + first * channels, ring->buf,
+               (ring->frames - first) * channels * sizeof(int16_t));
+    free(ring->buf);
+    ring->buf = buf;
+    ring->size = size;
+    ring->rd = 0;
+}
+
+static void frame_ring_reset(struct frame_ring *ring)
+{
+    ring->rd = 0;
+    ring->frames = 0;
+}
+
+static void frame_ring_free(struct frame_ring *ring)
+{
+    free(ring->buf);
+    memset(ring, 0, sizeof(*ring));
+}
+
+/* Returns the oldest contiguous frames, their count in *frames */
+static int16_t *frame_ring_read_view(struct frame_ring *ring, size_t *frames)
+{
+    size_t count = ring->size - ring->rd;
+
+    *frames = count < ring->frames ? count : ring->frames;
+    return ring->buf + ring->rd * ring->channels;
+}
+
+static void frame_ring_consume(struct frame_ring *ring, size_t frames)
+{
+    if (frames > ring->frames)
+        frames = ring->frames;
+    ring->frames -= frames;
+    ring->rd = ring->frames == 0 ? 0 : (ring->rd + frames) % ring->size;
+}
+
+/* Returns the contiguous free space after the last frame, its size in *frames */
+static int16_t *frame_ring_write_view(struct frame_ring *ring, size_t *frames)
+{
+    size_t wr;
+
+    if (ring->size == 0) {
+        *frames = 0;
+        return ring->buf;
+    }
+    wr = (ring->rd + ring->frames) % ring->size;
+    if (ring->frames == ring->size)
+        *frames = 0;
+    else
+        *frames = wr >= ring->rd ? ring->size - wr : ring->rd - wr;
+    return ring->buf + wr * ring->channels;
+}
+
+static void frame_ring_commit(struct frame_ring *ring, size_t frames)
+{
+    ring->frames += frames;
+}
+
 static void get_capture_delay(struct stream_in *in,
                               size_t frames __unused,
                               struct echo_reference_buffer *buffer)
@@ -975,21 +1810,13 @@ static void get_capture_delay(struct stream_in *in,
     pcm_device = node_to_item(list_head(&in->pcm_dev_list),
                               struct pcm_device, stream_list_node);
 
-    if (pcm_get_htimestamp(pcm_device->pcm, &kernel_frames, &tstamp) < 0) {
-        buffer->time_stamp.tv_sec  = 0;
-        buffer->time_stamp.tv_nsec = 0;
-        buffer->delay_ns           = 0;
-        ALOGW("read get_capture_delay(): pcm_htimestamp error");
-        return;
-    }
-
     /* read frames available in audio HAL input buffer
      * add number of frames being read as we want the capture time of first sample
      * in current buffer */
-    /* frames in in->read_buf are at driver sampling rate while frames in in->proc_buf are
+    /* frames in in->read_buf are at driver sampling rate while frames in in->proc_ring are
      * at requested sampling rate */
     buf_delay = (long)(((int64_t)(in->read_buf_frames) * 1000000000) / in->config.rate +
-                       ((int64_t)(in->proc_buf_frames) * 1000000000) / in->requested_rate );
+                       ((int64_t)(in->proc_ring.frames) * 1000000000) / in->requested_rate );
 
     /* add delay introduced by resampler */
     rsmp_delay = 0;
@@ -997,6 +1824,26 @@ static void get_capture_delay(struct stream_in *in,
         rsmp_delay = in->resampler->delay_ns(in->resampler);
     }
 
+    /* mmap capture: in_mmap_begin() already timed the mapped period, which
+     * in->read_buf_frames counts down */
+    if (pcm_device->mmap && in->capture_time_ns != 0) {
+        int64_t end_ns = in->capture_time_ns +
+                (int64_t)in->mmap_frames * 1000000000LL / in->config.rate;
+
+        buffer->time_stamp.tv_sec  = end_ns / 1000000000LL;
+        buffer->time_stamp.tv_nsec = end_ns % 1000000000LL;
+        buffer->delay_ns           = buf_delay + rsmp_delay;
+        return;
+    }
+
+    if (pcm_get_htimestamp(pcm_device->pcm, &kernel_frames, &tstamp) < 0) {
+        buffer->time_stamp.tv_sec  = 0;
+        buffer->time_stamp.tv_nsec = 0;
+        buffer->delay_ns           = 0;
+        ALOGW("read get_capture_delay(): pcm_htimestamp error");
+        return;
+    }
+
     kernel_delay = (long)(((int64_t)kernel_frames * 1000000000) / in->config.rate);
 
     delay_ns = kernel_delay + buf_delay + rsmp_delay;
@@ -1008,42 +1855,119 @@ static void get_capture_delay(struct stream_in *in,
          "in->read_buf_frames:[%zd], in->proc_buf_frames:[%zd], frames:[%zd]",
          buffer->time_stamp.tv_sec , buffer->time_stamp.tv_nsec, kernel_frames,
          buffer->delay_ns, kernel_delay, buf_delay, rsmp_delay,
-         in->read_buf_frames, in->proc_buf_frames, frames);
+         in->read_buf_frames, in->proc_ring.frames, frames);
+}
+
+/* Called by the primary output. Frames that do not fit are dropped */
+static void echo_ref_ring_push(struct audio_device *adev, const int16_t *buffer, size_t frames,
+                               unsigned int channels, const struct echo_reference_buffer *timing)
+{
+    struct echo_ref_ring *ring = &adev->echo_ref_ring;
+    struct echo_ref_slot *slot;
+    int32_t wr;
+    size_t count;
+
+    if (!android_atomic_acquire_load(&ring->active) || channels != ring->channels)
+        return;
+    do {
+        wr = ring->wr;
+        if (wr - android_atomic_acquire_load(&ring->rd) >= ECHO_REF_RING_SLOTS) {
+            android_atomic_inc(&ring->overruns);
+            return;
+        }
+        slot = &ring->slots[wr % ECHO_REF_RING_SLOTS];
+        count = frames < ECHO_REF_SLOT_FRAMES ? frames : ECHO_REF_SLOT_FRAMES;
+        slot->frames = count;
+        slot->time_stamp = timing->time_stamp;
+        /* render delay of the last frame of this slot */
+        slot->delay_ns = timing->delay_ns -
+                (int32_t)(((int64_t)(frames - count) * 1000000000) / ring->rate);
+        if (buffer != NULL) {
+            memcpy(slot->data, buffer, count * channels * sizeof(int16_t));
+            buffer += count * channels;
+        }
+        frames -= count;
+        android_atomic_release_store(wr + 1, &ring->wr);
+        ring->pushed++;
+    } while (frames > 0);
+}
+
+static void echo_ref_ring_stop(struct audio_device *adev, struct stream_out *out)
+{
+    struct echo_reference_buffer b;
+
+    if (out != adev->primary_output)
+        return;
+    memset(&b, 0, sizeof(b));
+    echo_ref_ring_push(adev, NULL, 0, adev->echo_ref_ring.channels, &b);
+}
+
+/* Called by the capture thread owning the echo reference */
+static void echo_ref_ring_drain(struct stream_in *in)
+{
+    struct echo_ref_ring *ring = &in->dev->echo_ref_ring;
+    struct echo_ref_slot *slot;
+    struct echo_reference_buffer b;
+    int32_t rd = ring->rd;
+    int32_t wr = android_atomic_acquire_load(&ring->wr);
+
+    for (; rd != wr; rd++) {
+        slot = &ring->slots[rd % ECHO_REF_RING_SLOTS];
+        if (slot->frames == 0) {
+            in->echo_reference->write(in->echo_reference, NULL);
+        } else {
+            b.raw = slot->data;
+            b.frame_count = slot->frames;
+            b.time_stamp = slot->time_stamp;
+            b.delay_ns = slot->delay_ns;
+            in->echo_reference->write(in->echo_reference, &b);
+        }
+        android_atomic_release_store(rd + 1, &ring->rd);
+    }
+}
+
+static void echo_ref_ring_init(struct audio_device *adev)
+{
+    struct echo_ref_ring *ring = &adev->echo_ref_ring;
+    int i;
+
+    ring->data = (int16_t *)calloc(ECHO_REF_RING_SLOTS * ECHO_REF_SLOT_FRAMES *
+                                   ECHO_REF_MAX_CHANNELS, sizeof(int16_t));
+    for (i = 0; ring->data != NULL && i < ECHO_REF_RING_SLOTS; i++)
+        ring->slots[i].data = ring->data + i * ECHO_REF_SLOT_FRAMES * ECHO_REF_MAX_CHANNELS;
 }
 
 static int32_t update_echo_reference(struct stream_in *in, size_t frames)
 {
     ALOGVV("%s: enter:), in->config.channels(%d)", __func__,in->config.channels);
     struct echo_reference_buffer b;
+    size_t count;
     b.delay_ns = 0;
-    struct pcm_device *pcm_device;
 
-    pcm_device = node_to_item(list_head(&in->pcm_dev_list),
-                              struct pcm_device, stream_list_node);
+    echo_ref_ring_drain(in);
 
-    ALOGVV("update_echo_reference, in->config.channels(%d), frames = [%zd], in->ref_buf_frames = [%zd],  "
+    ALOGVV("update_echo_reference, in->config.channels(%d), frames = [%zd], in->ref_ring.frames = [%zd],  "
           "b.frame_count = [%zd]",
-          in->config.channels, frames, in->ref_buf_frames, frames - in->ref_buf_frames);
-    if (in->ref_buf_frames < frames) {
-        if (in->ref_buf_size < frames) {
-            in->ref_buf_size = frames;
-            in->ref_buf = (int16_t *)realloc(in->ref_buf, pcm_frames_to_bytes(pcm_device->pcm, frames));
-            ALOG_ASSERT((in->ref_buf != NULL),
-                        "update_echo_reference() failed to reallocate ref_buf");
-            ALOGVV("update_echo_reference(): ref_buf %p extended to %d bytes",
-                      in->ref_buf, pcm_frames_to_bytes(pcm_device->pcm, frames));
-        }
-        b.frame_count = frames - in->ref_buf_frames;
-        b.raw = (void *)(in->ref_buf + in->ref_buf_frames * in->config.channels);
-
-        get_capture_delay(in, frames, &b);
-
-        if (in->echo_reference->read(in->echo_reference, &b) == 0)
-        {
-            in->ref_buf_frames += b.frame_count;
-            ALOGVV("update_echo_reference(): in->ref_buf_frames:[%zd], "
-                    "in->ref_buf_size:[%zd], frames:[%zd], b.frame_count:[%zd]",
-                 in->ref_buf_frames, in->ref_buf_size, frames, b.frame_count);
+          in->config.channels, frames, in->ref_ring.frames, frames - in->ref_ring.frames);
+    if (in->ref_ring.frames < frames) {
+        frame_ring_reserve(&in->ref_ring, frames, in->config.channels);
+        /* the free space may wrap around the end of the ring */
+        while (in->ref_ring.frames < frames) {
+            b.raw = (void *)frame_ring_write_view(&in->ref_ring, &count);
+            if (count > frames - in->ref_ring.frames)
+                count = frames - in->ref_ring.frames;
+            b.frame_count = count;
+
+            get_capture_delay(in, frames, &b);
+
+            if (in->echo_reference->read(in->echo_reference, &b) != 0 || b.frame_count == 0)
+                break;
+            pcm_tap_write(in->dev, PCM_TAP_ECHO_REFERENCE, b.raw, b.frame_count,
+                          in->config.channels, in->requested_rate);
+            frame_ring_commit(&in->ref_ring, b.frame_count);
+            ALOGVV("update_echo_reference(): in->ref_ring.frames:[%zd], "
+                    "in->ref_ring.size:[%zd], frames:[%zd], b.frame_count:[%zd]",
+                 in->ref_ring.frames, in->ref_ring.size, frames, b.frame_count);
         }
     } else
         ALOGW("update_echo_reference(): NOT enough frames to read ref buffer");
@@ -1091,63 +2015,56 @@ static void push_echo_reference(struct stream_in *in, size_t frames)
 {
     ALOGVV("%s: enter:)", __func__);
     /* read frames from echo reference buffer and update echo delay
-     * in->ref_buf_frames is updated with frames available in in->ref_buf */
+     * in->ref_ring is updated with frames available */
 
     int32_t delay_us = update_echo_reference(in, frames)/1000;
-    int32_t size_in_bytes = 0;
     int i;
     audio_buffer_t buf;
+    size_t count;
 
-    if (in->ref_buf_frames < frames)
-        frames = in->ref_buf_frames;
+    if (in->ref_ring.frames < frames)
+        frames = in->ref_ring.frames;
 
-    buf.frameCount = frames;
-    buf.raw = in->ref_buf;
+    /* feed the frames in place, in at most two contiguous views */
+    while (frames > 0) {
+        buf.raw = frame_ring_read_view(&in->ref_ring, &count);
+        buf.frameCount = count < frames ? count : frames;
+
+        for (i = 0; i < in->num_preprocessors; i++) {
+            if ((*in->preprocessors[i].effect_itfe)->process_reverse == NULL)
+                continue;
+            ALOGVV("%s: effect_itfe)->process_reverse() BEGIN i=(%d) ", __func__, i);
+            (*in->preprocessors[i].effect_itfe)->process_reverse(in->preprocessors[i].effect_itfe,
+                                                   &buf,
+                                                   NULL);
+            ALOGVV("%s: effect_itfe)->process_reverse() END i=(%d) ", __func__, i);
+        }
+        if (buf.frameCount == 0)
+            break;
+        frame_ring_consume(&in->ref_ring, buf.frameCount);
+        frames -= buf.frameCount < frames ? buf.frameCount : frames;
+    }
 
     for (i = 0; i < in->num_preprocessors; i++) {
         if ((*in->preprocessors[i].effect_itfe)->process_reverse == NULL)
             continue;
-        ALOGVV("%s: effect_itfe)->process_reverse() BEGIN i=(%d) ", __func__, i);
-        (*in->preprocessors[i].effect_itfe)->process_reverse(in->preprocessors[i].effect_itfe,
-                                               &buf,
-                                               NULL);
-        ALOGVV("%s: effect_itfe)->process_reverse() END i=(%d) ", __func__, i);
         set_preprocessor_echo_delay(in->preprocessors[i].effect_itfe, delay_us);
     }
-
-    in->ref_buf_frames -= buf.frameCount;
-    ALOGVV("%s: in->ref_buf_frames(%zd), in->config.channels(%d) ",
-           __func__, in->ref_buf_frames, in->config.channels);
-    if (in->ref_buf_frames) {
-        memcpy(in->ref_buf,
-               in->ref_buf + buf.frameCount * in->config.channels,
-               in->ref_buf_frames * in->config.channels * sizeof(int16_t));
-    }
+    ALOGVV("%s: in->ref_ring.frames(%zd), in->config.channels(%d) ",
+           __func__, in->ref_ring.frames, in->config.channels);
 }
 
 static void put_echo_reference(struct audio_device *adev,
                           struct echo_reference_itfe *reference)
 {
     ALOGV("%s: enter:)", __func__);
-    int32_t prev_generation = adev->echo_reference_generation;
-    struct stream_out *out = adev->primary_output;
 
     if (adev->echo_reference != NULL &&
             reference == adev->echo_reference) {
-        /* echo reference is taken from the low latency output stream used
-         * for voice use cases */
+        /* the output only writes to the ring, nothing else refers to the echo reference */
+        android_atomic_release_store(0, &adev->echo_ref_ring.active);
         adev->echo_reference = NULL;
-        android_atomic_inc(&adev->echo_reference_generation);
-        if (out != NULL && out->usecase == USECASE_AUDIO_PLAYBACK) {
-            // if the primary output is in standby or did not pick the echo reference yet
-            // we can safely get rid of it here.
-            // otherwise, out_write() or out_standby() will detect the change in echo reference
-            // generation and release the echo reference owned by the stream.
-            if ((out->echo_reference_generation != prev_generation) || out->standby)
-                release_echo_reference(reference);
-        } else {
-            release_echo_reference(reference);
-        }
+        release_echo_reference(reference);
         ALOGV("release_echo_reference");
     }
 }
@@ -1162,7 +2079,7 @@ static struct echo_reference_itfe *get_echo_reference(struct audio_device *adev,
     /* echo reference is taken from the low latency output stream used
      * for voice use cases */
     if (adev->primary_output!= NULL && adev->primary_output->usecase == USECASE_AUDIO_PLAYBACK &&
-            !adev->primary_output->standby) {
+            !adev->primary_output->standby && adev->echo_ref_ring.data != NULL) {
         struct audio_stream *stream =
                 &adev->primary_output->stream.common;
         uint32_t wr_channel_count = audio_channel_count_from_out_mask(stream->get_channels(stream));
@@ -1175,8 +2092,17 @@ static struct echo_reference_itfe *get_echo_reference(struct audio_device *adev,
                                            wr_channel_count,
                                            wr_sampling_rate,
                                            &adev->echo_reference);
-        if (status == 0)
-            android_atomic_inc(&adev->echo_reference_generation);
+        if (status == 0 && wr_channel_count <= ECHO_REF_MAX_CHANNELS) {
+            /* drop what the output may have left in the ring */
+            adev->echo_ref_ring.channels = wr_channel_count;
+            adev->echo_ref_ring.rate = wr_sampling_rate;
+            android_atomic_release_store(android_atomic_acquire_load(&adev->echo_ref_ring.wr),
+                                         &adev->echo_ref_ring.rd);
+            android_atomic_release_store(1, &adev->echo_ref_ring.active);
+        } else if (status == 0) {
+            release_echo_reference(adev->echo_reference);
+            adev->echo_reference = NULL;
+        }
     }
     return adev->echo_reference;
 }
@@ -1227,37 +2153,68 @@ static int get_hw_echo_reference(struct stream_in *in)
 }
 #endif
 
+/*
+ * The driver queue is read with pcm_get_htimestamp() every OUT_TIMING_REFRESH_PERIODS
+ * periods. In between, the queue duration is extrapolated from the frames written
+ * since and the time elapsed.
+ */
 static int get_playback_delay(struct stream_out *out,
                        size_t frames,
                        struct echo_reference_buffer *buffer)
 {
     unsigned int kernel_frames;
     int status;
-    int primary_pcm = 0;
     struct pcm_device *pcm_device;
+    struct timespec now;
+    int64_t queued_ns;
 
     pcm_device = node_to_item(list_head(&out->pcm_dev_list),
                               struct pcm_device, stream_list_node);
 
-    status = pcm_get_htimestamp(pcm_device->pcm, &kernel_frames, &buffer->time_stamp);
-    if (status < 0) {
-        buffer->time_stamp.tv_sec  = 0;
-        buffer->time_stamp.tv_nsec = 0;
-        buffer->delay_ns           = 0;
-        ALOGV("get_playback_delay(): pcm_get_htimestamp error,"
-                "setting playbackTimestamp to 0");
-        return status;
+    if (!out->timing_valid || out->timing_written - out->timing_anchor >=
+            (uint64_t)OUT_TIMING_REFRESH_PERIODS * out->config.period_size) {
+        status = pcm_get_htimestamp(pcm_device->pcm, &kernel_frames, &out->timing_ts);
+        if (status < 0) {
+            buffer->time_stamp.tv_sec  = 0;
+            buffer->time_stamp.tv_nsec = 0;
+            buffer->delay_ns           = 0;
+            out->timing_valid = false;
+            ALOGV("get_playback_delay(): pcm_get_htimestamp error,"
+                    "setting playbackTimestamp to 0");
+            return status;
+        }
+        kernel_frames = pcm_get_buffer_size(pcm_device->pcm) - kernel_frames;
+        /* the driver queue is at the PCM rate which differs from the stream rate on SCO */
+        out->timing_queued_ns = ((int64_t)kernel_frames * 1000000000) /
+                pcm_device->pcm_profile->config.rate;
+        out->timing_anchor = out->timing_written;
+        out->timing_valid = true;
+        out->timing_queries++;
+        buffer->time_stamp = out->timing_ts;
+        queued_ns = out->timing_queued_ns;
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        queued_ns = out->timing_queued_ns +
+                (int64_t)(out->timing_written - out->timing_anchor) * 1000000000 /
+                        out->sample_rate -
+                ((int64_t)(now.tv_sec - out->timing_ts.tv_sec) * 1000000000 +
+                        now.tv_nsec - out->timing_ts.tv_nsec);
+        if (queued_ns < 0) {
+            /* underrun: the model no longer holds */
+            queued_ns = 0;
+            out->timing_valid = false;
+        }
+        buffer->time_stamp = now;
+        out->timing_estimates++;
     }
 
-    kernel_frames = pcm_get_buffer_size(pcm_device->pcm) - kernel_frames;
-
     /* adjust render time stamp with delay added by current driver buffer.
      * Add the duration of current frame as we want the render time of the last
      * sample being written. */
-    buffer->delay_ns = (long)(((int64_t)(kernel_frames + frames)* 1000000000)/
-                            out->config.rate);
-    ALOGVV("get_playback_delay_time_stamp Secs: [%10ld], nSecs: [%9ld], kernel_frames: [%5u], delay_ns: [%d],",
-         buffer->time_stamp.tv_sec, buffer->time_stamp.tv_nsec, kernel_frames, buffer->delay_ns);
+    buffer->delay_ns = (long)(queued_ns + ((int64_t)frames * 1000000000) / out->sample_rate);
+    ALOGVV("get_playback_delay_time_stamp Secs: [%10ld], nSecs: [%9ld], queued_ns: [%lld], delay_ns: [%d],",
+         buffer->time_stamp.tv_sec, buffer->time_stamp.tv_nsec, (long long)queued_ns,
+         buffer->delay_ns);
 
     return 0;
 }
@@ -1556,6 +2513,84 @@ static void in_update_aux_channels(struct stream_in *in,
  * - process if pre-processors are attached
  * - discard unwanted channels
  */
+#ifdef PREPROCESSING_ENABLED
+/*
+ * Runs the preprocessors as a chain: each stage reads the previous stage output
+ * from one of the ping-pong buffers and the last stage writes to out_buf directly.
+ * A stage whose process() fails (e.g. -ENODATA from a library that processes the
+ * whole session in the last effect) forwards its input untouched to the next stage.
+ * On return in_buf->frameCount and out_buf->frameCount hold the frames consumed and
+ * produced by the whole chain.
+ */
+static int run_preprocessors(struct stream_in *in, audio_buffer_t *in_buf,
+                             audio_buffer_t *out_buf)
+{
+    audio_buffer_t stage_in = *in_buf;
+    audio_buffer_t stage_out;
+    struct effect_info_s *fx;
+    size_t offered;
+    size_t consumed = 0;
+    bool consumed_set = false;
+    int last = in->num_preprocessors - 1;
+    int cur = -1;           /* ping-pong buffer holding stage_in, -1 for in_buf */
+    int next = 0;
+    int i, ret;
+    int64_t start_ns;
+
+    for (i = 0; i <= last; i++) {
+        fx = &in->preprocessors[i];
+        offered = stage_in.frameCount;
+        stage_out.frameCount = out_buf->frameCount;
+        if (i == last) {
+            stage_out.s16 = out_buf->s16;
+        } else {
+            next = (cur == 0) ? 1 : 0;
+            stage_out.s16 = in->pipe_buf[next];
+        }
+
+        start_ns = get_time_ns();
+        ret = (*fx->effect_itfe)->process(fx->effect_itfe, &stage_in, &stage_out);
+        fx->process_ns += get_time_ns() - start_ns;
+        fx->calls++;
+
+        if (ret != 0) {
+            fx->deferred++;
+            stage_in.frameCount = offered;
+            continue;
+        }
+        fx->frames_in += stage_in.frameCount;
+        fx->frames_out += stage_out.frameCount;
+        if (!consumed_set) {
+            consumed = stage_in.frameCount;
+            consumed_set = true;
+        } else if (stage_in.frameCount < offered) {
+            /* stages have no carry over buffer, the rest of the input is lost */
+            fx->frames_dropped += offered - stage_in.frameCount;
+        }
+        stage_in.s16 = stage_out.s16;
+        stage_in.frameCount = stage_out.frameCount;
+        cur = (i == last) ? -1 : next;
+    }
+
+    if (!consumed_set) {
+        /* no stage processed anything: pass the input through as before */
+        consumed = in_buf->frameCount < out_buf->frameCount ?
+                in_buf->frameCount : out_buf->frameCount;
+        memcpy(out_buf->s16, in_buf->s16, consumed * in->config.channels * sizeof(int16_t));
+        in_buf->frameCount = consumed;
+        out_buf->frameCount = consumed;
+        return 0;
+    }
+    /* only needed when the last stage deferred its processing */
+    if (stage_in.s16 != out_buf->s16)
+        memcpy(out_buf->s16, stage_in.s16,
+               stage_in.frameCount * in->config.channels * sizeof(int16_t));
+    in_buf->frameCount = consumed;
+    out_buf->frameCount = stage_in.frameCount;
+    return 0;
+}
+#endif
+
 static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize_t frames)
 {
     ssize_t frames_wr = 0;
@@ -1593,67 +2628,71 @@ static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize
     if (has_processing) {
         /* since all the processing below is done in frames and using the config.channels
          * as the number of channels, no changes is required in case aux_channels are present */
+
+        /* intermediate buffers for chained effects */
+        if (in->num_preprocessors > 1 && in->pipe_buf_size < (size_t)frames) {
+            size_t size_in_bytes = frames * in->config.channels * sizeof(int16_t);
+            in->pipe_buf_size = (size_t)frames;
+            for (i = 0; i < 2; i++) {
+                in->pipe_buf[i] = (int16_t *)realloc(in->pipe_buf[i], size_in_bytes);
+                ALOG_ASSERT((in->pipe_buf[i] != NULL),
+                            "process_frames() failed to reallocate pipe_buf");
+            }
+        }
         while (frames_wr < frames) {
             /* first reload enough frames at the end of process input buffer */
-            if (in->proc_buf_frames < (size_t)frames) {
-                ssize_t frames_rd;
-                if (in->proc_buf_size < (size_t)frames) {
+            if (in->proc_ring.frames < (size_t)frames) {
+                ssize_t frames_rd = 0;
+                int16_t *view;
+                size_t count;
+
+                frame_ring_reserve(&in->proc_ring, frames, in->config.channels);
+                if (has_additional_channels && in->proc_buf_size < (size_t)frames) {
                     size_t size_in_bytes = pcm_frames_to_bytes(pcm_device->pcm, frames);
                     in->proc_buf_size = (size_t)frames;
-                    in->proc_buf_in = (int16_t *)realloc(in->proc_buf_in, size_in_bytes);
-                    ALOG_ASSERT((in->proc_buf_in != NULL),
-                                "process_frames() failed to reallocate proc_buf_in");
-                    if (has_additional_channels) {
-                        in->proc_buf_out = (int16_t *)realloc(in->proc_buf_out, size_in_bytes);
-                        ALOG_ASSERT((in->proc_buf_out != NULL),
-                                    "process_frames() failed to reallocate proc_buf_out");
-                        proc_buf_out = in->proc_buf_out;
-                    }
+                    in->proc_buf_out = (int16_t *)realloc(in->proc_buf_out, size_in_bytes);
+                    ALOG_ASSERT((in->proc_buf_out != NULL),
+                                "process_frames() failed to reallocate proc_buf_out");
+                    proc_buf_out = in->proc_buf_out;
                 }
-                frames_rd = read_frames(in,
-                                        in->proc_buf_in +
-                                            in->proc_buf_frames * in->config.channels,
-                                        frames - in->proc_buf_frames);
-                  if (frames_rd < 0) {
+                /* the free space may wrap around the end of the ring */
+                while (in->proc_ring.frames < (size_t)frames) {
+                    view = frame_ring_write_view(&in->proc_ring, &count);
+                    if (count > frames - in->proc_ring.frames)
+                        count = frames - in->proc_ring.frames;
+                    frames_rd = read_frames(in, view, count);
+                    if (frames_rd <= 0)
+                        break;
+                    frame_ring_commit(&in->proc_ring, frames_rd);
+                }
+                if (frames_rd < 0) {
                     /* Return error code */
                     frames_wr = frames_rd;
                     break;
                 }
-                in->proc_buf_frames += frames_rd;
             }
 
             if (in->echo_reference != NULL) {
-                push_echo_reference(in, in->proc_buf_frames);
+                push_echo_reference(in, in->proc_ring.frames);
             }
 
              /* in_buf.frameCount and out_buf.frameCount indicate respectively
-              * the maximum number of frames to be consumed and produced by process() */
-            in_buf.frameCount = in->proc_buf_frames;
-            in_buf.s16 = in->proc_buf_in;
+              * the maximum number of frames to be consumed and produced by process().
+              * The input is the oldest contiguous part of in->proc_ring */
+            in_buf.s16 = frame_ring_read_view(&in->proc_ring, &in_buf.frameCount);
             out_buf.frameCount = frames - frames_wr;
             out_buf.s16 = (int16_t *)proc_buf_out + frames_wr * in->config.channels;
 
-            /* FIXME: this works because of current pre processing library implementation that
-             * does the actual process only when the last enabled effect process is called.
-             * The generic solution is to have an output buffer for each effect and pass it as
-             * input to the next.
-             */
-            for (i = 0; i < in->num_preprocessors; i++) {
-                (*in->preprocessors[i].effect_itfe)->process(in->preprocessors[i].effect_itfe,
-                                                   &in_buf,
-                                                   &out_buf);
-            }
+            run_preprocessors(in, &in_buf, &out_buf);
 
-            /* process() has updated the number of frames consumed and produced in
-             * in_buf.frameCount and out_buf.frameCount respectively
-             * move remaining frames to the beginning of in->proc_buf_in */
-            in->proc_buf_frames -= in_buf.frameCount;
+            pcm_tap_write(in->dev, PCM_TAP_PRE_PROCESSING, in_buf.s16, in_buf.frameCount,
+                          in->config.channels, in->requested_rate);
+            pcm_tap_write(in->dev, PCM_TAP_POST_PROCESSING, out_buf.s16, out_buf.frameCount,
+                          in->config.channels, in->requested_rate);
 
-            if (in->proc_buf_frames) {
-                memcpy(in->proc_buf_in,
-                       in->proc_buf_in + in_buf.frameCount * in->config.channels,
-                       in->proc_buf_frames * in->config.channels * sizeof(int16_t));
-            }
+            /* the pipeline has updated the number of frames consumed and produced in
+             * in_buf.frameCount and out_buf.frameCount respectively */
+            frame_ring_consume(&in->proc_ring, in_buf.frameCount);
 
             /* if not enough frames were passed to process(), read more and retry. */
             if (out_buf.frameCount == 0) {
@@ -1719,6 +2758,74 @@ static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize
     return frames_wr;
 }
 
+/*
+ * Maps up to one period of captured frames from the DMA buffer into
+ * in->mmap_buf so that they are consumed in place by get_next_buffer() users.
+ * release_buffer() commits them back to the driver. Records the capture time
+ * of the first mapped frame in in->capture_time_ns.
+ */
+static int in_mmap_begin(struct stream_in *in, struct pcm_device *pcm_device)
+{
+    struct pcm *pcm = pcm_device->pcm;
+    const struct pcm_config *config = &pcm_device->pcm_profile->config;
+    unsigned int frames = config->period_size;
+    int wait_ms = config->period_size * 1000 / config->rate / 2;
+    unsigned int offset, hw_ptr;
+    struct timespec ts;
+    void *area;
+    int avail;
+    int ret;
+
+    if (wait_ms < 1)
+        wait_ms = 1;
+
+    if (!pcm_device->mmap_started) {
+        ret = pcm_start(pcm);
+        if (ret < 0)
+            return ret;
+        pcm_device->mmap_started = true;
+    }
+
+    for (;;) {
+        avail = pcm_mmap_avail(pcm);
+        if (avail < 0)
+            return avail;
+        if ((unsigned int)avail > pcm_get_buffer_size(pcm)) {
+            /* overrun: restart capture, the lost frames are counted by in_read() */
+            ALOGV("%s: overrun, restarting", __func__);
+            ret = pcm_prepare(pcm);
+            if (ret == 0)
+                ret = pcm_start(pcm);
+            if (ret < 0)
+                return ret;
+            continue;
+        }
+        if ((unsigned int)avail >= frames)
+            break;
+        ret = pcm_wait(pcm, wait_ms);
+        if (ret == -EPIPE) {
+            /* xrun reported before the pointers show it: recover the same way */
+            ALOGV("%s: xrun, restarting", __func__);
+            ret = pcm_prepare(pcm);
+            if (ret == 0)
+                ret = pcm_start(pcm);
+        }
+        if (ret < 0)
+            return ret;
+    }
+
+    ret = pcm_mmap_begin(pcm, &area, &offset, &frames);
+    if (ret < 0)
+        return ret;
+    in->mmap_buf = (int16_t *)((uint8_t *)area + pcm_frames_to_bytes(pcm, offset));
+    in->mmap_frames = frames;
+
+    if (pcm_mmap_get_hw_ptr(pcm, &hw_ptr, &ts) == 0)
+        in->capture_time_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec -
+                              (int64_t)avail * 1000000000LL / config->rate;
+    return 0;
+}
+
 static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
                                    struct resampler_buffer* buffer)
 {
@@ -1742,15 +2849,19 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
                               struct pcm_device, stream_list_node);
 
     if (in->read_buf_frames == 0) {
-        size_t size_in_bytes = pcm_frames_to_bytes(pcm_device->pcm, in->config.period_size);
-        if (in->read_buf_size < in->config.period_size) {
-            in->read_buf_size = in->config.period_size;
-            in->read_buf = (int16_t *) realloc(in->read_buf, size_in_bytes);
-            ALOG_ASSERT((in->read_buf != NULL),
-                        "get_next_buffer() failed to reallocate read_buf");
-        }
+        if (pcm_device->mmap) {
+            in->read_status = in_mmap_begin(in, pcm_device);
+        } else {
+            size_t size_in_bytes = pcm_frames_to_bytes(pcm_device->pcm, in->config.period_size);
+            if (in->read_buf_size < in->config.period_size) {
+                in->read_buf_size = in->config.period_size;
+                in->read_buf = (int16_t *) realloc(in->read_buf, size_in_bytes);
+                ALOG_ASSERT((in->read_buf != NULL),
+                            "get_next_buffer() failed to reallocate read_buf");
+            }
 
-        in->read_status = pcm_read(pcm_device->pcm, (void*)in->read_buf, size_in_bytes);
+            in->read_status = pcm_read(pcm_device->pcm, (void*)in->read_buf, size_in_bytes);
+        }
 
         if (in->read_status != 0) {
             ALOGE("get_next_buffer() pcm_read error %d", in->read_status);
@@ -1758,7 +2869,10 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
             buffer->frame_count = 0;
             return in->read_status;
         }
-        in->read_buf_frames = in->config.period_size;
+        in->read_buf_frames = pcm_device->mmap ? in->mmap_frames : in->config.period_size;
+        pcm_tap_write(in->dev, PCM_TAP_PRE_RESAMPLER,
+                      pcm_device->mmap ? (int16_t *)in->mmap_buf : in->read_buf,
+                      in->read_buf_frames, in->config.channels, in->config.rate);
 
 #ifdef PREPROCESSING_ENABLED
 #ifdef HW_AEC_LOOPBACK
@@ -1814,7 +2928,11 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
 
     buffer->frame_count = (buffer->frame_count > in->read_buf_frames) ?
                                 in->read_buf_frames : buffer->frame_count;
-    buffer->i16 = in->read_buf + (in->config.period_size - in->read_buf_frames) *
+    if (pcm_device->mmap)
+        buffer->i16 = in->mmap_buf + (in->mmap_frames - in->read_buf_frames) *
+                                                pcm_device->pcm_profile->config.channels;
+    else
+        buffer->i16 = in->read_buf + (in->config.period_size - in->read_buf_frames) *
                                                 in->config.channels;
     return in->read_status;
 }
@@ -1831,6 +2949,14 @@ static void release_buffer(struct resampler_buffer_provider *buffer_provider,
                                    offsetof(struct stream_in, buf_provider));
 
     in->read_buf_frames -= buffer->frame_count;
+    if (in->mmap_buf != NULL && buffer->frame_count > 0 && !list_empty(&in->pcm_dev_list)) {
+        struct pcm_device *pcm_device = node_to_item(list_head(&in->pcm_dev_list),
+                                                     struct pcm_device, stream_list_node);
+        /* hand the consumed frames back to the driver */
+        pcm_mmap_commit(pcm_device->pcm, 0, buffer->frame_count);
+        if (in->read_buf_frames == 0)
+            in->mmap_buf = NULL;
+    }
 }
 
 /* read_frames() reads frames from kernel driver, down samples to capture rate
@@ -1880,6 +3006,8 @@ static ssize_t read_frames(struct stream_in *in, void *buffer, ssize_t frames)
 
         frames_wr += frames_rd;
     }
+    pcm_tap_write(in->dev, PCM_TAP_POST_RESAMPLER, (int16_t *)buffer, frames_wr,
+                  in->config.channels, in->requested_rate);
     return frames_wr;
 }
 
@@ -1938,6 +3066,100 @@ static int stop_input_stream(struct stream_in *in)
     return 0;
 }
 
+/*
+ * Opens the PCM of a pcm_device with the profile config. Profiles flagged for
+ * mmap are tried with PCM_MMAP|PCM_NOIRQ first and fall back to read/write
+ * mode if the driver refuses. pcm_device->mmap tells which mode was used.
+ */
+/*
+ * Opens the PCM of pcm_device with config. mmap is only attempted with the
+ * profile's own config, the one the mmap read and write paths are tuned for.
+ */
+static struct pcm *pcm_device_open(struct pcm_device *pcm_device,
+                                   const struct pcm_config *config, unsigned int flags)
+{
+    struct pcm_device_profile *profile = pcm_device->pcm_profile;
+    struct pcm *pcm;
+
+    pcm_device->mmap = false;
+    pcm_device->mmap_started = false;
+    pcm_device->mmap_appl = 0;
+    if (profile->mmap && config == &profile->config) {
+        pcm = pcm_open(profile->card, profile->id, flags | PCM_MMAP | PCM_NOIRQ,
+                       &profile->config);
+        if (pcm && pcm_is_ready(pcm)) {
+            pcm_device->mmap = true;
+            return pcm;
+        }
+        ALOGW("%s: mmap not supported on card_id(%d) device_id(%d): %s", __func__,
+              profile->card, profile->id, pcm ? pcm_get_error(pcm) : "");
+        if (pcm)
+            pcm_close(pcm);
+    }
+    return pcm_open(profile->card, profile->id, flags, (struct pcm_config *)config);
+}
+
+/*
+ * The visualizer and sound trigger libraries are optional and only needed for
+ * offloaded playback and hotword capture: they are loaded on first use rather
+ * than in adev_open(). Called with adev->lock held.
+ */
+static void load_offload_fx_lib(struct audio_device *adev)
+{
+    if (adev->offload_fx_lib_loaded)
+        return;
+    adev->offload_fx_lib_loaded = true;
+
+    if (access(OFFLOAD_FX_LIBRARY_PATH, R_OK) == 0) {
+        adev->offload_fx_lib = dlopen(OFFLOAD_FX_LIBRARY_PATH, RTLD_NOW);
+        if (adev->offload_fx_lib == NULL) {
+            ALOGE("%s: DLOPEN failed for %s", __func__, OFFLOAD_FX_LIBRARY_PATH);
+        } else {
+            ALOGV("%s: DLOPEN successful for %s", __func__, OFFLOAD_FX_LIBRARY_PATH);
+            adev->offload_fx_start_output =
+                        (int (*)(audio_io_handle_t))dlsym(adev->offload_fx_lib,
+                                                        "visualizer_hal_start_output");
+            adev->offload_fx_stop_output =
+                        (int (*)(audio_io_handle_t))dlsym(adev->offload_fx_lib,
+                                                        "visualizer_hal_stop_output");
+        }
+    }
+}
+
+static void load_sound_trigger_lib(struct audio_device *adev)
+{
+    if (adev->sound_trigger_lib_loaded)
+        return;
+    adev->sound_trigger_lib_loaded = true;
+
+    if (access(SOUND_TRIGGER_HAL_LIBRARY_PATH, R_OK) == 0) {
+        adev->sound_trigger_lib = dlopen(SOUND_TRIGGER_HAL_LIBRARY_PATH, RTLD_NOW);
+        if (adev->sound_trigger_lib == NULL) {
+            ALOGE("%s: DLOPEN failed for %s", __func__, SOUND_TRIGGER_HAL_LIBRARY_PATH);
+        } else {
+            ALOGV("%s: DLOPEN successful for %s", __func__, SOUND_TRIGGER_HAL_LIBRARY_PATH);
+            adev->sound_trigger_open_for_streaming =
+                        (int (*)(void))dlsym(adev->sound_trigger_lib,
+                                                        "sound_trigger_open_for_streaming");
+            adev->sound_trigger_read_samples =
+                        (size_t (*)(int, void *, size_t))dlsym(adev->sound_trigger_lib,
+                                                        "sound_trigger_read_samples");
+            adev->sound_trigger_close_for_streaming =
+                        (int (*)(int))dlsym(adev->sound_trigger_lib,
+                                                        "sound_trigger_close_for_streaming");
+            if (!adev->sound_trigger_open_for_streaming ||
+                !adev->sound_trigger_read_samples ||
+                !adev->sound_trigger_close_for_streaming) {
+
+                ALOGE("%s: Error grabbing functions in %s", __func__, SOUND_TRIGGER_HAL_LIBRARY_PATH);
+                adev->sound_trigger_open_for_streaming = 0;
+                adev->sound_trigger_read_samples = 0;
+                adev->sound_trigger_close_for_streaming = 0;
+            }
+        }
+    }
+}
+
 static int start_input_stream(struct stream_in *in)
 {
     /* Enable output device and stream routing controls */
@@ -2046,6 +3268,7 @@ static int start_input_stream(struct stream_in *in)
           pcm_device->pcm_profile->config.format, pcm_device->pcm_profile->config.period_size);
 
     if (pcm_profile->type == PCM_HOTWORD_STREAMING) {
+        load_sound_trigger_lib(adev);
         if (!adev->sound_trigger_open_for_streaming) {
             ALOGE("%s: No handle to sound trigger HAL", __func__);
             ret = -EIO;
@@ -2061,8 +3284,8 @@ static int start_input_stream(struct stream_in *in)
         ALOGV("Opened DSP successfully");
     } else {
         pcm_device->sound_trigger_handle = 0;
-        pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card, pcm_device->pcm_profile->id,
-                                   PCM_IN | PCM_MONOTONIC, &pcm_device->pcm_profile->config);
+        pcm_device->pcm = pcm_device_open(pcm_device, &pcm_device->pcm_profile->config,
+                                          PCM_IN | PCM_MONOTONIC);
 
         if (pcm_device->pcm && !pcm_is_ready(pcm_device->pcm)) {
             ALOGE("%s: %s", __func__, pcm_get_error(pcm_device->pcm));
@@ -2075,10 +3298,16 @@ static int start_input_stream(struct stream_in *in)
 
     /* force read and proc buffer reallocation in case of frame size or
      * channel count change */
-    in->proc_buf_frames = 0;
+#ifdef PREPROCESSING_ENABLED
+    frame_ring_reset(&in->proc_ring);
+    in->pipe_buf_size = 0;
+#endif
     in->proc_buf_size = 0;
     in->read_buf_size = 0;
     in->read_buf_frames = 0;
+    in->mmap_buf = NULL;
+    in->mmap_frames = 0;
+    in->capture_time_ns = 0;
 
     /* if no supported sample rate is available, use the resampler */
     if (in->resampler) {
@@ -2119,12 +3348,41 @@ void lock_output_stream(struct stream_out *out)
 /* must be called with out->lock locked */
 static int send_offload_cmd_l(struct stream_out* out, int command)
 {
-    struct offload_cmd *cmd = (struct offload_cmd *)calloc(1, sizeof(struct offload_cmd));
+    struct offload_cmd *cmd;
+    unsigned int i;
 
     ALOGVV("%s %d", __func__, command);
 
+    /* a queued wait for buffer already covers this one, wherever it is */
+    if (command == OFFLOAD_CMD_WAIT_FOR_BUFFER) {
+        for (i = 0; i < out->offload_cmd_pending; i++) {
+            if (out->offload_cmd_ring[(out->offload_cmd_rd + i) % OFFLOAD_CMD_RING_SIZE].cmd ==
+                    OFFLOAD_CMD_WAIT_FOR_BUFFER) {
+                out->offload_cmd_coalesced++;
+                return 0;
+            }
+        }
+    }
+    if (out->offload_cmd_pending == OFFLOAD_CMD_RING_SIZE && command == OFFLOAD_CMD_EXIT) {
+        /* the thread is going away, pending commands would not be serviced anyway */
+        out->offload_cmd_dropped += out->offload_cmd_pending;
+        out->offload_cmd_pending = 0;
+    }
+    /*
+     * Every other command gets a callback that AudioFlinger waits for: never drop
+     * one, wait for the offload thread to complete a command instead.
+     */
+    while (out->offload_cmd_pending == OFFLOAD_CMD_RING_SIZE) {
+        ALOGW("%s: command ring full, waiting to queue command %d", __func__, command);
+        pthread_cond_wait(&out->cond, &out->lock);
+    }
+
+    cmd = &out->offload_cmd_ring[(out->offload_cmd_rd + out->offload_cmd_pending) %
+                                 OFFLOAD_CMD_RING_SIZE];
     cmd->cmd = command;
-    list_add_tail(&out->offload_cmd_list, &cmd->node);
+    cmd->post_ns = get_time_ns();
+    out->offload_cmd_pending++;
+    out->offload_cmd_total++;
     pthread_cond_signal(&out->offload_cond);
     return 0;
 }
@@ -2141,41 +3399,53 @@ static void stop_compressed_output_l(struct stream_out *out)
     }
 }
 
+static void update_offload_cmd_stats_l(struct stream_out *out, int64_t dispatch_ns,
+                                       int64_t latency_ns, bool callback)
+{
+    if (dispatch_ns > out->offload_dispatch_max_ns)
+        out->offload_dispatch_max_ns = dispatch_ns;
+    if (!callback)
+        return;
+    out->offload_cb_count++;
+    out->offload_cb_latency_sum_ns += latency_ns;
+    if (latency_ns > out->offload_cb_latency_max_ns)
+        out->offload_cb_latency_max_ns = latency_ns;
+}
+
 static void *offload_thread_loop(void *context)
 {
     struct stream_out *out = (struct stream_out *) context;
-    struct listnode *item;
 
-    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_AUDIO);
-    set_sched_policy(0, SP_FOREGROUND);
+    thread_policy_apply(out->dev, THREAD_ROLE_OFFLOAD_CALLBACK);
     prctl(PR_SET_NAME, (unsigned long)"Offload Callback", 0, 0, 0);
 
     ALOGV("%s", __func__);
     lock_output_stream(out);
     for (;;) {
-        struct offload_cmd *cmd = NULL;
+        struct offload_cmd cmd;
         stream_callback_event_t event;
         bool send_callback = false;
+        int64_t dispatch_ns;
 
-        ALOGVV("%s offload_cmd_list %d out->offload_state %d",
-              __func__, list_empty(&out->offload_cmd_list),
+        ALOGVV("%s offload_cmd_pending %u out->offload_state %d",
+              __func__, out->offload_cmd_pending,
               out->offload_state);
-        if (list_empty(&out->offload_cmd_list)) {
+        if (out->offload_cmd_pending == 0) {
             ALOGV("%s SLEEPING", __func__);
             pthread_cond_wait(&out->offload_cond, &out->lock);
             ALOGV("%s RUNNING", __func__);
             continue;
         }
 
-        item = list_head(&out->offload_cmd_list);
-        cmd = node_to_item(item, struct offload_cmd, node);
-        list_remove(item);
+        cmd = out->offload_cmd_ring[out->offload_cmd_rd];
+        out->offload_cmd_rd = (out->offload_cmd_rd + 1) % OFFLOAD_CMD_RING_SIZE;
+        out->offload_cmd_pending--;
+        dispatch_ns = get_time_ns() - cmd.post_ns;
 
         ALOGVV("%s STATE %d CMD %d out->compr %p",
-               __func__, out->offload_state, cmd->cmd, out->compr);
+               __func__, out->offload_state, cmd.cmd, out->compr);
 
-        if (cmd->cmd == OFFLOAD_CMD_EXIT) {
-            free(cmd);
+        if (cmd.cmd == OFFLOAD_CMD_EXIT) {
             break;
         }
 
@@ -2187,7 +3457,7 @@ static void *offload_thread_loop(void *context)
         out->offload_thread_blocked = true;
         pthread_mutex_unlock(&out->lock);
         send_callback = false;
-        switch(cmd->cmd) {
+        switch(cmd.cmd) {
         case OFFLOAD_CMD_WAIT_FOR_BUFFER:
             compress_wait(out->compr, -1);
             send_callback = true;
@@ -2205,33 +3475,146 @@ static void *offload_thread_loop(void *context)
             event = STREAM_CBK_EVENT_DRAIN_READY;
             break;
         default:
-            ALOGE("%s unknown command received: %d", __func__, cmd->cmd);
+            ALOGE("%s unknown command received: %d", __func__, cmd.cmd);
             break;
         }
         lock_output_stream(out);
         out->offload_thread_blocked = false;
         pthread_cond_signal(&out->cond);
+        update_offload_cmd_stats_l(out, dispatch_ns, get_time_ns() - cmd.post_ns,
+                                   send_callback);
         if (send_callback) {
             out->offload_callback(event, NULL, out->offload_cookie);
         }
-        free(cmd);
     }
 
     pthread_cond_signal(&out->cond);
-    while (!list_empty(&out->offload_cmd_list)) {
-        item = list_head(&out->offload_cmd_list);
-        list_remove(item);
-        free(node_to_item(item, struct offload_cmd, node));
-    }
+    out->offload_cmd_pending = 0;
     pthread_mutex_unlock(&out->lock);
 
     return NULL;
 }
 
+static void update_offload_wakeups_l(struct stream_out *out)
+{
+    int64_t now_ns = get_time_ns();
+
+    if (out->offload_wakeup_window_ns == 0)
+        out->offload_wakeup_window_ns = now_ns;
+    if (now_ns - out->offload_wakeup_window_ns >= 60 * 1000000000LL) {
+        out->offload_wakeups_per_min = out->offload_wakeups;
+        out->offload_wakeups = 0;
+        out->offload_wakeup_window_ns = now_ns;
+    }
+    out->offload_wakeups++;
+}
+
+static void offload_volume_apply(struct stream_out *out, const int *volume)
+{
+    struct mixer_ctl *ctl = adev_get_mixer_ctl(out->dev, MIXER_CARD,
+                                               MIXER_CTL_ID_COMPRESS_PLAYBACK_VOLUME);
+    int values[2];
+
+    if (ctl == NULL)
+        return;
+    values[0] = volume[0];
+    values[1] = volume[1];
+    mixer_ctl_set_array(ctl, values, ARRAY_SIZE(values));
+    android_atomic_inc(&out->dev->mixer_ops);
+}
+
+/*
+ * Moves the compress volume to volume_target in COMPRESS_VOLUME_RAMP_MS, one
+ * mixer write every COMPRESS_VOLUME_STEP_MS at most. A new target restarts the
+ * ramp from the volume last applied, so volume animations from the framework are
+ * coalesced instead of producing one mixer write per call.
+ */
+static void *offload_volume_thread(void *context)
+{
+    struct stream_out *out = (struct stream_out *)context;
+    int64_t elapsed_ns, ramp_ns = COMPRESS_VOLUME_RAMP_MS * 1000000LL;
+    int volume[2];
+    struct timespec ts;
+    int i;
+
+    thread_policy_apply(out->dev, THREAD_ROLE_OFFLOAD_VOLUME);
+    prctl(PR_SET_NAME, (unsigned long)"Offload Volume", 0, 0, 0);
+
+    pthread_mutex_lock(&out->volume_lock);
+    while (!out->volume_thread_exit) {
+        if (!out->volume_ramp_active) {
+            pthread_cond_wait(&out->volume_cond, &out->volume_lock);
+            continue;
+        }
+        elapsed_ns = get_time_ns() - out->volume_ramp_start_ns;
+        for (i = 0; i < 2; i++) {
+            if (elapsed_ns >= ramp_ns)
+                volume[i] = out->volume_target[i];
+            else
+                volume[i] = out->volume_start[i] + (int)((int64_t)(out->volume_target[i] -
+                            out->volume_start[i]) * elapsed_ns / ramp_ns);
+        }
+        if (elapsed_ns >= ramp_ns)
+            out->volume_ramp_active = false;
+
+        if (volume[0] != out->volume_current[0] || volume[1] != out->volume_current[1]) {
+            out->volume_current[0] = volume[0];
+            out->volume_current[1] = volume[1];
+            pthread_mutex_unlock(&out->volume_lock);
+            offload_volume_apply(out, volume);
+            pthread_mutex_lock(&out->volume_lock);
+        }
+        if (out->volume_ramp_active) {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_nsec += COMPRESS_VOLUME_STEP_MS * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_nsec -= 1000000000;
+                ts.tv_sec++;
+            }
+            pthread_cond_timedwait(&out->volume_cond, &out->volume_lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&out->volume_lock);
+    return NULL;
+}
+
+static void offload_volume_set(struct stream_out *out, int left, int right)
+{
+    pthread_mutex_lock(&out->volume_lock);
+    if (!out->volume_valid) {
+        /* nothing playing at a known volume yet: no ramp */
+        out->volume_valid = true;
+        out->volume_current[0] = out->volume_target[0] = left;
+        out->volume_current[1] = out->volume_target[1] = right;
+        offload_volume_apply(out, out->volume_current);
+    } else if (left != out->volume_target[0] || right != out->volume_target[1]) {
+        out->volume_start[0] = out->volume_current[0];
+        out->volume_start[1] = out->volume_current[1];
+        out->volume_target[0] = left;
+        out->volume_target[1] = right;
+        out->volume_ramp_start_ns = get_time_ns();
+        out->volume_ramp_active = true;
+        pthread_cond_signal(&out->volume_cond);
+    }
+    pthread_mutex_unlock(&out->volume_lock);
+}
+
 static int create_offload_callback_thread(struct stream_out *out)
 {
+    pthread_condattr_t attr;
+
     pthread_cond_init(&out->offload_cond, (const pthread_condattr_t *) NULL);
-    list_init(&out->offload_cmd_list);
+    pthread_mutex_init(&out->volume_lock, (const pthread_mutexattr_t *) NULL);
+    /* ramp steps are timed on CLOCK_MONOTONIC */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&out->volume_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    out->volume_thread_exit = false;
+    pthread_create(&out->volume_thread, (const pthread_attr_t *) NULL,
+                    offload_volume_thread, out);
+    out->offload_cmd_rd = 0;
+    out->offload_cmd_pending = 0;
     pthread_create(&out->offload_thread, (const pthread_attr_t *) NULL,
                     offload_thread_loop, out);
     return 0;
@@ -2246,6 +3629,14 @@ static int destroy_offload_callback_thread(struct stream_out *out)
     pthread_join(out->offload_thread, (void **) NULL);
     pthread_cond_destroy(&out->offload_cond);
 
+    pthread_mutex_lock(&out->volume_lock);
+    out->volume_thread_exit = true;
+    pthread_cond_signal(&out->volume_cond);
+    pthread_mutex_unlock(&out->volume_lock);
+    pthread_join(out->volume_thread, (void **) NULL);
+    pthread_cond_destroy(&out->volume_cond);
+    pthread_mutex_destroy(&out->volume_lock);
+
     return 0;
 }
 
@@ -2293,21 +3684,165 @@ static int uc_select_pcm_devices(struct audio_usecase *usecase)
     return 0;
 }
 
-static int out_close_pcm_devices(struct stream_out *out)
+/* Only changes the profiles: the new rate is used next time SCO is opened */
+static void sco_set_rate(struct audio_device *adev, bool wbs)
 {
-    struct pcm_device *pcm_device;
-    struct listnode *node;
-    struct audio_device *adev = out->dev;
+    unsigned int rate = wbs ? SCO_WB_SAMPLING_RATE : SCO_DEFAULT_SAMPLING_RATE;
+    unsigned int scale = rate / SCO_DEFAULT_SAMPLING_RATE;
 
-    list_for_each(node, &out->pcm_dev_list) {
-        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
-        if (pcm_device->sound_trigger_handle > 0) {
-            adev->sound_trigger_close_for_streaming(pcm_device->sound_trigger_handle);
-            pcm_device->sound_trigger_handle = 0;
+    if (adev->bluetooth_wbs == wbs)
+        return;
+    ALOGV("%s: SCO rate %u", __func__, rate);
+    adev->bluetooth_wbs = wbs;
+    pcm_device_playback_sco.config.rate = rate;
+    pcm_device_playback_sco.config.period_size = SCO_PERIOD_SIZE * scale;
+    pcm_device_playback_sco.config.start_threshold = SCO_START_THRESHOLD * scale;
+    pcm_device_playback_sco.config.stop_threshold = SCO_STOP_THRESHOLD * scale;
+    pcm_device_capture_sco.config.rate = rate;
+    pcm_device_capture_sco.config.period_size = SCO_PERIOD_SIZE * scale;
+}
+
+static void sco_decimator_release(struct sco_decimator *d)
+{
+    if (d == NULL)
+        return;
+    if (d->frames_in > 0)
+        ALOGV("%s: ratio %u, %lld frames in %lld us", __func__, d->ratio,
+              (long long)d->frames_in, (long long)(d->process_ns / 1000));
+    free(d->coefs);
+    free(d->hist);
+    free(d->out);
+    free(d);
+}
+
+static int sco_decimator_alloc(struct sco_decimator *d, size_t max_frames)
+{
+    int16_t *hist = (int16_t *)realloc(d->hist, (d->taps + max_frames) * sizeof(int16_t));
+    int16_t *out;
+
+    if (hist == NULL)
+        return -ENOMEM;
+    d->hist = hist;
+    out = (int16_t *)realloc(d->out, (max_frames / d->ratio + 1) * sizeof(int16_t));
+    if (out == NULL)
+        return -ENOMEM;
+    d->out = out;
+    d->max_frames = max_frames;
+    return 0;
+}
+
+static struct sco_decimator *sco_decimator_create(unsigned int ratio, unsigned int channels,
+                                                  size_t max_frames)
+{
+    struct sco_decimator *d = (struct sco_decimator *)calloc(1, sizeof(struct sco_decimator));
+    /* cut off at 90% of the output Nyquist frequency */
+    double fc = 0.45 / ratio, x, w, sum = 0;
+    double *h;
+    unsigned int i;
+
+    if (d == NULL)
+        return NULL;
+    d->ratio = ratio;
+    d->channels = channels;
+    d->taps = SCO_DECIMATOR_TAPS_PER_PHASE * ratio;
+    d->coefs = (int16_t *)malloc(d->taps * sizeof(int16_t));
+    h = (double *)malloc(d->taps * sizeof(double));
+    if (d->coefs == NULL || h == NULL || sco_decimator_alloc(d, max_frames) != 0) {
+        free(h);
+        sco_decimator_release(d);
+        return NULL;
+    }
+
+    /* Blackman windowed sinc, normalized for unity gain at DC */
+    for (i = 0; i < d->taps; i++) {
+        x = i - (d->taps - 1) / 2.0;
+        w = 0.42 - 0.5 * cos(2 * M_PI * i / (d->taps - 1)) +
+                0.08 * cos(4 * M_PI * i / (d->taps - 1));
+        h[i] = (x == 0 ? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x)) * w;
+        sum += h[i];
+    }
+    for (i = 0; i < d->taps; i++)
+        d->coefs[i] = (int16_t)lrint(h[i] / sum * 32767);
+    free(h);
+
+    /* start with a full filter of silence so that the first call produces output */
+    d->hist_frames = d->taps - 1;
+    memset(d->hist, 0, d->hist_frames * sizeof(int16_t));
+    return d;
+}
+
+static void fold_to_mono(int16_t *dst, const int16_t *src, size_t frames,
+                         unsigned int channels)
+{
+    size_t i;
+    unsigned int c;
+    int32_t acc;
+
+    if (channels == 2) {
+        for (i = 0; i < frames; i++)
+            dst[i] = (int16_t)(((int32_t)src[2 * i] + src[2 * i + 1]) >> 1);
+    } else {
+        for (i = 0; i < frames; i++) {
+            for (acc = 0, c = 0; c < channels; c++)
+                acc += src[i * channels + c];
+            dst[i] = (int16_t)(acc / (int32_t)channels);
         }
-        if (pcm_device->pcm) {
-            pcm_close(pcm_device->pcm);
-            pcm_device->pcm = NULL;
+    }
+}
+
+/* Returns the number of mono frames written to d->out */
+static size_t sco_decimate(struct sco_decimator *d, const int16_t *in, size_t frames)
+{
+    int64_t start_ns = get_time_ns();
+    int16_t *hist;
+    size_t k, out_frames;
+    unsigned int j;
+    int32_t acc;
+
+    if (frames > d->max_frames && sco_decimator_alloc(d, frames) != 0) {
+        ALOGE("%s: cannot grow buffers to %zu frames", __func__, frames);
+        return 0;
+    }
+
+    fold_to_mono(d->hist + d->hist_frames, in, frames, d->channels);
+    d->hist_frames += frames;
+
+    if (d->hist_frames < d->taps) {
+        out_frames = 0;
+    } else {
+        out_frames = (d->hist_frames - d->taps) / d->ratio + 1;
+        for (k = 0; k < out_frames; k++) {
+            hist = d->hist + k * d->ratio;
+            /* coefficients sum to unity so the accumulator cannot overflow */
+            for (acc = 0, j = 0; j < d->taps; j++)
+                acc += (int32_t)hist[j] * d->coefs[j];
+            acc = (acc + (1 << 14)) >> 15;
+            d->out[k] = (int16_t)(acc > 32767 ? 32767 : (acc < -32768 ? -32768 : acc));
+        }
+        d->hist_frames -= out_frames * d->ratio;
+        memmove(d->hist, d->hist + out_frames * d->ratio, d->hist_frames * sizeof(int16_t));
+    }
+
+    d->frames_in += frames;
+    d->process_ns += get_time_ns() - start_ns;
+    return out_frames;
+}
+
+static int out_close_pcm_devices(struct stream_out *out)
+{
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+    struct audio_device *adev = out->dev;
+
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (pcm_device->sound_trigger_handle > 0) {
+            adev->sound_trigger_close_for_streaming(pcm_device->sound_trigger_handle);
+            pcm_device->sound_trigger_handle = 0;
+        }
+        if (pcm_device->pcm) {
+            pcm_close(pcm_device->pcm);
+            pcm_device->pcm = NULL;
         }
         if (pcm_device->resampler) {
             release_resampler(pcm_device->resampler);
@@ -2317,6 +3852,13 @@ static int out_close_pcm_devices(struct stream_out *out)
             free(pcm_device->res_buffer);
             pcm_device->res_buffer = NULL;
         }
+        if (pcm_device->fold_buffer) {
+            free(pcm_device->fold_buffer);
+            pcm_device->fold_buffer = NULL;
+            pcm_device->fold_frames = 0;
+        }
+        sco_decimator_release(pcm_device->decimator);
+        pcm_device->decimator = NULL;
     }
 
     return 0;
@@ -2333,8 +3875,14 @@ static int out_open_pcm_devices(struct stream_out *out)
         ALOGV("%s: Opening PCM device card_id(%d) device_id(%d)",
               __func__, pcm_device->pcm_profile->card, pcm_device->pcm_profile->id);
 
-        pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card, pcm_device->pcm_profile->id,
-                               PCM_OUT | PCM_MONOTONIC, &pcm_device->pcm_profile->config);
+        /* deep buffer and multichannel PCM configs are set by the stream, not by the profile */
+        if (out->usecase == USECASE_AUDIO_PLAYBACK_DEEP_BUFFER ||
+                out->usecase == USECASE_AUDIO_PLAYBACK_MULTI_CH)
+            pcm_device->pcm = pcm_device_open(pcm_device, &out->config,
+                                              PCM_OUT | PCM_MONOTONIC | PCM_NORESTART);
+        else
+            pcm_device->pcm = pcm_device_open(pcm_device, &pcm_device->pcm_profile->config,
+                                              PCM_OUT | PCM_MONOTONIC | PCM_NORESTART);
 
         if (pcm_device->pcm && !pcm_is_ready(pcm_device->pcm)) {
             ALOGE("%s: %s", __func__, pcm_get_error(pcm_device->pcm));
@@ -2344,16 +3892,30 @@ static int out_open_pcm_devices(struct stream_out *out)
         }
         /*
         * If the stream rate differs from the PCM rate, we need to
-        * create a resampler.
+        * create a resampler. SCO rates divide the stream rate: use the cheaper
+        * decimator which also takes care of the mono downmix.
         */
-        if (out->sample_rate != pcm_device->pcm_profile->config.rate) {
+        if (pcm_device->pcm_profile == &pcm_device_playback_sco &&
+                out->sample_rate % pcm_device->pcm_profile->config.rate == 0) {
+            pcm_device->decimator = sco_decimator_create(
+                    out->sample_rate / pcm_device->pcm_profile->config.rate,
+                    audio_channel_count_from_out_mask(out->channel_mask),
+                    out->config.period_size);
+            if (pcm_device->decimator == NULL) {
+                ret = -ENOMEM;
+                goto error_open;
+            }
+        } else if (out->sample_rate != pcm_device->pcm_profile->config.rate) {
             ALOGV("%s: create_resampler(), pcm_device_card(%d), pcm_device_id(%d), \
                     out_rate(%d), device_rate(%d)",__func__,
                     pcm_device->pcm_profile->card, pcm_device->pcm_profile->id,
                     out->sample_rate, pcm_device->pcm_profile->config.rate);
+            /* the SCO PCM is mono: fold the stream before resampling it */
+            pcm_device->res_channels = pcm_device->pcm_profile == &pcm_device_playback_sco ?
+                    1 : audio_channel_count_from_out_mask(out->channel_mask);
             ret = create_resampler(out->sample_rate,
                     pcm_device->pcm_profile->config.rate,
-                    audio_channel_count_from_out_mask(out->channel_mask),
+                    pcm_device->res_channels,
                     RESAMPLER_QUALITY_DEFAULT,
                     NULL,
                     &pcm_device->resampler);
@@ -2430,6 +3992,22 @@ static int stop_output_stream(struct stream_out *out)
     return ret;
 }
 
+/*
+ * Deep buffer PCM configuration, picked when the PCM is opened. The period size,
+ * and so the AudioFlinger buffer size, never changes: with the screen off only
+ * the number of periods and avail_min grow, so that blocking writes are batched.
+ */
+static void out_update_deep_buffer_config(struct stream_out *out, bool screen_off)
+{
+    out->config = pcm_config_deep_buffer;
+    if (screen_off) {
+        out->config.period_count = DEEP_BUFFER_SCREEN_OFF_PERIOD_COUNT;
+        out->config.avail_min = DEEP_BUFFER_SCREEN_OFF_AVAIL_MIN;
+    }
+    ALOGV("%s: screen_off %d, %u periods, avail_min %u", __func__, screen_off,
+          out->config.period_count, out->config.avail_min);
+}
+
 static int start_output_stream(struct stream_out *out)
 {
     int ret = 0;
@@ -2438,18 +4016,25 @@ static int start_output_stream(struct stream_out *out)
     ALOGV("%s: enter: usecase(%d: %s) devices(%#x) channels(%d)",
           __func__, out->usecase, use_case_table[out->usecase], out->devices, out->config.channels);
 
+    adev_init_wait(adev);
     enable_output_path_l(out);
 
     if (out->usecase != USECASE_AUDIO_PLAYBACK_OFFLOAD) {
         out->compr = NULL;
+        if (out->usecase == USECASE_AUDIO_PLAYBACK_DEEP_BUFFER)
+            out_update_deep_buffer_config(out, adev->screen_off);
+        if (out->usecase == USECASE_AUDIO_PLAYBACK_MULTI_CH &&
+                (out->devices & AUDIO_DEVICE_OUT_AUX_DIGITAL) &&
+                adev->cur_hdmi_channels != out->config.channels) {
+            set_hdmi_channels(adev, out->config.channels);
+            adev->cur_hdmi_channels = out->config.channels;
+        }
+        tfa9895_preempt_dummybuf_l(out);
         ret = out_open_pcm_devices(out);
         if (ret != 0)
             goto error_open;
 #ifdef PREPROCESSING_ENABLED
-        out->echo_reference = NULL;
-        out->echo_reference_generation = adev->echo_reference_generation;
-        if (adev->echo_reference != NULL)
-            out->echo_reference = adev->echo_reference;
+        out->timing_valid = false;
 #endif
     } else {
         out->compr = compress_open(COMPRESS_CARD, COMPRESS_DEVICE,
@@ -2464,6 +4049,7 @@ static int start_output_stream(struct stream_out *out)
         if (out->offload_callback)
             compress_nonblock(out->compr, out->non_blocking);
 
+        load_offload_fx_lib(adev);
         if (adev->offload_fx_start_output != NULL)
             adev->offload_fx_start_output(out->handle);
     }
@@ -2509,6 +4095,7 @@ static int start_voice_call(struct audio_device *adev)
 
     ALOGV("%s: enter", __func__);
 
+    adev_init_wait(adev);
     uc_info = (struct audio_usecase *)calloc(1, sizeof(struct audio_usecase));
     uc_info->id = USECASE_VOICE_CALL;
     uc_info->type = VOICE_CALL;
@@ -2534,6 +4121,458 @@ static int start_voice_call(struct audio_device *adev)
     return 0;
 }
 
+/*
+ * Round trip latency test: out_write() injects the sequence, in_read() records
+ * the capture window and a background thread correlates the two. See the
+ * definitions in audio_hw.h.
+ */
+static void latency_test_init(struct audio_device *adev)
+{
+    struct latency_test *test = &adev->latency_test;
+    uint32_t lfsr = 1;
+    int i;
+
+    pthread_mutex_init(&test->lock, (const pthread_mutexattr_t *) NULL);
+    pthread_cond_init(&test->cond, (const pthread_condattr_t *) NULL);
+    /* x^10 + x^7 + 1 */
+    for (i = 0; i < LATENCY_TEST_MLS_LENGTH; i++) {
+        test->mls[i] = (lfsr & 1) ? 1 : -1;
+        lfsr = (lfsr >> 1) | ((((lfsr >> 0) ^ (lfsr >> 3)) & 1) << (LATENCY_TEST_MLS_ORDER - 1));
+    }
+}
+
+static void latency_test_set(struct audio_device *adev, int runs)
+{
+    struct latency_test *test = &adev->latency_test;
+
+    pthread_mutex_lock(&test->lock);
+    if (runs > LATENCY_TEST_MAX_RUNS)
+        runs = LATENCY_TEST_MAX_RUNS;
+    if (runs > 0 && test->capture == NULL)
+        test->capture = (int16_t *)malloc(LATENCY_TEST_MAX_RATE * LATENCY_TEST_WINDOW_MS / 1000 *
+                                          sizeof(int16_t));
+    if (runs > 0 && test->capture != NULL && test->thread == 0) {
+        test->thread_exit = false;
+        if (pthread_create(&test->thread, (const pthread_attr_t *) NULL,
+                           latency_test_thread_loop, adev) != 0) {
+            ALOGE("%s: analysis thread create fail", __func__);
+            test->thread = 0;
+        }
+    }
+    test->runs_requested = test->thread != 0 ? runs : 0;
+    test->runs_done = 0;
+    test->runs_failed = 0;
+    /* a window being analyzed completes, then the test stops */
+    if (test->state != LATENCY_TEST_ANALYZING)
+        test->state = test->runs_requested > 0 ? LATENCY_TEST_ARMED : LATENCY_TEST_IDLE;
+    pthread_mutex_unlock(&test->lock);
+}
+
+/* Plays the sequence on all channels of a 16 bit buffer about to be written to the PCM */
+static void latency_test_play(struct audio_device *adev, struct stream_out *out,
+                              int16_t *buffer, size_t frames, unsigned int channels)
+{
+    struct latency_test *test = &adev->latency_test;
+    size_t i;
+    unsigned int c;
+
+    pthread_mutex_lock(&test->lock);
+    if (test->state == LATENCY_TEST_RECORDING && test->probe_pos < LATENCY_TEST_MLS_LENGTH &&
+            out->sample_rate == test->rate &&
+            (test->probe_pos == 0 || out->usecase == test->out_usecase)) {
+        if (test->probe_pos == 0) {
+            test->probe_capture_frame = test->capture_frames;
+            test->out_usecase = out->usecase;
+        }
+        for (i = 0; i < frames && test->probe_pos < LATENCY_TEST_MLS_LENGTH; i++) {
+            for (c = 0; c < channels; c++)
+                buffer[i * channels + c] = test->mls[test->probe_pos] * LATENCY_TEST_LEVEL;
+            test->probe_pos++;
+        }
+    }
+    pthread_mutex_unlock(&test->lock);
+}
+
+/* Records channel 0 of a buffer returned to the client of a PCM input */
+static void latency_test_record(struct audio_device *adev, struct stream_in *in,
+                                const int16_t *buffer, size_t frames, unsigned int channels)
+{
+    struct latency_test *test = &adev->latency_test;
+    size_t i;
+
+    pthread_mutex_lock(&test->lock);
+    if (test->state == LATENCY_TEST_ARMED && in->requested_rate <= LATENCY_TEST_MAX_RATE) {
+        test->rate = in->requested_rate;
+        test->window_frames = test->rate * LATENCY_TEST_WINDOW_MS / 1000;
+        test->capture_frames = 0;
+        test->probe_pos = 0;
+        test->probe_capture_frame = -1;
+        test->in_usecase = in->usecase;
+        test->state = LATENCY_TEST_RECORDING;
+    }
+    if (test->state == LATENCY_TEST_RECORDING && in->usecase == test->in_usecase) {
+        for (i = 0; i < frames && test->capture_frames < test->window_frames; i++)
+            test->capture[test->capture_frames++] = buffer[i * channels];
+        if (test->capture_frames == test->window_frames) {
+            test->state = LATENCY_TEST_ANALYZING;
+            pthread_cond_signal(&test->cond);
+        }
+    }
+    pthread_mutex_unlock(&test->lock);
+}
+
+/* Dot product of n samples with a +1/-1 sequence. n * 32768 must fit in 32 bits. */
+static int32_t latency_test_correlate(const int16_t *x, const int16_t *seq, size_t n)
+{
+    int32_t sum = 0;
+    size_t i = 0;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    int32x4_t acc = vdupq_n_s32(0);
+    int32x2_t acc2;
+
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t vx = vld1q_s16(x + i);
+        int16x8_t vs = vld1q_s16(seq + i);
+
+        acc = vmlal_s16(acc, vget_low_s16(vx), vget_low_s16(vs));
+        acc = vmlal_s16(acc, vget_high_s16(vx), vget_high_s16(vs));
+    }
+    acc2 = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+    sum = vget_lane_s32(vpadd_s32(acc2, acc2), 0);
+#endif
+    for (; i < n; i++)
+        sum += (int32_t)x[i] * seq[i];
+    return sum;
+}
+
+/*
+ * Runs on the analysis thread: locates the sequence in the capture window. The
+ * latency is the distance between the capture position at which the sequence
+ * was written and the one at which it came back, as seen by the clients.
+ */
+static void latency_test_analyze(struct audio_device *adev)
+{
+    struct latency_test *test = &adev->latency_test;
+    int64_t corr_sum = 0;
+    int32_t corr, peak = 0;
+    size_t lag, lags, peak_lag = 0;
+    int16_t *window;
+    bool valid;
+
+    pthread_mutex_lock(&test->lock);
+    if (test->state != LATENCY_TEST_ANALYZING) {
+        pthread_mutex_unlock(&test->lock);
+        return;
+    }
+    /* capture is not written to while analyzing: correlate without the lock */
+    valid = test->probe_capture_frame >= 0 && test->probe_pos == LATENCY_TEST_MLS_LENGTH &&
+            test->capture_frames >= test->probe_capture_frame + LATENCY_TEST_MLS_LENGTH;
+    window = test->capture + (valid ? test->probe_capture_frame : 0);
+    lags = valid ? test->capture_frames - test->probe_capture_frame - LATENCY_TEST_MLS_LENGTH + 1 : 0;
+    pthread_mutex_unlock(&test->lock);
+
+    for (lag = 0; lag < lags; lag++) {
+        corr = latency_test_correlate(window + lag, test->mls, LATENCY_TEST_MLS_LENGTH);
+        if (corr < 0)
+            corr = -corr;
+        corr_sum += corr;
+        if (corr > peak) {
+            peak = corr;
+            peak_lag = lag;
+        }
+    }
+    valid = lags > 0 && (int64_t)peak * (int64_t)lags >= corr_sum * LATENCY_TEST_MIN_PEAK_RATIO;
+
+    pthread_mutex_lock(&test->lock);
+    if (valid && test->runs_done < test->runs_requested) {
+        test->latency_us[test->runs_done - test->runs_failed] =
+                (int32_t)((int64_t)peak_lag * 1000000 / test->rate);
+        ALOGV("%s: run %d: %d us", __func__, test->runs_done,
+              test->latency_us[test->runs_done - test->runs_failed]);
+    } else {
+        test->runs_failed++;
+        ALOGW("%s: run %d: sequence not found", __func__, test->runs_done);
+    }
+    test->runs_done++;
+    test->state = test->runs_done < test->runs_requested ? LATENCY_TEST_ARMED : LATENCY_TEST_IDLE;
+    pthread_mutex_unlock(&test->lock);
+}
+
+/*
+ * The correlation takes tens of millions of multiply-adds per run: keep it off
+ * the routing worker and the stream threads, at background priority.
+ */
+static void *latency_test_thread_loop(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct latency_test *test = &adev->latency_test;
+
+    thread_policy_apply(adev, THREAD_ROLE_LATENCY_TEST);
+    prctl(PR_SET_NAME, (unsigned long)"Latency Test", 0, 0, 0);
+
+    pthread_mutex_lock(&test->lock);
+    while (!test->thread_exit) {
+        if (test->state != LATENCY_TEST_ANALYZING) {
+            pthread_cond_wait(&test->cond, &test->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&test->lock);
+        latency_test_analyze(adev);
+        pthread_mutex_lock(&test->lock);
+    }
+    pthread_mutex_unlock(&test->lock);
+    return NULL;
+}
+
+static void latency_test_close(struct audio_device *adev)
+{
+    struct latency_test *test = &adev->latency_test;
+
+    if (test->thread != 0) {
+        pthread_mutex_lock(&test->lock);
+        test->thread_exit = true;
+        pthread_cond_signal(&test->cond);
+        pthread_mutex_unlock(&test->lock);
+        pthread_join(test->thread, (void **) NULL);
+        test->thread = 0;
+    }
+    pthread_cond_destroy(&test->cond);
+    pthread_mutex_destroy(&test->lock);
+    free(test->capture);
+    test->capture = NULL;
+}
+
+static void latency_test_get_results(struct audio_device *adev, struct str_parms *reply)
+{
+    struct latency_test *test = &adev->latency_test;
+    int64_t sum = 0, sum_sq = 0;
+    int32_t min = 0, max = 0;
+    float mean = 0.0f, jitter = 0.0f;
+    int i, count;
+
+    pthread_mutex_lock(&test->lock);
+    count = test->runs_done - test->runs_failed;
+    for (i = 0; i < count; i++) {
+        sum += test->latency_us[i];
+        sum_sq += (int64_t)test->latency_us[i] * test->latency_us[i];
+        if (i == 0 || test->latency_us[i] < min)
+            min = test->latency_us[i];
+        if (i == 0 || test->latency_us[i] > max)
+            max = test->latency_us[i];
+    }
+    if (count > 0) {
+        mean = (float)sum / count;
+        jitter = sqrtf(fmaxf((float)sum_sq / count - mean * mean, 0.0f));
+    }
+    str_parms_add_str(reply, "latency_test_state",
+                      test->state == LATENCY_TEST_IDLE ? "idle" : "running");
+    str_parms_add_int(reply, "latency_test_runs", test->runs_done);
+    str_parms_add_int(reply, "latency_test_failed", test->runs_failed);
+    str_parms_add_float(reply, "latency_test_mean_ms", mean / 1000.0f);
+    str_parms_add_float(reply, "latency_test_min_ms", min / 1000.0f);
+    str_parms_add_float(reply, "latency_test_max_ms", max / 1000.0f);
+    str_parms_add_float(reply, "latency_test_jitter_ms", jitter / 1000.0f);
+    if (count > 0) {
+        str_parms_add_str(reply, "latency_test_output", use_case_table[test->out_usecase]);
+        str_parms_add_str(reply, "latency_test_input", use_case_table[test->in_usecase]);
+    }
+    pthread_mutex_unlock(&test->lock);
+}
+
+/*
+ * Routing worker: device selection, voice call transitions and amp control
+ * requested from set_parameters() are executed here so that the caller does not
+ * hold stream mutexes during mixer and I2C I/O. Commands are executed in order.
+ * Commands carry no snapshot of the routing state: the worker re-reads it under
+ * adev->lock so that a burst of requests converges on the latest state.
+ */
+static void route_cmd_execute(struct audio_device *adev, struct route_cmd *cmd)
+{
+    int64_t lock_ns = 0;
+    bool locked = false;
+    bool amp = false;
+
+    switch (cmd->cmd) {
+    case ROUTE_CMD_SELECT_DEVICES:
+        pthread_mutex_lock(&adev->lock);
+        lock_ns = get_time_ns();
+        locked = true;
+        if (get_usecase_from_id(adev, cmd->data[0]) != NULL)
+            select_devices(adev, cmd->data[0]);
+        break;
+    case ROUTE_CMD_UPDATE_VOICE_CALL:
+        pthread_mutex_lock(&adev->lock);
+        lock_ns = get_time_ns();
+        locked = true;
+        if (adev->mode == AUDIO_MODE_IN_CALL && adev->primary_output != NULL) {
+            if (!adev->in_call)
+                start_voice_call(adev);
+            else
+                select_devices(adev, USECASE_VOICE_CALL);
+        } else if (adev->mode == AUDIO_MODE_NORMAL && adev->in_call) {
+            stop_voice_call(adev);
+        }
+        break;
+    case ROUTE_CMD_SET_RT5506_AMP:
+        if (adev->htc_acoustic_set_rt5506_amp != NULL)
+            adev->htc_acoustic_set_rt5506_amp(cmd->data[0], cmd->data[1]);
+        amp = true;
+        break;
+    case ROUTE_CMD_SPK_REVERSE:
+        if (adev->htc_acoustic_spk_reverse != NULL)
+            adev->htc_acoustic_spk_reverse(cmd->data[0]);
+        amp = true;
+        break;
+    default:
+        ALOGE("%s unknown command received: %d", __func__, cmd->cmd);
+        break;
+    }
+
+    if (locked) {
+        lock_ns = get_time_ns() - lock_ns;
+        pthread_mutex_unlock(&adev->lock);
+    }
+    pthread_mutex_lock(&adev->route_lock);
+    if (lock_ns > adev->route_lock_max_ns)
+        adev->route_lock_max_ns = lock_ns;
+    if (amp)
+        adev->route_amp_count++;
+    pthread_mutex_unlock(&adev->route_lock);
+}
+
+static void *route_thread_loop(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct listnode *item;
+    struct route_cmd *cmd;
+    int64_t latency_ns;
+
+    thread_policy_apply(adev, THREAD_ROLE_ROUTING);
+    prctl(PR_SET_NAME, (unsigned long)"Routing", 0, 0, 0);
+
+    ALOGV("%s", __func__);
+    pthread_mutex_lock(&adev->route_lock);
+    for (;;) {
+        if (list_empty(&adev->route_cmd_list)) {
+            pthread_cond_wait(&adev->route_cond, &adev->route_lock);
+            continue;
+        }
+
+        item = list_head(&adev->route_cmd_list);
+        cmd = node_to_item(item, struct route_cmd, node);
+        list_remove(item);
+
+        if (cmd->cmd == ROUTE_CMD_EXIT) {
+            free(cmd);
+            break;
+        }
+
+        pthread_mutex_unlock(&adev->route_lock);
+        route_cmd_execute(adev, cmd);
+        pthread_mutex_lock(&adev->route_lock);
+
+        latency_ns = get_time_ns() - cmd->post_ns;
+        adev->route_cmd_count++;
+        if (latency_ns > adev->route_latency_max_ns)
+            adev->route_latency_max_ns = latency_ns;
+        adev->route_seq_done = cmd->seq;
+        pthread_cond_broadcast(&adev->route_done_cond);
+        ALOGVV("%s: cmd %d done in %lld us", __func__, cmd->cmd,
+               (long long)(latency_ns / 1000));
+        free(cmd);
+    }
+
+    while (!list_empty(&adev->route_cmd_list)) {
+        item = list_head(&adev->route_cmd_list);
+        list_remove(item);
+        free(node_to_item(item, struct route_cmd, node));
+    }
+    adev->route_seq_done = adev->route_seq_posted;
+    pthread_cond_broadcast(&adev->route_done_cond);
+    pthread_mutex_unlock(&adev->route_lock);
+
+    return NULL;
+}
+
+/* Queues a command for the routing worker. Returns its sequence number for route_cmd_wait(). */
+static uint32_t route_cmd_post(struct audio_device *adev, int command, int data0, int data1)
+{
+    struct route_cmd *cmd = (struct route_cmd *)calloc(1, sizeof(struct route_cmd));
+    uint32_t seq;
+
+    ALOGVV("%s %d", __func__, command);
+
+    pthread_mutex_lock(&adev->route_lock);
+    seq = ++adev->route_seq_posted;
+    if (cmd == NULL) {
+        ALOGE("%s: cannot allocate command %d", __func__, command);
+        adev->route_seq_done = seq;
+        pthread_mutex_unlock(&adev->route_lock);
+        return seq;
+    }
+    cmd->cmd = command;
+    cmd->data[0] = data0;
+    cmd->data[1] = data1;
+    cmd->seq = seq;
+    cmd->post_ns = get_time_ns();
+    list_add_tail(&adev->route_cmd_list, &cmd->node);
+    pthread_cond_signal(&adev->route_cond);
+    pthread_mutex_unlock(&adev->route_lock);
+    return seq;
+}
+
+/* Waits for completion of all commands up to seq. Must not be called with adev->lock held. */
+static void route_cmd_wait(struct audio_device *adev, uint32_t seq)
+{
+    pthread_mutex_lock(&adev->route_lock);
+    while ((int32_t)(adev->route_seq_done - seq) < 0)
+        pthread_cond_wait(&adev->route_done_cond, &adev->route_lock);
+    pthread_mutex_unlock(&adev->route_lock);
+}
+
+static void update_route_caller_lock_stats(struct audio_device *adev, int64_t lock_ns)
+{
+    pthread_mutex_lock(&adev->route_lock);
+    if (lock_ns > adev->route_caller_lock_max_ns)
+        adev->route_caller_lock_max_ns = lock_ns;
+    pthread_mutex_unlock(&adev->route_lock);
+}
+
+static int create_route_thread(struct audio_device *adev)
+{
+    int ret;
+
+    pthread_mutex_init(&adev->route_lock, (const pthread_mutexattr_t *) NULL);
+    pthread_cond_init(&adev->route_cond, (const pthread_condattr_t *) NULL);
+    pthread_cond_init(&adev->route_done_cond, (const pthread_condattr_t *) NULL);
+    list_init(&adev->route_cmd_list);
+    ret = pthread_create(&adev->route_thread, (const pthread_attr_t *) NULL,
+                         route_thread_loop, adev);
+    if (ret != 0) {
+        ALOGE("%s: routing thread create fail", __func__);
+        pthread_cond_destroy(&adev->route_done_cond);
+        pthread_cond_destroy(&adev->route_cond);
+        pthread_mutex_destroy(&adev->route_lock);
+        adev->route_thread = 0;
+        return -ret;
+    }
+    return 0;
+}
+
+static void destroy_route_thread(struct audio_device *adev)
+{
+    if (adev->route_thread == 0)
+        return;
+
+    route_cmd_post(adev, ROUTE_CMD_EXIT, 0, 0);
+    pthread_join(adev->route_thread, (void **) NULL);
+    pthread_cond_destroy(&adev->route_done_cond);
+    pthread_cond_destroy(&adev->route_cond);
+    pthread_mutex_destroy(&adev->route_lock);
+    adev->route_thread = 0;
+}
+
 static int check_input_parameters(uint32_t sample_rate,
                                   audio_format_t format,
                                   int channel_count)
@@ -2641,19 +4680,17 @@ static int do_out_standby_l(struct stream_out *out)
     int status = 0;
 
     out->standby = true;
+    out->standby_warm = false;
+    stream_stats_standby(&out->stats);
     if (out->usecase != USECASE_AUDIO_PLAYBACK_OFFLOAD) {
+        ALOGV("%s: usecase(%d) worst case write %lld us", __func__, out->usecase,
+              (long long)(out->write_max_ns / 1000));
+        out->write_max_ns = 0;
         out_close_pcm_devices(out);
 #ifdef PREPROCESSING_ENABLED
         /* stop writing to echo reference */
-        if (out->echo_reference != NULL) {
-            out->echo_reference->write(out->echo_reference, NULL);
-            if (out->echo_reference_generation != adev->echo_reference_generation) {
-                ALOGV("%s: release_echo_reference %p", __func__, out->echo_reference);
-                release_echo_reference(out->echo_reference);
-                out->echo_reference_generation = adev->echo_reference_generation;
-            }
-            out->echo_reference = NULL;
-        }
+        echo_ref_ring_stop(adev, out);
+        out->timing_valid = false;
 #endif
     } else {
         stop_compressed_output_l(out);
@@ -2669,6 +4706,114 @@ static int do_out_standby_l(struct stream_out *out)
     return status;
 }
 
+static int64_t out_standby_delay_ns(struct audio_device *adev)
+{
+    return (int64_t)(adev->screen_off ? adev->standby_delay_screen_off_ms :
+                                        adev->standby_delay_ms) * 1000000LL;
+}
+
+/*
+ * Stops the PCMs but keeps them prepared, with the usecase and its routes in
+ * place. The next out_write() restarts them, standby_thread closes them if no
+ * write comes within the standby delay.
+ */
+static void out_enter_warm_standby_l(struct stream_out *out)
+{
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (pcm_device->pcm == NULL)
+            continue;
+        pcm_stop(pcm_device->pcm);
+        if (pcm_device->mmap) {
+            pcm_device->mmap_started = false;
+            pcm_device->mmap_appl = 0;
+            pcm_prepare(pcm_device->pcm);
+        }
+    }
+    stream_stats_standby(&out->stats);
+    out->standby_warm = true;
+    out->standby_start_ns = get_time_ns();
+    out->standby_flush = android_atomic_acquire_load(&out->dev->standby_flush);
+    pthread_cond_signal(&out->standby_cond);
+}
+
+static void *out_standby_thread_loop(void *context)
+{
+    struct stream_out *out = (struct stream_out *)context;
+    struct audio_device *adev = out->dev;
+    int64_t wait_ns, screen_off_ns;
+    struct timespec ts;
+
+    thread_policy_apply(adev, THREAD_ROLE_OUT_STANDBY);
+    prctl(PR_SET_NAME, (unsigned long)"Output Standby", 0, 0, 0);
+
+    lock_output_stream(out);
+    while (!out->standby_thread_exit) {
+        if (!out->standby_warm) {
+            pthread_cond_wait(&out->standby_cond, &out->lock);
+            continue;
+        }
+        wait_ns = out->standby_start_ns + out_standby_delay_ns(adev) - get_time_ns();
+        if (wait_ns <= 0 ||
+                out->standby_flush != android_atomic_acquire_load(&adev->standby_flush)) {
+            ALOGV("%s: usecase(%d) standby delay expired", __func__, out->usecase);
+            pthread_mutex_lock(&adev->lock);
+            do_out_standby_l(out);
+            pthread_mutex_unlock(&adev->lock);
+            out->standby_expired++;
+            continue;
+        }
+        /* the screen may turn off meanwhile and shorten the delay */
+        screen_off_ns = (int64_t)adev->standby_delay_screen_off_ms * 1000000LL;
+        if (screen_off_ns > 0 && wait_ns > screen_off_ns)
+            wait_ns = screen_off_ns;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        wait_ns += ts.tv_nsec;
+        ts.tv_sec += wait_ns / 1000000000LL;
+        ts.tv_nsec = wait_ns % 1000000000LL;
+        pthread_cond_timedwait(&out->standby_cond, &out->lock, &ts);
+    }
+    pthread_mutex_unlock(&out->lock);
+    return NULL;
+}
+
+static void create_out_standby_thread(struct stream_out *out)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&out->standby_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    out->standby_thread_exit = false;
+    if (pthread_create(&out->standby_thread, (const pthread_attr_t *) NULL,
+                       out_standby_thread_loop, out) != 0) {
+        ALOGE("%s: standby thread create fail", __func__);
+        pthread_cond_destroy(&out->standby_cond);
+        out->standby_thread = 0;
+    }
+}
+
+static void destroy_out_standby_thread(struct stream_out *out)
+{
+    if (out->standby_thread == 0)
+        return;
+
+    lock_output_stream(out);
+    out->standby_thread_exit = true;
+    pthread_cond_signal(&out->standby_cond);
+    pthread_mutex_unlock(&out->lock);
+    pthread_join(out->standby_thread, (void **) NULL);
+    /* adev_set_mode() signals standby_cond under adev->lock */
+    pthread_mutex_lock(&out->dev->lock);
+    out->standby_thread = 0;
+    pthread_mutex_unlock(&out->dev->lock);
+    pthread_cond_destroy(&out->standby_cond);
+}
+
 static int out_standby(struct audio_stream *stream)
 {
     struct stream_out *out = (struct stream_out *)stream;
@@ -2677,20 +4822,98 @@ static int out_standby(struct audio_stream *stream)
     ALOGV("%s: enter: usecase(%d: %s)", __func__,
           out->usecase, use_case_table[out->usecase]);
     lock_output_stream(out);
-    if (!out->standby) {
-        pthread_mutex_lock(&adev->lock);
-        do_out_standby_l(out);
-        pthread_mutex_unlock(&adev->lock);
+    if (!out->standby && !out->standby_warm) {
+        if (out->standby_thread != 0 && out_standby_delay_ns(adev) > 0) {
+#ifdef PREPROCESSING_ENABLED
+            /* the echo reference reader expects the writer to stop */
+            echo_ref_ring_stop(adev, out);
+            out->timing_valid = false;
+#endif
+            out_enter_warm_standby_l(out);
+        } else {
+            pthread_mutex_lock(&adev->lock);
+            do_out_standby_l(out);
+            pthread_mutex_unlock(&adev->lock);
+        }
     }
     pthread_mutex_unlock(&out->lock);
     ALOGV("%s: exit", __func__);
     return 0;
 }
 
+static void update_write_rate_l(struct stream_out *out)
+{
+    int64_t now_ns = get_time_ns();
+
+    if (now_ns - out->writes_window_ns >= 1000000000LL) {
+        /* a window spanning a standby period is not representative */
+        out->writes_per_sec = now_ns - out->writes_window_ns < 2000000000LL ?
+                out->writes_window : 0;
+        out->writes_window = 0;
+        out->writes_window_ns = now_ns;
+    }
+    out->writes_window++;
+}
+
 static int out_dump(const struct audio_stream *stream, int fd)
 {
-    (void)stream;
-    (void)fd;
+    struct stream_out *out = (struct stream_out *)stream;
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+
+    dprintf(fd, "    Output usecase %s: devices %#x, rate %u, channels %#x, format %#x, %s\n",
+            use_case_table[out->usecase], out->devices, out->sample_rate, out->channel_mask,
+            out->format, out->standby ? "standby" :
+                         (out->standby_warm ? "warm standby" : "active"));
+    stream_stats_dump(&out->stats, fd, "writes");
+    if (out->standby_thread != 0)
+        dprintf(fd, "      first write after standby: warm %u avg %lld max %lld us, "
+                "cold %u avg %lld max %lld us, delays expired %u\n",
+                out->resume_warm_count, out->resume_warm_count == 0 ? 0LL :
+                    (long long)(out->resume_warm_sum_ns / out->resume_warm_count / 1000),
+                (long long)(out->resume_warm_max_ns / 1000),
+                out->resume_cold_count, out->resume_cold_count == 0 ? 0LL :
+                    (long long)(out->resume_cold_sum_ns / out->resume_cold_count / 1000),
+                (long long)(out->resume_cold_max_ns / 1000), out->standby_expired);
+    if (out->usecase != USECASE_AUDIO_PLAYBACK_OFFLOAD)
+        dprintf(fd, "      periods: %u x %u frames, avail_min %u, latency %u ms, "
+                "writes per second %u\n", out->config.period_count, out->config.period_size,
+                out->config.avail_min,
+                out->stream.get_latency((const struct audio_stream_out *)out),
+                out->writes_per_sec);
+    if (out->convert_frames > 0)
+        dprintf(fd, "      format %#x to 16 bit: %lld us per period\n", out->format,
+                (long long)(out->convert_ns * out->config.period_size / out->convert_frames / 1000));
+    if (out->downmix_frames > 0)
+        dprintf(fd, "      downmix %d to %u channels: %lld us per period\n",
+                audio_channel_count_from_out_mask(out->channel_mask), out->config.channels,
+                (long long)(out->downmix_ns * out->config.period_size / out->downmix_frames / 1000));
+#ifdef PREPROCESSING_ENABLED
+    if (out->timing_queries > 0)
+        dprintf(fd, "      echo reference delay: %u driver timestamps, %u extrapolated\n",
+                out->timing_queries, out->timing_estimates);
+#endif
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (pcm_device->decimator && pcm_device->decimator->frames_in > 0)
+            dprintf(fd, "      SCO decimation by %u, %u taps: %lld us per call minute\n",
+                    pcm_device->decimator->ratio, pcm_device->decimator->taps,
+                    (long long)(pcm_device->decimator->process_ns * 60 * out->sample_rate /
+                                pcm_device->decimator->frames_in / 1000));
+    }
+    if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD) {
+        dprintf(fd, "      offload commands: %u, coalesced %u, dropped %u, dispatch max %lld us\n",
+                out->offload_cmd_total, out->offload_cmd_coalesced, out->offload_cmd_dropped,
+                (long long)(out->offload_dispatch_max_ns / 1000));
+        dprintf(fd, "      offload fragments: %u x %u bytes, wakeups per minute %u\n",
+                out->compr_config.fragments, out->compr_config.fragment_size,
+                out->offload_wakeups_per_min);
+        if (out->offload_cb_count > 0)
+            dprintf(fd, "      offload callbacks: %u, latency avg %lld us, max %lld us\n",
+                    out->offload_cb_count,
+                    (long long)(out->offload_cb_latency_sum_ns / out->offload_cb_count / 1000),
+                    (long long)(out->offload_cb_latency_max_ns / 1000));
+    }
 
     return 0;
 }
@@ -2741,6 +4964,8 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
     bool do_standby = false;
     struct pcm_device *pcm_device;
     struct pcm_device_profile *pcm_profile;
+    uint32_t route_seq = 0;
+    int64_t lock_ns;
 #ifdef PREPROCESSING_ENABLED
     struct stream_in *in = NULL;    /* if non-NULL, then force input to standby */
 #endif
@@ -2754,6 +4979,7 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
         pthread_mutex_lock(&adev->lock_inputs);
         lock_output_stream(out);
         pthread_mutex_lock(&adev->lock);
+        lock_ns = get_time_ns();
 #ifdef PREPROCESSING_ENABLED
         if (((int)out->devices != val) && (val != 0) && (!out->standby) &&
             (out->usecase == USECASE_AUDIO_PLAYBACK)) {
@@ -2799,25 +5025,24 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
                            uc_info->out_snd_device = SND_DEVICE_OUT_HEADPHONES;
                         }
                     }
-                    select_devices(adev, out->usecase);
+                    route_seq = route_cmd_post(adev, ROUTE_CMD_SELECT_DEVICES, out->usecase, 0);
                 }
             }
 
-            if ((adev->mode == AUDIO_MODE_IN_CALL) && !adev->in_call &&
-                    (out == adev->primary_output)) {
-                start_voice_call(adev);
-            } else if ((adev->mode == AUDIO_MODE_IN_CALL) && adev->in_call &&
-                       (out == adev->primary_output)) {
-                select_devices(adev, USECASE_VOICE_CALL);
-            }
+            if ((adev->mode == AUDIO_MODE_IN_CALL) && (out == adev->primary_output))
+                route_seq = route_cmd_post(adev, ROUTE_CMD_UPDATE_VOICE_CALL, 0, 0);
         }
 
         if ((adev->mode == AUDIO_MODE_NORMAL) && adev->in_call &&
                 (out == adev->primary_output)) {
-            stop_voice_call(adev);
+            route_seq = route_cmd_post(adev, ROUTE_CMD_UPDATE_VOICE_CALL, 0, 0);
         }
+        update_route_caller_lock_stats(adev, get_time_ns() - lock_ns);
         pthread_mutex_unlock(&adev->lock);
         pthread_mutex_unlock(&out->lock);
+        /* routing is done by the worker, without holding the stream lock */
+        if (route_seq != 0)
+            route_cmd_wait(adev, route_seq);
 #ifdef PREPROCESSING_ENABLED
         if (in) {
             /* The lock on adev->lock_inputs prevents input stream from being closed */
@@ -2870,110 +5095,587 @@ static char* out_get_parameters(const struct audio_stream *stream, const char *k
                     break;
                 }
             }
-            i++;
+            i++;
+        }
+        str_parms_add_str(reply, AUDIO_PARAMETER_STREAM_SUP_CHANNELS, value);
+        str = str_parms_to_str(reply);
+    } else {
+        str = strdup(keys);
+    }
+    str_parms_destroy(query);
+    str_parms_destroy(reply);
+    ALOGV("%s: exit: returns - %s", __func__, str);
+    return str;
+}
+
+static uint32_t out_get_latency(const struct audio_stream_out *stream)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+
+    if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD)
+        return COMPRESS_OFFLOAD_PLAYBACK_LATENCY;
+
+    return (out->config.period_count * out->config.period_size * 1000) /
+           (out->config.rate);
+}
+
+static int out_set_volume(struct audio_stream_out *stream, float left,
+                          float right)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    int offload_volume[2];//For stereo
+
+    if (out->usecase == USECASE_AUDIO_PLAYBACK_MULTI_CH) {
+        /* only take left channel into account: the API is for stereo anyway */
+        out->muted = (left == 0.0f);
+        return 0;
+    } else if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD) {
+        offload_volume[0] = (int)(left * COMPRESS_PLAYBACK_VOLUME_MAX);
+        offload_volume[1] = (int)(right * COMPRESS_PLAYBACK_VOLUME_MAX);
+
+        ALOGV("out_set_volume set offload volume (%f, %f)", left, right);
+        offload_volume_set(out, offload_volume[0], offload_volume[1]);
+        return 0;
+    }
+
+    return -ENOSYS;
+}
+
+/* always called with adev lock held */
+static bool tfa9895_speaker_active_l(struct audio_device *adev)
+{
+    struct audio_usecase *usecase;
+    struct stream_out *out;
+    struct listnode *node;
+
+    list_for_each(node, &adev->usecase_list) {
+        usecase = node_to_item(node, struct audio_usecase, adev_list_node);
+        if (usecase->type != PCM_PLAYBACK || usecase->stream == NULL)
+            continue;
+        out = (struct stream_out *)usecase->stream;
+        if (out->usecase != USECASE_AUDIO_PLAYBACK_OFFLOAD && !out->standby &&
+                (out->devices & AUDIO_DEVICE_OUT_SPEAKER))
+            return true;
+    }
+    return false;
+}
+
+static bool tfa9895_speaker_active(struct audio_device *adev)
+{
+    bool active;
+
+    pthread_mutex_lock(&adev->lock);
+    active = tfa9895_speaker_active_l(adev);
+    pthread_mutex_unlock(&adev->lock);
+    return active;
+}
+
+/* always called with adev lock held */
+static bool playback_pcm_open_l(struct audio_device *adev)
+{
+    struct audio_usecase *usecase;
+    struct pcm_device *pcm_device;
+    struct listnode *node, *dev_node;
+
+    list_for_each(node, &adev->usecase_list) {
+        usecase = node_to_item(node, struct audio_usecase, adev_list_node);
+        if (usecase->type != PCM_PLAYBACK || usecase->stream == NULL)
+            continue;
+        list_for_each(dev_node, &((struct stream_out *)usecase->stream)->pcm_dev_list) {
+            pcm_device = node_to_item(dev_node, struct pcm_device, stream_list_node);
+            if (pcm_device->pcm_profile == &pcm_device_playback && pcm_device->pcm != NULL)
+                return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * The dummybuf thread opens the same playback PCM as the streams. Start it on the
+ * speaker path only if no stream has that PCM open, and atomically with respect
+ * to start_output_stream() which preempts it with tfa9895_preempt_dummybuf_l().
+ */
+static bool tfa9895_start_dummybuf(struct audio_device *adev)
+{
+    bool claimed;
+
+    pthread_mutex_lock(&adev->lock);
+    claimed = !tfa9895_speaker_active_l(adev) && !playback_pcm_open_l(adev);
+    if (claimed) {
+        adev->dummybuf_thread_devices = AUDIO_DEVICE_OUT_SPEAKER;
+        dummybuf_thread_open(adev);
+    }
+    adev->tfa9895_owns_playback_pcm = claimed;
+    pthread_mutex_unlock(&adev->lock);
+    return claimed;
+}
+
+static void tfa9895_stop_dummybuf(struct audio_device *adev)
+{
+    /* after this, start_output_stream() no longer touches the dummybuf thread */
+    pthread_mutex_lock(&adev->lock);
+    adev->tfa9895_owns_playback_pcm = false;
+    pthread_mutex_unlock(&adev->lock);
+    dummybuf_thread_close(adev);
+}
+
+/*
+ * always called with adev lock held. A stream starting on the playback PCM takes
+ * it back from the dummybuf thread: its own writes clock I2S for the rest of the
+ * tfa9895 configuration. Only waits for the dummybuf thread to close the PCM.
+ */
+static void tfa9895_preempt_dummybuf_l(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+
+    if (!adev->tfa9895_owns_playback_pcm)
+        return;
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (pcm_device->pcm_profile == &pcm_device_playback)
+            break;
+    }
+    if (node == &out->pcm_dev_list)
+        return;
+
+    ALOGV("%s: stream takes over the I2S clock", __func__);
+    if (adev->dummybuf_thread) {
+        pthread_mutex_lock(&adev->dummybuf_thread_lock);
+        adev->dummybuf_thread_cancel = 1;
+        if (adev->dummybuf_thread_pcm != NULL)
+            pcm_stop(adev->dummybuf_thread_pcm);
+        pthread_cond_broadcast(&adev->dummybuf_thread_cond);
+        while (!adev->dummybuf_thread_exited)
+            pthread_cond_wait(&adev->dummybuf_thread_cond, &adev->dummybuf_thread_lock);
+        pthread_mutex_unlock(&adev->dummybuf_thread_lock);
+    }
+    /* the worker still joins the thread in tfa9895_stop_dummybuf() */
+    adev->tfa9895_owns_playback_pcm = false;
+}
+
+/*
+ * The tfa9895 speaker amp must see an I2S clock for some time before it accepts
+ * DSP related I2C commands. This worker does the (re)configuration so that
+ * neither adev_open() nor the playback thread has to wait for it: if a speaker
+ * stream is playing, its own PCM provides the clock; otherwise the dummybuf
+ * thread is used to generate it.
+ */
+static void *tfa9895_config_thread(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    bool use_dummybuf;
+
+    thread_policy_apply(adev, THREAD_ROLE_TFA9895);
+    prctl(PR_SET_NAME, (unsigned long)"TFA9895 Config", 0, 0, 0);
+
+    ALOGV("%s: enter", __func__);
+    pthread_mutex_lock(&adev->tfa9895_config_lock);
+    for (;;) {
+        if (adev->tfa9895_config_exit)
+            break;
+        if (adev->tfa9895_config_state != TFA9895_CONFIG_PENDING) {
+            pthread_cond_wait(&adev->tfa9895_config_cond, &adev->tfa9895_config_lock);
+            continue;
+        }
+        adev->tfa9895_config_state = TFA9895_CONFIG_RUNNING;
+        pthread_mutex_unlock(&adev->tfa9895_config_lock);
+
+        /* the init thread runs the dummybuf thread itself until then */
+        adev_init_wait(adev);
+        if (tfa9895_speaker_active(adev))
+            usleep(TFA9895_I2S_LEAD_US);
+        /* the stream may have gone to standby during the lead time */
+        use_dummybuf = tfa9895_start_dummybuf(adev);
+        if (use_dummybuf) {
+            if (dummybuf_thread_wait_active(adev, RETRY_NUMBER * 10))
+                usleep(TFA9895_DUMMYBUF_LEAD_US);
+            else
+                ALOGW("%s: dummybuf thread not active, configuring anyway", __func__);
+        }
+
+        pthread_mutex_lock(&adev->tfa9895_lock);
+        adev->tfa9895_mode_change &= ~0x1;
+        adev->tfa9895_init =
+            adev->htc_acoustic_set_amp_mode(adev->mode, AUDIO_DEVICE_OUT_SPEAKER, 0, 0, false);
+        if (!adev->tfa9895_init) {
+            if (++adev->tfa9895_config_failures < RETRY_NUMBER) {
+                ALOGE("set_amp_mode failed, need to re-config again");
+                adev->tfa9895_mode_change |= 0x1;
+            } else {
+                ALOGE("set_amp_mode failed %d times, giving up until next mode change",
+                      adev->tfa9895_config_failures);
+            }
+        } else {
+            adev->tfa9895_config_failures = 0;
+        }
+        ALOGI("@@##tfa9895_config_thread Done!! tfa9895_mode_change=%d", adev->tfa9895_mode_change);
+        pthread_mutex_unlock(&adev->tfa9895_lock);
+
+        if (use_dummybuf)
+            tfa9895_stop_dummybuf(adev);
+
+        pthread_mutex_lock(&adev->tfa9895_config_lock);
+        if (adev->tfa9895_config_state == TFA9895_CONFIG_RUNNING)
+            adev->tfa9895_config_state = TFA9895_CONFIG_IDLE;
+    }
+    pthread_mutex_unlock(&adev->tfa9895_config_lock);
+    ALOGV("%s: exit", __func__);
+    return NULL;
+}
+
+/* Post a configuration request to the tfa9895 worker. Never blocks on the amp. */
+static void tfa9895_config_request(struct audio_device *adev)
+{
+    if (!adev->tfa9895_config_thread)
+        return;
+
+    pthread_mutex_lock(&adev->tfa9895_config_lock);
+    if (adev->tfa9895_config_state == TFA9895_CONFIG_IDLE) {
+        adev->tfa9895_config_state = TFA9895_CONFIG_PENDING;
+        pthread_cond_signal(&adev->tfa9895_config_cond);
+    }
+    pthread_mutex_unlock(&adev->tfa9895_config_lock);
+}
+
+static void tfa9895_config_thread_open(struct audio_device *adev)
+{
+    adev->tfa9895_config_state = TFA9895_CONFIG_IDLE;
+    adev->tfa9895_config_exit = false;
+    adev->tfa9895_owns_playback_pcm = false;
+    pthread_mutex_init(&adev->tfa9895_config_lock, (const pthread_mutexattr_t *) NULL);
+    pthread_cond_init(&adev->tfa9895_config_cond, (const pthread_condattr_t *) NULL);
+    if (pthread_create(&adev->tfa9895_config_thread, (const pthread_attr_t *) NULL,
+                       tfa9895_config_thread, adev) != 0) {
+        ALOGE("%s: tfa9895 config thread create fail", __func__);
+        adev->tfa9895_config_thread = 0;
+    }
+}
+
+static void tfa9895_config_thread_close(struct audio_device *adev)
+{
+    if (!adev->tfa9895_config_thread)
+        return;
+
+    pthread_mutex_lock(&adev->tfa9895_config_lock);
+    adev->tfa9895_config_exit = true;
+    pthread_cond_signal(&adev->tfa9895_config_cond);
+    pthread_mutex_unlock(&adev->tfa9895_config_lock);
+
+    pthread_join(adev->tfa9895_config_thread, (void **) NULL);
+    pthread_cond_destroy(&adev->tfa9895_config_cond);
+    pthread_mutex_destroy(&adev->tfa9895_config_lock);
+    adev->tfa9895_config_thread = 0;
+}
+
+/*
+ * Copies playback data straight into the mmap'ed DMA buffer with
+ * pcm_mmap_begin()/pcm_mmap_commit(). The PCM is started once the start
+ * threshold is queued. The PCM is opened with PCM_NOIRQ so pcm_wait() does not
+ * return on period interrupts: room is polled for every half period instead.
+ */
+static int pcm_device_mmap_write(struct pcm_device *pcm_device, const void *data,
+                                 size_t bytes)
+{
+    struct pcm *pcm = pcm_device->pcm;
+    const struct pcm_config *config = &pcm_device->pcm_profile->config;
+    const uint8_t *src = (const uint8_t *)data;
+    unsigned int frames = pcm_bytes_to_frames(pcm, bytes);
+    unsigned int buffer_size = pcm_get_buffer_size(pcm);
+    int wait_ms = config->period_size * 1000 / config->rate / 2;
+    unsigned int offset, count;
+    void *area;
+    int avail;
+    int ret;
+
+    if (wait_ms < 1)
+        wait_ms = 1;
+
+    while (frames > 0) {
+        avail = pcm_mmap_avail(pcm);
+        if (avail < 0)
+            return avail;
+        if ((unsigned int)avail > buffer_size) {
+            /* underrun: the hardware pointer overtook the application pointer */
+            ALOGV("%s: underrun, restarting", __func__);
+            pcm_device->xruns++;
+            pcm_device->mmap_started = false;
+            pcm_device->mmap_appl = 0;
+            ret = pcm_prepare(pcm);
+            if (ret < 0)
+                return ret;
+            continue;
+        }
+        if (avail == 0) {
+            if (!pcm_device->mmap_started) {
+                ret = pcm_start(pcm);
+                if (ret < 0)
+                    return ret;
+                pcm_device->mmap_started = true;
+            }
+            pcm_wait(pcm, wait_ms);
+            continue;
+        }
+
+        count = frames < (unsigned int)avail ? frames : (unsigned int)avail;
+        ret = pcm_mmap_begin(pcm, &area, &offset, &count);
+        if (ret < 0)
+            return ret;
+        memcpy((uint8_t *)area + pcm_frames_to_bytes(pcm, offset), src,
+               pcm_frames_to_bytes(pcm, count));
+        ret = pcm_mmap_commit(pcm, offset, count);
+        if (ret < 0)
+            return ret;
+
+        src += pcm_frames_to_bytes(pcm, count);
+        frames -= count;
+        pcm_device->mmap_appl += count;
+
+        if (!pcm_device->mmap_started && pcm_device->mmap_appl >= config->start_threshold) {
+            ret = pcm_start(pcm);
+            if (ret < 0)
+                return ret;
+            pcm_device->mmap_started = true;
         }
-        str_parms_add_str(reply, AUDIO_PARAMETER_STREAM_SUP_CHANNELS, value);
-        str = str_parms_to_str(reply);
-    } else {
-        str = strdup(keys);
     }
-    str_parms_destroy(query);
-    str_parms_destroy(reply);
-    ALOGV("%s: exit: returns - %s", __func__, str);
-    return str;
+    return 0;
 }
 
-static uint32_t out_get_latency(const struct audio_stream_out *stream)
+/* Playback PCMs are opened with PCM_NORESTART so that underruns are reported here */
+static int pcm_device_write(struct pcm_device *pcm_device, const void *data, size_t bytes)
 {
-    struct stream_out *out = (struct stream_out *)stream;
+    int ret;
 
-    if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD)
-        return COMPRESS_OFFLOAD_PLAYBACK_LATENCY;
+    if (pcm_device->mmap)
+        return pcm_device_mmap_write(pcm_device, data, bytes);
+    ret = pcm_write(pcm_device->pcm, data, bytes);
+    if (ret == -EPIPE) {
+        /* the next write prepares the PCM again */
+        pcm_device->xruns++;
+        ret = pcm_write(pcm_device->pcm, data, bytes);
+    }
+    return ret;
+}
 
-    return (out->config.period_count * out->config.period_size * 1000) /
-           (out->config.rate);
+/*
+ * Float, 8.24 and packed 24 bit samples to 16 bit with TPDF dither. Samples are
+ * first brought to Q31 (float is clamped to [-1, 1]), then a triangular dither
+ * of +/- 1 LSB is added before rounding. Sample i uses dither generator i % 4,
+ * so that the NEON and scalar paths are bit exact.
+ */
+#define DITHER_LCG_MUL 1664525u
+#define DITHER_LCG_ADD 1013904223u
+
+static inline int32_t float_to_q31(float x)
+{
+    if (x >= 1.0f)
+        return INT32_MAX;
+    if (x <= -1.0f)
+        return INT32_MIN;
+    if (x != x)
+        return 0;
+    return (int32_t)(x * 2147483648.0f);
 }
 
-static int out_set_volume(struct audio_stream_out *stream, float left,
-                          float right)
+static inline int32_t p24_to_q31(const uint8_t *p)
 {
-    struct stream_out *out = (struct stream_out *)stream;
-    struct audio_device *adev = out->dev;
-    int offload_volume[2];//For stereo
+    return (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24));
+}
 
-    if (out->usecase == USECASE_AUDIO_PLAYBACK_MULTI_CH) {
-        /* only take left channel into account: the API is for stereo anyway */
-        out->muted = (left == 0.0f);
-        return 0;
-    } else if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD) {
-        struct mixer_ctl *ctl;
-        struct mixer *mixer = NULL;
+static inline int16_t q31_to_s16_dither(int32_t q31, uint32_t *state)
+{
+    int64_t sample;
+    int32_t r1, r2;
 
-        offload_volume[0] = (int)(left * COMPRESS_PLAYBACK_VOLUME_MAX);
-        offload_volume[1] = (int)(right * COMPRESS_PLAYBACK_VOLUME_MAX);
+    *state = *state * DITHER_LCG_MUL + DITHER_LCG_ADD;
+    r1 = (int32_t)(*state >> 16);
+    *state = *state * DITHER_LCG_MUL + DITHER_LCG_ADD;
+    r2 = (int32_t)(*state >> 16);
 
-        mixer = mixer_open(MIXER_CARD);
-        if (!mixer) {
-            ALOGE("%s unable to open the mixer for card %d, aborting.",
-                    __func__, MIXER_CARD);
-            return -EINVAL;
+    sample = (int64_t)q31 + (r1 - r2);
+    if (sample > INT32_MAX)
+        sample = INT32_MAX;
+    else if (sample < INT32_MIN)
+        sample = INT32_MIN;
+    sample = (sample + (1 << 15)) >> 16;
+    return sample > INT16_MAX ? INT16_MAX : (int16_t)sample;
+}
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+static inline int16x4_t q31_to_s16_dither_neon(int32x4_t q31, uint32x4_t *state)
+{
+    const uint32x4_t mul = vdupq_n_u32(DITHER_LCG_MUL);
+    const uint32x4_t add = vdupq_n_u32(DITHER_LCG_ADD);
+    int32x4_t r1, r2;
+
+    *state = vmlaq_u32(add, *state, mul);
+    r1 = vreinterpretq_s32_u32(vshrq_n_u32(*state, 16));
+    *state = vmlaq_u32(add, *state, mul);
+    r2 = vreinterpretq_s32_u32(vshrq_n_u32(*state, 16));
+
+    return vqrshrn_n_s32(vqaddq_s32(q31, vsubq_s32(r1, r2)), 16);
+}
+#endif
+
+/* same saturation as vqshlq_n_s32(x, 8) */
+static inline int32_t q8_23_to_q31_sat(int32_t v)
+{
+    if (v >= (1 << 23))
+        return INT32_MAX;
+    if (v < -(1 << 23))
+        return INT32_MIN;
+    return (int32_t)((uint32_t)v << 8);
+}
+
+static void convert_to_s16_dither(int16_t *dst, const void *src, size_t samples,
+                                  audio_format_t format, uint32_t *state)
+{
+    size_t i = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    uint32x4_t lcg = vld1q_u32(state);
+
+    if (format == AUDIO_FORMAT_PCM_FLOAT) {
+        const float *in = (const float *)src;
+        for (; i + 4 <= samples; i += 4) {
+            /* vcvtq saturates, NaN converts to 0 */
+            int32x4_t q31 = vcvtq_s32_f32(vmulq_n_f32(vld1q_f32(in + i), 2147483648.0f));
+            vst1_s16(dst + i, q31_to_s16_dither_neon(q31, &lcg));
         }
-        ctl = mixer_get_ctl_by_name(mixer, MIXER_CTL_COMPRESS_PLAYBACK_VOLUME);
-        if (!ctl) {
-            ALOGE("%s: Could not get ctl for mixer cmd - %s",
-                  __func__, MIXER_CTL_COMPRESS_PLAYBACK_VOLUME);
-            mixer_close(mixer);
-            return -EINVAL;
+    } else if (format == AUDIO_FORMAT_PCM_8_24_BIT) {
+        const int32_t *in = (const int32_t *)src;
+        for (; i + 4 <= samples; i += 4) {
+            /* 8.24 has headroom: saturate samples beyond full scale */
+            int32x4_t q31 = vqshlq_n_s32(vld1q_s32(in + i), 8);
+            vst1_s16(dst + i, q31_to_s16_dither_neon(q31, &lcg));
+        }
+    } else if (format == AUDIO_FORMAT_PCM_24_BIT_PACKED) {
+        const uint8_t *in = (const uint8_t *)src;
+        for (; i + 8 <= samples; i += 8) {
+            uint8x8x3_t b = vld3_u8(in + i * 3);
+            uint16x8_t hi = vorrq_u16(vshll_n_u8(b.val[2], 8), vmovl_u8(b.val[1]));
+            uint16x8_t lo = vshll_n_u8(b.val[0], 8);
+            int32x4_t q31_lo = vreinterpretq_s32_u32(vorrq_u32(
+                    vshll_n_u16(vget_low_u16(hi), 16), vmovl_u16(vget_low_u16(lo))));
+            int32x4_t q31_hi = vreinterpretq_s32_u32(vorrq_u32(
+                    vshll_n_u16(vget_high_u16(hi), 16), vmovl_u16(vget_high_u16(lo))));
+            vst1_s16(dst + i, q31_to_s16_dither_neon(q31_lo, &lcg));
+            vst1_s16(dst + i + 4, q31_to_s16_dither_neon(q31_hi, &lcg));
         }
-        ALOGV("out_set_volume set offload volume (%f, %f)", left, right);
-        mixer_ctl_set_array(ctl, offload_volume,
-                            sizeof(offload_volume)/sizeof(offload_volume[0]));
-        mixer_close(mixer);
-        return 0;
     }
+    vst1q_u32(state, lcg);
+#endif
+    for (; i < samples; i++) {
+        int32_t q31;
 
-    return -ENOSYS;
+        if (format == AUDIO_FORMAT_PCM_FLOAT)
+            q31 = float_to_q31(((const float *)src)[i]);
+        else if (format == AUDIO_FORMAT_PCM_8_24_BIT)
+            q31 = q8_23_to_q31_sat(((const int32_t *)src)[i]);
+        else
+            q31 = p24_to_q31((const uint8_t *)src + i * 3);
+        dst[i] = q31_to_s16_dither(q31, &state[i & 3]);
+    }
 }
 
-static void *tfa9895_config_thread(void *context)
+static bool is_supported_pcm_output_format(audio_format_t format)
 {
-    ALOGV("%s: enter", __func__);
-    pthread_detach(pthread_self());
-    struct audio_device *adev = (struct audio_device *)context;
-    pthread_mutex_lock(&adev->tfa9895_lock);
-    adev->tfa9895_init =
-        adev->htc_acoustic_set_amp_mode(adev->mode, AUDIO_DEVICE_OUT_SPEAKER, 0, 0, false);
-    if (!adev->tfa9895_init) {
-        ALOGE("set_amp_mode failed, need to re-config again");
-        adev->tfa9895_mode_change |= 0x1;
-    }
-    ALOGI("@@##tfa9895_config_thread Done!! tfa9895_mode_change=%d", adev->tfa9895_mode_change);
-    pthread_mutex_unlock(&adev->tfa9895_lock);
-    dummybuf_thread_close(adev);
-    return NULL;
+    return format == AUDIO_FORMAT_PCM_16_BIT || format == AUDIO_FORMAT_PCM_FLOAT ||
+           format == AUDIO_FORMAT_PCM_8_24_BIT || format == AUDIO_FORMAT_PCM_24_BIT_PACKED;
 }
 
-static int fast_set_affinity(pid_t tid) {
-    cpu_set_t cpu_set;
-    int cpu_num;
-    const char *irq_procfs = "/proc/asound/irq_affinity";
-    FILE *fp;
-
-    if ((fp = fopen(irq_procfs, "r")) == NULL) {
-        ALOGW("Procfs node %s not found", irq_procfs);
-        return -1;
+/*
+ * Stereo downmix of 5.1 (FL FR FC LFE BL BR) and 7.1 (FL FR FC LFE BL BR SL SR):
+ * L = FL + g * (FC + BL [+ SL]), R = FR + g * (FC + BR [+ SR]) with g = -3 dB,
+ * saturated to 16 bit. LFE is dropped. The sums are done in Q14 so that the
+ * worst case (three surround terms) fits in 32 bit.
+ */
+static inline int16_t downmix_clamp16(int32_t sample)
+{
+    if ((sample >> 15) ^ (sample >> 31))
+        sample = 0x7FFF ^ (sample >> 31);
+    return (int16_t)sample;
+}
+
+static inline int16_t downmix_sum(int32_t front, int32_t surround)
+{
+    return downmix_clamp16((front * (1 << 14) + surround * DOWNMIX_SURROUND_GAIN_Q14 +
+                            (1 << 13)) >> 14);
+}
+
+static void downmix_to_stereo(int16_t *dst, const int16_t *src, size_t frames,
+                              unsigned int channels)
+{
+    size_t i = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    const int16x4_t gain = vdup_n_s16(DOWNMIX_SURROUND_GAIN_Q14);
+    int32x4_t acc_l, acc_r;
+    int16x4x2_t out;
+
+    /* 4 frames per iteration, deinterleaved by vld3q/vld4q then split with vuzpq */
+    if (channels == 6) {
+        for (; i + 4 <= frames; i += 4, src += 24, dst += 8) {
+            int16x8x3_t in = vld3q_s16(src);
+            /* [FL x4 | FR x4], [LFE x4 | BL x4] */
+            int16x8x2_t fr = vuzpq_s16(in.val[0], in.val[1]);
+            /* [FC x4 | FC x4], [BR x4 | BR x4] */
+            int16x8x2_t cs = vuzpq_s16(in.val[2], in.val[2]);
+
+            acc_l = vshll_n_s16(vget_low_s16(fr.val[0]), 14);
+            acc_l = vmlal_s16(acc_l, vget_low_s16(cs.val[0]), gain);
+            acc_l = vmlal_s16(acc_l, vget_high_s16(fr.val[1]), gain);
+            acc_r = vshll_n_s16(vget_high_s16(fr.val[0]), 14);
+            acc_r = vmlal_s16(acc_r, vget_low_s16(cs.val[0]), gain);
+            acc_r = vmlal_s16(acc_r, vget_low_s16(cs.val[1]), gain);
+            out.val[0] = vqrshrn_n_s32(acc_l, 14);
+            out.val[1] = vqrshrn_n_s32(acc_r, 14);
+            vst2_s16(dst, out);
+        }
+    } else if (channels == 8) {
+        for (; i + 4 <= frames; i += 4, src += 32, dst += 8) {
+            int16x8x4_t in = vld4q_s16(src);
+            /* [FL x4 | FR x4], [BL x4 | BR x4] */
+            int16x8x2_t fb = vuzpq_s16(in.val[0], in.val[1]);
+            /* [FC x4 | LFE x4], [SL x4 | SR x4] */
+            int16x8x2_t cs = vuzpq_s16(in.val[2], in.val[3]);
+
+            acc_l = vshll_n_s16(vget_low_s16(fb.val[0]), 14);
+            acc_l = vmlal_s16(acc_l, vget_low_s16(cs.val[0]), gain);
+            acc_l = vmlal_s16(acc_l, vget_low_s16(fb.val[1]), gain);
+            acc_l = vmlal_s16(acc_l, vget_low_s16(cs.val[1]), gain);
+            acc_r = vshll_n_s16(vget_high_s16(fb.val[0]), 14);
+            acc_r = vmlal_s16(acc_r, vget_low_s16(cs.val[0]), gain);
+            acc_r = vmlal_s16(acc_r, vget_high_s16(fb.val[1]), gain);
+            acc_r = vmlal_s16(acc_r, vget_high_s16(cs.val[1]), gain);
+            out.val[0] = vqrshrn_n_s32(acc_l, 14);
+            out.val[1] = vqrshrn_n_s32(acc_r, 14);
+            vst2_s16(dst, out);
+        }
     }
-
-    if (fscanf(fp, "%d", &cpu_num) != 1) {
-        ALOGW("Couldn't read CPU id from procfs node %s", irq_procfs);
-        fclose(fp);
-        return -1;
+#endif
+    for (; i < frames; i++, src += channels, dst += 2) {
+        if (channels == 8) {
+            dst[0] = downmix_sum(src[0], (int32_t)src[2] + src[4] + src[6]);
+            dst[1] = downmix_sum(src[1], (int32_t)src[2] + src[5] + src[7]);
+        } else {
+            dst[0] = downmix_sum(src[0], (int32_t)src[2] + src[4]);
+            dst[1] = downmix_sum(src[1], (int32_t)src[2] + src[5]);
+        }
     }
-    fclose(fp);
+}
 
-    CPU_ZERO(&cpu_set);
-    CPU_SET(cpu_num, &cpu_set);
-    return sched_setaffinity(tid, sizeof(cpu_set), &cpu_set);
+/*
+ * Channel count of the PCM for a multichannel stream: the stream layout if the
+ * HDMI sink reports enough channels, stereo otherwise.
+ */
+static unsigned int get_multi_channel_pcm_channels(struct audio_device *adev,
+                                                   audio_devices_t devices,
+                                                   unsigned int stream_channels)
+{
+    if ((devices & AUDIO_DEVICE_OUT_AUX_DIGITAL) &&
+            (unsigned int)edid_get_max_channels(adev) >= stream_channels)
+        return stream_channels;
+    return PLAYBACK_HDMI_DEFAULT_CHANNEL_COUNT;
 }
 
 static ssize_t out_write(struct audio_stream_out *stream, const void *buffer,
@@ -2986,24 +5688,37 @@ static ssize_t out_write(struct audio_stream_out *stream, const void *buffer,
     struct listnode *node;
     size_t frame_size = audio_stream_out_frame_size(stream);
     size_t frames_wr = 0, frames_rq = 0;
-    unsigned char *data = NULL;
-    struct pcm_config config;
+    /* data actually written to the PCM, differs from buffer when downmixing */
+    const void *pcm_buf = buffer;
+    size_t pcm_bytes = bytes;
+    size_t pcm_frame_size = frame_size;
+    int64_t write_start_ns = get_time_ns();
+    int64_t write_ns, end_ns;
 #ifdef PREPROCESSING_ENABLED
     size_t in_frames = bytes / frame_size;
     size_t out_frames = in_frames;
     struct stream_in *in = NULL;
 #endif
-    pid_t tid;
-    int err;
+    bool was_standby;
+    uint32_t xruns;
+    uint32_t amp_seq = 0;
+    bool resampled = false;
+    bool cold_start, warm_resume;
 
     lock_output_stream(out);
+    if (out->standby_warm &&
+            out->standby_flush != android_atomic_acquire_load(&adev->standby_flush)) {
+        /* the mode changed meanwhile: restart from scratch */
+        pthread_mutex_lock(&adev->lock);
+        do_out_standby_l(out);
+        pthread_mutex_unlock(&adev->lock);
+    }
+    cold_start = out->standby;
+    warm_resume = out->standby_warm;
+    out->standby_warm = false;
 
     if (out->usecase == USECASE_AUDIO_PLAYBACK && !out->is_fastmixer_affinity_set) {
-        tid = gettid();
-        err = fast_set_affinity(tid);
-        if (err < 0) {
-            ALOGW("Couldn't set affinity for tid %d; error %d", tid, err);
-        }
+        thread_policy_apply(adev, THREAD_ROLE_FAST_MIXER);
         out->is_fastmixer_affinity_set = true;
     }
 
@@ -3019,7 +5734,9 @@ static ssize_t out_write(struct audio_stream_out *stream, const void *buffer,
         }
 #endif
         pthread_mutex_lock(&adev->lock);
+        amp_seq = adev->route_amp_seq;
         ret = start_output_stream(out);
+        amp_seq = adev->route_amp_seq != amp_seq ? adev->route_amp_seq : 0;
         /* ToDo: If use case is compress offload should return 0 */
         if (ret != 0) {
             pthread_mutex_unlock(&adev->lock);
@@ -3046,8 +5763,20 @@ static ssize_t out_write(struct audio_stream_out *stream, const void *buffer,
             pthread_mutex_unlock(&adev->lock_inputs);
         }
 #endif
+        if (amp_seq != 0) {
+            /* the headset amp must be configured before the first write starts the PCM */
+            pthread_mutex_unlock(&out->lock);
+            route_cmd_wait(adev, amp_seq);
+            lock_output_stream(out);
+            if (out->standby) {
+                ret = -ENODEV;
+                goto exit;
+            }
+        }
     }
 false_alarm:
+    /* the buffer is expected to be empty on the first write after standby */
+    was_standby = (out->stats.last_op_ns == 0);
 
     if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD) {
         ALOGVV("%s: writing buffer (%d bytes) to compress device", __func__, bytes);
@@ -3065,9 +5794,13 @@ false_alarm:
             out->send_new_metadata = 0;
         }
 
+        /* a write after the buffer filled up is a new refill wakeup */
+        if (out->offload_buffer_full || out->offload_state != OFFLOAD_STATE_PLAYING)
+            update_offload_wakeups_l(out);
         ret = compress_write(out->compr, buffer, bytes);
         ALOGVV("%s: writing buffer (%d bytes) to compress device returned %d", __func__, bytes, ret);
-        if (ret >= 0 && ret < (ssize_t)bytes) {
+        out->offload_buffer_full = (ret >= 0 && ret < (ssize_t)bytes);
+        if (out->offload_buffer_full) {
             send_offload_cmd_l(out, OFFLOAD_CMD_WAIT_FOR_BUFFER);
         }
         if (out->offload_state != OFFLOAD_STATE_PLAYING) {
@@ -3083,140 +5816,152 @@ false_alarm:
 #endif
         return ret;
     } else {
-#ifdef PREPROCESSING_ENABLED
-        if (android_atomic_acquire_load(&adev->echo_reference_generation)
-                != out->echo_reference_generation) {
-            pthread_mutex_lock(&adev->lock);
-            if (out->echo_reference != NULL) {
-                ALOGV("%s: release_echo_reference %p", __func__, out->echo_reference);
-                release_echo_reference(out->echo_reference);
-            }
-            // note that adev->echo_reference_generation here can be different from the one
-            // tested above but it doesn't matter as we now have the adev mutex and it is consistent
-            // with what has been set by get_echo_reference() or put_echo_reference()
-            out->echo_reference_generation = adev->echo_reference_generation;
-            out->echo_reference = adev->echo_reference;
-            ALOGV("%s: update echo reference generation %d", __func__,
-                  out->echo_reference_generation);
-            pthread_mutex_unlock(&adev->lock);
-        }
-#endif
+        /* amp reconfiguration is done by the tfa9895 worker, playback keeps running */
+        if (adev->tfa9895_mode_change == 0x1 && (out->devices & AUDIO_DEVICE_OUT_SPEAKER))
+            tfa9895_config_request(adev);
 
         if (out->muted)
             memset((void *)buffer, 0, bytes);
+        /* the codec takes 16 bit samples, other formats are converted here */
+        if (out->format != AUDIO_FORMAT_PCM_16_BIT) {
+            size_t frames = bytes / frame_size;
+            size_t samples = frames * audio_channel_count_from_out_mask(out->channel_mask);
+            int64_t convert_start_ns = get_time_ns();
+
+            pcm_frame_size = audio_channel_count_from_out_mask(out->channel_mask) *
+                                 sizeof(int16_t);
+            pcm_bytes = samples * sizeof(int16_t);
+            if (pcm_bytes > out->convert_buf_size) {
+                int16_t *convert_buf = (int16_t *)realloc(out->convert_buf, pcm_bytes);
+                if (convert_buf == NULL) {
+                    ret = -ENOMEM;
+                    goto exit;
+                }
+                out->convert_buf = convert_buf;
+                out->convert_buf_size = pcm_bytes;
+            }
+            convert_to_s16_dither(out->convert_buf, buffer, samples, out->format,
+                                  out->dither_state);
+            pcm_buf = out->convert_buf;
+            out->convert_ns += get_time_ns() - convert_start_ns;
+            out->convert_frames += frames;
+        }
+        if (out->usecase == USECASE_AUDIO_PLAYBACK_MULTI_CH &&
+                out->config.channels < audio_channel_count_from_out_mask(out->channel_mask)) {
+            size_t frames = bytes / frame_size;
+            int64_t downmix_start_ns = get_time_ns();
+
+            pcm_frame_size = out->config.channels * sizeof(int16_t);
+            pcm_bytes = frames * pcm_frame_size;
+            if (pcm_bytes > out->downmix_buf_size) {
+                int16_t *downmix_buf = (int16_t *)realloc(out->downmix_buf, pcm_bytes);
+                if (downmix_buf == NULL) {
+                    ret = -ENOMEM;
+                    goto exit;
+                }
+                out->downmix_buf = downmix_buf;
+                out->downmix_buf_size = pcm_bytes;
+            }
+            /* pcm_buf is the 16 bit conversion of buffer if there was one */
+            downmix_to_stereo(out->downmix_buf, (const int16_t *)pcm_buf, frames,
+                              audio_channel_count_from_out_mask(out->channel_mask));
+            pcm_buf = out->downmix_buf;
+            out->downmix_ns += get_time_ns() - downmix_start_ns;
+            out->downmix_frames += frames;
+        }
+        if (adev->latency_test.state == LATENCY_TEST_RECORDING)
+            latency_test_play(adev, out, (int16_t *)pcm_buf, pcm_bytes / pcm_frame_size,
+                              pcm_frame_size / sizeof(int16_t));
         list_for_each(node, &out->pcm_dev_list) {
             pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
-            if (pcm_device->resampler) {
-                if (bytes * pcm_device->pcm_profile->config.rate / out->sample_rate + frame_size
-                        > pcm_device->res_byte_count) {
-                    pcm_device->res_byte_count =
-                        bytes * pcm_device->pcm_profile->config.rate / out->sample_rate + frame_size;
+            if (pcm_device->decimator) {
+                frames_wr = sco_decimate(pcm_device->decimator, (const int16_t *)pcm_buf,
+                                         pcm_bytes / pcm_frame_size);
+                resampled = true;
+            } else if (pcm_device->resampler) {
+                size_t res_frame_size = pcm_device->res_channels * sizeof(int16_t);
+                int16_t *res_in = (int16_t *)pcm_buf;
+
+                frames_rq = pcm_bytes / pcm_frame_size;
+                if (res_frame_size != pcm_frame_size) {
+                    if (frames_rq > pcm_device->fold_frames) {
+                        int16_t *fold = (int16_t *)realloc(pcm_device->fold_buffer,
+                                                           frames_rq * res_frame_size);
+                        if (fold == NULL) {
+                            ret = -ENOMEM;
+                            goto exit;
+                        }
+                        pcm_device->fold_buffer = fold;
+                        pcm_device->fold_frames = frames_rq;
+                    }
+                    fold_to_mono(pcm_device->fold_buffer, (const int16_t *)pcm_buf, frames_rq,
+                                 pcm_frame_size / sizeof(int16_t));
+                    res_in = pcm_device->fold_buffer;
+                }
+                if (frames_rq * res_frame_size * pcm_device->pcm_profile->config.rate /
+                        out->sample_rate + res_frame_size > pcm_device->res_byte_count) {
+                    pcm_device->res_byte_count = frames_rq * res_frame_size *
+                        pcm_device->pcm_profile->config.rate / out->sample_rate + res_frame_size;
                     pcm_device->res_buffer =
                         realloc(pcm_device->res_buffer, pcm_device->res_byte_count);
                     ALOGV("%s: resampler res_byte_count = %zu", __func__,
                         pcm_device->res_byte_count);
                 }
-                frames_rq = bytes / frame_size;
-                frames_wr = pcm_device->res_byte_count / frame_size;
+                frames_wr = pcm_device->res_byte_count / res_frame_size;
+                resampled = true;
                 ALOGVV("%s: resampler request frames = %d frame_size = %d",
-                    __func__, frames_rq, frame_size);
+                    __func__, frames_rq, pcm_frame_size);
                 pcm_device->resampler->resample_from_input(pcm_device->resampler,
-                    (int16_t *)buffer, &frames_rq, (int16_t *)pcm_device->res_buffer, &frames_wr);
+                    res_in, &frames_rq, (int16_t *)pcm_device->res_buffer, &frames_wr);
                 ALOGVV("%s: resampler output frames_= %d", __func__, frames_wr);
             }
             if (pcm_device->pcm) {
 #ifdef PREPROCESSING_ENABLED
-                if (out->echo_reference != NULL && pcm_device->pcm_profile->devices != SND_DEVICE_OUT_SPEAKER) {
+                if (out == adev->primary_output &&
+                        android_atomic_acquire_load(&adev->echo_ref_ring.active) &&
+                        pcm_device->pcm_profile->devices != SND_DEVICE_OUT_SPEAKER) {
                     struct echo_reference_buffer b;
-                    b.raw = (void *)buffer;
-                    b.frame_count = in_frames;
 
                     get_playback_delay(out, out_frames, &b);
-                    out->echo_reference->write(out->echo_reference, &b);
+                    echo_ref_ring_push(adev, (const int16_t *)pcm_buf, in_frames,
+                                       pcm_frame_size / sizeof(int16_t), &b);
                  }
 #endif
-                if (adev->tfa9895_mode_change == 0x1) {
-                    if (out->devices & AUDIO_DEVICE_OUT_SPEAKER) {
-                        pthread_mutex_lock(&adev->tfa9895_lock);
-                        data = (unsigned char *)
-                                calloc(pcm_frames_to_bytes(pcm_device->pcm, out->config.period_size),
-                                        sizeof(unsigned char));
-                        if (data) {
-                            int i;
-
-                            // reopen pcm with stop_threshold = INT_MAX/2
-                            memcpy(&config, &pcm_device->pcm_profile->config,
-                                    sizeof(struct pcm_config));
-                            config.stop_threshold = INT_MAX/2;
-
-                            if (pcm_device->pcm)
-                                pcm_close(pcm_device->pcm);
-
-                            for (i = 0; i < RETRY_NUMBER; i++) {
-                                pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card,
-                                        pcm_device->pcm_profile->id,
-                                        PCM_OUT | PCM_MONOTONIC, &config);
-                                if (pcm_device->pcm != NULL && pcm_is_ready(pcm_device->pcm))
-                                    break;
-                                else
-                                    usleep(10000);
-                            }
-                            if (i >= RETRY_NUMBER)
-                                ALOGE("%s: failed to reopen pcm device", __func__);
-
-                            if (pcm_device->pcm) {
-                                for (i = out->config.period_count; i > 0; i--)
-                                    pcm_write(pcm_device->pcm, (void *)data,
-                                           pcm_frames_to_bytes(pcm_device->pcm,
-                                           out->config.period_size));
-                                /* TODO: Hold on 100 ms and wait i2s signal ready
-                                     before giving dsp related i2c commands */
-                                usleep(100000);
-                                adev->tfa9895_mode_change &= ~0x1;
-                                ALOGV("@@##checking - 2: tfa9895_config_thread: "
-                                    "adev->tfa9895_mode_change=%d", adev->tfa9895_mode_change);
-                                adev->tfa9895_init =
-                                        adev->htc_acoustic_set_amp_mode(
-                                                adev->mode, AUDIO_DEVICE_OUT_SPEAKER, 0, 0, false);
-                            }
-                            free(data);
-
-                            // reopen pcm with normal stop_threshold
-                            if (pcm_device->pcm)
-                                pcm_close(pcm_device->pcm);
-
-                            for (i = 0; i < RETRY_NUMBER; i++) {
-                                pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card,
-                                        pcm_device->pcm_profile->id,
-                                        PCM_OUT | PCM_MONOTONIC, &pcm_device->pcm_profile->config);
-                                if (pcm_device->pcm != NULL && pcm_is_ready(pcm_device->pcm))
-                                    break;
-                                else
-                                    usleep(10000);
-                            }
-                            if (i >= RETRY_NUMBER) {
-                                ALOGE("%s: failed to reopen pcm device, error return", __func__);
-                                pthread_mutex_unlock(&adev->tfa9895_lock);
-                                pthread_mutex_unlock(&out->lock);
-                                return -1;
-                            }
-                        }
-                    }
-                    pthread_mutex_unlock(&adev->tfa9895_lock);
-                }
                 ALOGVV("%s: writing buffer (%d bytes) to pcm device", __func__, bytes);
-                if (pcm_device->resampler && pcm_device->res_buffer)
+                xruns = pcm_device->xruns;
+                if (pcm_device->decimator)
                     pcm_device->status =
-                        pcm_write(pcm_device->pcm, (void *)pcm_device->res_buffer,
-                            frames_wr * frame_size);
+                        pcm_device_write(pcm_device, (void *)pcm_device->decimator->out,
+                            frames_wr * sizeof(int16_t));
+                else if (pcm_device->resampler && pcm_device->res_buffer)
+                    pcm_device->status =
+                        pcm_device_write(pcm_device, (void *)pcm_device->res_buffer,
+                            frames_wr * pcm_device->res_channels * sizeof(int16_t));
                 else
-                    pcm_device->status = pcm_write(pcm_device->pcm, (void *)buffer, bytes);
-                if (pcm_device->status != 0)
+                    pcm_device->status = pcm_device_write(pcm_device, (void *)pcm_buf, pcm_bytes);
+                if (pcm_device->status != 0) {
+                    android_atomic_inc(&out->stats.errors);
                     ret = pcm_device->status;
+                }
+                if (pcm_device->xruns != xruns && !was_standby) {
+                    android_atomic_inc(&out->stats.xruns);
+#ifdef PREPROCESSING_ENABLED
+                    out->timing_valid = false;
+#endif
+                }
             }
         }
+        if (resampled)
+            android_atomic_inc(&out->stats.resampled);
+        if (ret == 0)
+            out->written += pcm_bytes / (out->config.channels * sizeof(short));
+#ifdef PREPROCESSING_ENABLED
         if (ret == 0)
-            out->written += bytes / (out->config.channels * sizeof(short));
+            out->timing_written += out_frames;
+        else
+            out->timing_valid = false;
+#endif
+        update_write_rate_l(out);
     }
 
 exit:
@@ -3228,7 +5973,14 @@ exit:
             if (pcm_device->pcm && pcm_device->status != 0)
                 ALOGE("%s: error %zd - %s", __func__, ret, pcm_get_error(pcm_device->pcm));
         }
-        out_standby(&out->stream.common);
+        /* reopen on the next write: no delayed standby after an error */
+        lock_output_stream(out);
+        if (!out->standby) {
+            pthread_mutex_lock(&adev->lock);
+            do_out_standby_l(out);
+            pthread_mutex_unlock(&adev->lock);
+        }
+        pthread_mutex_unlock(&out->lock);
         usleep(bytes * 1000000 / audio_stream_out_frame_size(stream) /
                out_get_sample_rate(&out->stream.common));
     }
@@ -3247,6 +5999,25 @@ exit:
     }
 #endif
 
+    end_ns = get_time_ns();
+    write_ns = end_ns - write_start_ns;
+    if (write_ns > out->write_max_ns)
+        out->write_max_ns = write_ns;
+    if (warm_resume) {
+        out->resume_warm_count++;
+        out->resume_warm_sum_ns += write_ns;
+        if (write_ns > out->resume_warm_max_ns)
+            out->resume_warm_max_ns = write_ns;
+    } else if (cold_start && out->standby_thread != 0) {
+        out->resume_cold_count++;
+        out->resume_cold_sum_ns += write_ns;
+        if (write_ns > out->resume_cold_max_ns)
+            out->resume_cold_max_ns = write_ns;
+    }
+    if (ret == 0)
+        stream_stats_update(&out->stats, write_start_ns, end_ns, bytes,
+                            (int64_t)(bytes / frame_size) * 1000000000LL / out->sample_rate);
+
     return bytes;
 }
 
@@ -3318,7 +6089,23 @@ static int out_get_presentation_position(const struct audio_stream_out *stream,
             struct pcm_device *pcm_device = node_to_item(list_head(&out->pcm_dev_list),
                                                    struct pcm_device, stream_list_node);
 
-            if (pcm_get_htimestamp(pcm_device->pcm, &avail, timestamp) == 0) {
+            unsigned int hw_ptr;
+            int mmap_avail;
+
+            if (pcm_device->mmap && pcm_device->mmap_started &&
+                    pcm_mmap_get_hw_ptr(pcm_device->pcm, &hw_ptr, timestamp) == 0 &&
+                    (mmap_avail = pcm_mmap_avail(pcm_device->pcm)) >= 0 &&
+                    (unsigned int)mmap_avail <= pcm_get_buffer_size(pcm_device->pcm)) {
+                /* timestamp is that of the hardware pointer, minus frames still queued */
+                int64_t signed_frames = out->written -
+                        (pcm_get_buffer_size(pcm_device->pcm) - mmap_avail);
+                signed_frames -=
+                    (render_latency(out->usecase) * out->sample_rate / 1000000LL);
+                if (signed_frames >= 0) {
+                    *frames = signed_frames;
+                    ret = 0;
+                }
+            } else if (pcm_get_htimestamp(pcm_device->pcm, &avail, timestamp) == 0) {
                 size_t kernel_buffer_size = out->config.period_size * out->config.period_count;
                 int64_t signed_frames = out->written - kernel_buffer_size + avail;
                 /* This adjustment accounts for buffering after app processor.
@@ -3476,6 +6263,232 @@ static size_t in_get_buffer_size(const struct audio_stream *stream)
                                  in->devices);
 }
 
+/*
+ * Returns the offset in hist of the frames matching tail, i.e. with the highest
+ * normalized correlation, or -1 if tail is too quiet to be located.
+ */
+static ssize_t hotword_find_overlap(const int16_t *tail, size_t tail_frames,
+                                    const int16_t *hist, size_t hist_frames, float *score)
+{
+    int64_t tail_energy = 0, hist_energy = 0, dot;
+    float best_score = -1.0f, lag_score;
+    ssize_t best = -1;
+    size_t i, lag;
+
+    if (tail_frames == 0 || hist_frames < tail_frames)
+        return -1;
+    for (i = 0; i < tail_frames; i++) {
+        tail_energy += (int32_t)tail[i] * tail[i];
+        hist_energy += (int32_t)hist[i] * hist[i];
+    }
+    if (tail_energy < (int64_t)HOTWORD_SPLICE_MIN_RMS * HOTWORD_SPLICE_MIN_RMS * tail_frames)
+        return -1;
+
+    for (lag = 0; lag + tail_frames <= hist_frames; lag++) {
+        if (lag > 0)
+            hist_energy += (int32_t)hist[lag + tail_frames - 1] * hist[lag + tail_frames - 1] -
+                           (int32_t)hist[lag - 1] * hist[lag - 1];
+        if (hist_energy == 0)
+            continue;
+        dot = 0;
+        for (i = 0; i < tail_frames; i++)
+            dot += (int32_t)tail[i] * hist[lag + i];
+        lag_score = (float)dot / sqrtf((float)tail_energy * (float)hist_energy);
+        if (lag_score > best_score) {
+            best_score = lag_score;
+            best = lag;
+        }
+    }
+    *score = best_score;
+    return best;
+}
+
+/* Must be called with hw device mutex locked */
+static void hotword_close_pcm_l(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+    struct audio_usecase *usecase;
+
+    if (in->hotword_pcm != NULL) {
+        pcm_close(in->hotword_pcm);
+        in->hotword_pcm = NULL;
+    }
+    if (in->hotword_snd_device != SND_DEVICE_NONE) {
+        usecase = get_usecase_from_id(adev, in->usecase);
+        if (usecase != NULL)
+            disable_snd_device(adev, usecase, in->hotword_snd_device, true);
+        in->hotword_snd_device = SND_DEVICE_NONE;
+    }
+    if (in->hotword_resampler != NULL) {
+        release_resampler(in->hotword_resampler);
+        in->hotword_resampler = NULL;
+    }
+    free(in->hotword_pcm_buf);
+    in->hotword_pcm_buf = NULL;
+    free(in->hotword_dsp_tail);
+    in->hotword_dsp_tail = NULL;
+    free(in->hotword_hist);
+    in->hotword_hist = NULL;
+    in->hotword_dsp_tail_frames = 0;
+    in->hotword_hist_frames = 0;
+    in->hotword_hist_rd = 0;
+}
+
+/*
+ * Opens the regular capture PCM on the voice recognition mic while the DSP
+ * history is read, so that the handoff does not wait for routing and PCM start.
+ */
+static void hotword_open_pcm(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+    struct audio_usecase *usecase;
+    struct pcm_config config = pcm_device_capture.config;
+    int ret;
+
+    in->hotword_state = HOTWORD_STATE_DSP_ONLY;
+    if (in->requested_rate != HOTWORD_SAMPLING_RATE ||
+            audio_channel_count_from_in_mask(in->main_channels) != 1)
+        return;
+
+    pthread_mutex_lock(&adev->lock);
+    usecase = get_usecase_from_id(adev, in->usecase);
+    if (usecase != NULL && enable_snd_device(adev, usecase, SND_DEVICE_IN_VOICE_REC_MIC, true) == 0)
+        in->hotword_snd_device = SND_DEVICE_IN_VOICE_REC_MIC;
+    pthread_mutex_unlock(&adev->lock);
+    if (in->hotword_snd_device == SND_DEVICE_NONE)
+        return;
+
+    config.period_count = HOTWORD_PCM_PERIOD_COUNT;
+    in->hotword_pcm = pcm_open(pcm_device_capture.card, pcm_device_capture.id,
+                               PCM_IN | PCM_MONOTONIC, &config);
+    in->hotword_pcm_buf = (int16_t *)malloc(config.period_size * config.channels * sizeof(int16_t));
+    in->hotword_dsp_tail = (int16_t *)malloc(HOTWORD_SPLICE_MATCH_FRAMES * sizeof(int16_t));
+    in->hotword_hist = (int16_t *)malloc(HOTWORD_PCM_HISTORY_FRAMES * sizeof(int16_t));
+    ret = create_resampler(config.rate, HOTWORD_SAMPLING_RATE, 1, RESAMPLER_QUALITY_DEFAULT,
+                           NULL, &in->hotword_resampler);
+    if (in->hotword_pcm == NULL || !pcm_is_ready(in->hotword_pcm) || ret != 0 ||
+            in->hotword_pcm_buf == NULL || in->hotword_dsp_tail == NULL ||
+            in->hotword_hist == NULL || pcm_start(in->hotword_pcm) != 0) {
+        ALOGE("%s: cannot open capture PCM for handoff: %s", __func__,
+              in->hotword_pcm != NULL ? pcm_get_error(in->hotword_pcm) : "no pcm");
+        pthread_mutex_lock(&adev->lock);
+        hotword_close_pcm_l(in);
+        pthread_mutex_unlock(&adev->lock);
+        return;
+    }
+    in->hotword_state = HOTWORD_STATE_DSP;
+    in->hotword_splice_attempts = 0;
+    ALOGV("%s: capture PCM pre-opened", __func__);
+}
+
+/* Reads frames from hotword_pcm and appends them, mono at the DSP rate, to the history */
+static int hotword_capture_pcm(struct stream_in *in, size_t frames)
+{
+    unsigned int channels = pcm_device_capture.config.channels;
+    size_t in_frames = frames, out_frames, i;
+    int ret;
+
+    ret = pcm_read(in->hotword_pcm, in->hotword_pcm_buf,
+                   pcm_frames_to_bytes(in->hotword_pcm, frames));
+    if (ret != 0) {
+        /* overrun: the history is no longer continuous */
+        in->hotword_pcm_overruns++;
+        in->hotword_hist_frames = in->hotword_hist_rd = 0;
+        in->hotword_resampler->reset(in->hotword_resampler);
+        return ret;
+    }
+    for (i = 0; i < frames; i++) {
+        int32_t sum = 0;
+        unsigned int c;
+
+        for (c = 0; c < channels; c++)
+            sum += in->hotword_pcm_buf[i * channels + c];
+        in->hotword_pcm_buf[i] = (int16_t)(sum / (int32_t)channels);
+    }
+
+    /* room for the resampler output: drop the oldest history */
+    out_frames = frames * HOTWORD_SAMPLING_RATE / pcm_device_capture.config.rate + 1;
+    if (in->hotword_hist_frames + out_frames > HOTWORD_PCM_HISTORY_FRAMES) {
+        size_t drop = in->hotword_hist_frames + out_frames - HOTWORD_PCM_HISTORY_FRAMES;
+
+        if (drop > in->hotword_hist_frames)
+            drop = in->hotword_hist_frames;
+        memmove(in->hotword_hist, in->hotword_hist + drop,
+                (in->hotword_hist_frames - drop) * sizeof(int16_t));
+        in->hotword_hist_frames -= drop;
+        in->hotword_hist_rd = in->hotword_hist_rd > drop ? in->hotword_hist_rd - drop : 0;
+    }
+    in->hotword_resampler->resample_from_input(in->hotword_resampler, in->hotword_pcm_buf,
+            &in_frames, in->hotword_hist + in->hotword_hist_frames, &out_frames);
+    in->hotword_hist_frames += out_frames;
+    return 0;
+}
+
+/* Reads whatever the capture PCM has buffered, without blocking */
+static void hotword_drain_pcm(struct stream_in *in)
+{
+    unsigned int avail;
+    struct timespec ts;
+
+    while (pcm_get_htimestamp(in->hotword_pcm, &avail, &ts) == 0 &&
+            avail >= pcm_device_capture.config.period_size) {
+        if (hotword_capture_pcm(in, pcm_device_capture.config.period_size) != 0)
+            break;
+    }
+}
+
+static void hotword_keep_dsp_tail(struct stream_in *in, const int16_t *buffer, size_t frames)
+{
+    size_t keep;
+
+    if (frames >= HOTWORD_SPLICE_MATCH_FRAMES) {
+        memcpy(in->hotword_dsp_tail, buffer + frames - HOTWORD_SPLICE_MATCH_FRAMES,
+               HOTWORD_SPLICE_MATCH_FRAMES * sizeof(int16_t));
+        in->hotword_dsp_tail_frames = HOTWORD_SPLICE_MATCH_FRAMES;
+        return;
+    }
+    keep = in->hotword_dsp_tail_frames;
+    if (keep + frames > HOTWORD_SPLICE_MATCH_FRAMES) {
+        keep = HOTWORD_SPLICE_MATCH_FRAMES - frames;
+        memmove(in->hotword_dsp_tail, in->hotword_dsp_tail + in->hotword_dsp_tail_frames - keep,
+                keep * sizeof(int16_t));
+    }
+    memcpy(in->hotword_dsp_tail + keep, buffer, frames * sizeof(int16_t));
+    in->hotword_dsp_tail_frames = keep + frames;
+}
+
+/*
+ * Locates the last DSP frames in the PCM history. On a match, reading resumes
+ * from the PCM frame following them: the recognizer sees neither a gap nor the
+ * overlapping frames twice.
+ */
+static void hotword_splice(struct stream_in *in)
+{
+    ssize_t offset;
+    float score = 0.0f;
+
+    hotword_drain_pcm(in);
+    offset = hotword_find_overlap(in->hotword_dsp_tail, in->hotword_dsp_tail_frames,
+                                  in->hotword_hist, in->hotword_hist_frames, &score);
+    in->hotword_splice_attempts++;
+    if (offset >= 0 && score >= HOTWORD_SPLICE_MIN_SCORE) {
+        in->hotword_hist_rd = offset + in->hotword_dsp_tail_frames;
+        in->hotword_splice_offset = in->hotword_hist_frames - in->hotword_hist_rd;
+        in->hotword_splice_score = score;
+        in->hotword_state = HOTWORD_STATE_PCM;
+        ALOGV("%s: spliced after %u attempts, %zu frames ahead, score %f", __func__,
+              in->hotword_splice_attempts, in->hotword_splice_offset, score);
+        return;
+    }
+    if (in->hotword_splice_attempts >= HOTWORD_SPLICE_MAX_ATTEMPTS) {
+        ALOGW("%s: no overlap found, staying on the DSP stream", __func__);
+        pthread_mutex_lock(&in->dev->lock);
+        hotword_close_pcm_l(in);
+        pthread_mutex_unlock(&in->dev->lock);
+        in->hotword_state = HOTWORD_STATE_DSP_ONLY;
+    }
+}
+
 static int in_close_pcm_devices(struct stream_in *in)
 {
     struct pcm_device *pcm_device;
@@ -3507,7 +6520,10 @@ static int do_in_standby_l(struct stream_in *in)
 #endif
     if (!in->standby) {
 
+        stream_stats_standby(&in->stats);
         in_close_pcm_devices(in);
+        hotword_close_pcm_l(in);
+        in->hotword_state = HOTWORD_STATE_DSP;
 
 #ifdef PREPROCESSING_ENABLED
         if (in->echo_reference != NULL) {
@@ -3569,8 +6585,36 @@ static int in_standby(struct audio_stream *stream)
 
 static int in_dump(const struct audio_stream *stream, int fd)
 {
-    (void)stream;
-    (void)fd;
+    struct stream_in *in = (struct stream_in *)stream;
+#ifdef PREPROCESSING_ENABLED
+    int i;
+#endif
+
+    dprintf(fd, "    Input usecase %s: devices %#x, source %d, rate %u, %s\n",
+            use_case_table[in->usecase], in->devices, in->source, in->requested_rate,
+            in->standby ? "standby" : "active");
+    stream_stats_dump(&in->stats, fd, "reads");
+    if (in->stats.ops > 0)
+        dprintf(fd, "      cpu per read: %lld us\n",
+                (long long)(in->read_cpu_ns / in->stats.ops / 1000));
+#ifdef PREPROCESSING_ENABLED
+    for (i = 0; i < in->num_preprocessors; i++) {
+        struct effect_info_s *fx = &in->preprocessors[i];
+
+        dprintf(fd, "      effect %d: calls %u, deferred %u, frames in %llu out %llu dropped %llu,"
+                " %lld us per call\n", i, fx->calls, fx->deferred,
+                (unsigned long long)fx->frames_in, (unsigned long long)fx->frames_out,
+                (unsigned long long)fx->frames_dropped,
+                fx->calls > 0 ? (long long)(fx->process_ns / fx->calls / 1000) : 0LL);
+    }
+#endif
+    if (in->usecase == USECASE_AUDIO_CAPTURE_HOTWORD)
+        dprintf(fd, "      hotword: %s, splice attempts %u, %zu frames ahead, score %.2f, "
+                "PCM overruns %u\n",
+                in->hotword_state == HOTWORD_STATE_PCM ? "PCM" :
+                    (in->hotword_state == HOTWORD_STATE_DSP ? "DSP" : "DSP only"),
+                in->hotword_splice_attempts, in->hotword_splice_offset,
+                in->hotword_splice_score, in->hotword_pcm_overruns);
 
     return 0;
 }
@@ -3678,6 +6722,53 @@ static ssize_t read_bytes_from_dsp(struct stream_in *in, void* buffer,
         return 0;
 }
 
+/*
+ * Reads the DSP stream until the DSP returns less than requested, i.e. its
+ * history has been drained and it streams live, then splices to hotword_pcm.
+ */
+static ssize_t hotword_read(struct stream_in *in, void *buffer, size_t bytes)
+{
+    int16_t *dst = (int16_t *)buffer;
+    size_t frames = bytes / sizeof(int16_t), done = 0, count;
+    ssize_t ret;
+
+    if (in->hotword_state == HOTWORD_STATE_PCM) {
+        while (done < frames) {
+            if (in->hotword_hist_rd == in->hotword_hist_frames) {
+                in->hotword_hist_rd = in->hotword_hist_frames = 0;
+                if (hotword_capture_pcm(in, pcm_device_capture.config.period_size) != 0)
+                    break;
+                continue;
+            }
+            count = in->hotword_hist_frames - in->hotword_hist_rd;
+            if (count > frames - done)
+                count = frames - done;
+            memcpy(dst + done, in->hotword_hist + in->hotword_hist_rd, count * sizeof(int16_t));
+            in->hotword_hist_rd += count;
+            done += count;
+        }
+        return done * sizeof(int16_t);
+    }
+
+    ret = read_bytes_from_dsp(in, buffer, bytes);
+    if (ret > 0)
+        pcm_tap_write(in->dev, PCM_TAP_HOTWORD_DSP, dst, ret / sizeof(int16_t),
+                      1, HOTWORD_SAMPLING_RATE);
+    if (ret <= 0 || in->hotword_state == HOTWORD_STATE_DSP_ONLY)
+        return ret;
+    if (in->hotword_pcm == NULL) {
+        hotword_open_pcm(in);
+        if (in->hotword_pcm == NULL)
+            return ret;
+    } else {
+        hotword_drain_pcm(in);
+    }
+    hotword_keep_dsp_tail(in, dst, ret / sizeof(int16_t));
+    if ((size_t)ret < bytes)
+        hotword_splice(in);
+    return ret;
+}
+
 static ssize_t in_read(struct audio_stream_in *stream, void *buffer,
                        size_t bytes)
 {
@@ -3688,18 +6779,16 @@ static ssize_t in_read(struct audio_stream_in *stream, void *buffer,
     int read_and_process_successful = false;
 
     size_t frames_rq = bytes / audio_stream_in_frame_size(stream);
-    pid_t tid;
-    int err;
+    int64_t read_start_ns = get_time_ns();
+    struct timespec cpu_start, cpu_end;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
 
     /* no need to acquire adev->lock_inputs because API contract prevents a close */
     lock_input_stream(in);
 
     if (in->usecase == USECASE_AUDIO_CAPTURE && !in->is_fastcapture_affinity_set) {
-        tid = gettid();
-        err = fast_set_affinity(tid);
-        if (err < 0) {
-            ALOGW("Couldn't set affinity for tid %d; error %d", tid, err);
-        }
+        thread_policy_apply(adev, THREAD_ROLE_FAST_CAPTURE);
         in->is_fastcapture_affinity_set = true;
     }
 
@@ -3724,10 +6813,18 @@ false_alarm:
 
     if (!list_empty(&in->pcm_dev_list)) {
         if (in->usecase == USECASE_AUDIO_CAPTURE_HOTWORD) {
-            bytes = read_bytes_from_dsp(in, buffer, bytes);
+            bytes = hotword_read(in, buffer, bytes);
             if (bytes > 0)
                 read_and_process_successful = true;
         } else {
+            struct pcm_device *pcm_device = node_to_item(list_head(&in->pcm_dev_list),
+                                                         struct pcm_device, stream_list_node);
+
+            /* the buffer is expected to be full only if we did not keep up */
+            if (in_overrun_likely(&in->stats, pcm_device->pcm, in->config.rate, get_time_ns()))
+                android_atomic_inc(&in->stats.xruns);
+            if (in->resampler != NULL)
+                android_atomic_inc(&in->stats.resampled);
             /*
              * Read PCM and:
              * - resample if needed
@@ -3738,6 +6835,8 @@ false_alarm:
             if (frames >= 0)
                 read_and_process_successful = true;
         }
+        if (!read_and_process_successful)
+            android_atomic_inc(&in->stats.errors);
     }
 
     /*
@@ -3746,6 +6845,11 @@ false_alarm:
      */
     if (read_and_process_successful == true && adev->mic_mute)
         memset(buffer, 0, bytes);
+    if (read_and_process_successful == true && in->usecase != USECASE_AUDIO_CAPTURE_HOTWORD &&
+            (adev->latency_test.state == LATENCY_TEST_ARMED ||
+             adev->latency_test.state == LATENCY_TEST_RECORDING))
+        latency_test_record(adev, in, (const int16_t *)buffer, bytes / audio_stream_in_frame_size(stream),
+                            audio_channel_count_from_in_mask(in->main_channels));
 
 exit:
     pthread_mutex_unlock(&in->lock);
@@ -3755,6 +6859,12 @@ exit:
         ALOGV("%s: read failed - sleeping for buffer duration", __func__);
         usleep(bytes * 1000000 / audio_stream_in_frame_size(stream) /
                in->requested_rate);
+    } else {
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+        in->read_cpu_ns += (int64_t)(cpu_end.tv_sec - cpu_start.tv_sec) * 1000000000LL +
+                           (cpu_end.tv_nsec - cpu_start.tv_nsec);
+        stream_stats_update(&in->stats, read_start_ns, get_time_ns(), bytes,
+                            (int64_t)frames_rq * 1000000000LL / in->requested_rate);
     }
     return bytes;
 }
@@ -3795,11 +6905,12 @@ static int add_remove_audio_effect(const struct audio_stream *stream,
             select_devices(in->dev, in->usecase);
     }
 #else
-    if ( (in->num_preprocessors > MAX_PREPROCESSORS) && (enable == true) ) {
+    if ( (in->num_preprocessors >= MAX_PREPROCESSORS) && (enable == true) ) {
         status = -ENOSYS;
         goto exit;
     }
     if ( enable == true ) {
+        memset(&in->preprocessors[in->num_preprocessors], 0, sizeof(struct effect_info_s));
         in->preprocessors[in->num_preprocessors].effect_itfe = effect;
         /* add the supported channel of the effect in the channel_configs */
         in_read_audio_effect_channel_configs(in, &in->preprocessors[in->num_preprocessors]);
@@ -3816,10 +6927,7 @@ static int add_remove_audio_effect(const struct audio_stream *stream,
         status = -EINVAL;
         for (i=0; i < in->num_preprocessors; i++) {
             if (status == 0) { /* status == 0 means an effect was removed from a previous slot */
-                in->preprocessors[i - 1].effect_itfe = in->preprocessors[i].effect_itfe;
-                in->preprocessors[i - 1].channel_configs = in->preprocessors[i].channel_configs;
-                in->preprocessors[i - 1].num_channel_configs =
-                    in->preprocessors[i].num_channel_configs;
+                in->preprocessors[i - 1] = in->preprocessors[i];
                 ALOGV("add_remove_audio_effect moving fx from %d to %d", i, i-1);
                 continue;
             }
@@ -3945,8 +7053,9 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 
         out->compr_config.codec->id =
                 get_snd_codec_id(config->offload_info.format);
-        out->compr_config.fragment_size = COMPRESS_OFFLOAD_FRAGMENT_SIZE;
-        out->compr_config.fragments = COMPRESS_OFFLOAD_NUM_FRAGMENTS;
+        get_compress_fragments(config->offload_info.format, config->offload_info.bit_rate,
+                               &out->compr_config.fragment_size,
+                               &out->compr_config.fragments);
         out->compr_config.codec->sample_rate = config->offload_info.sample_rate;
         out->compr_config.codec->bit_rate =
                     config->offload_info.bit_rate;
@@ -3961,9 +7070,30 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
         create_offload_callback_thread(out);
         out->offload_state = OFFLOAD_STATE_IDLE;
 
-        ALOGV("%s: offloaded output offload_info version %04x bit rate %d",
+        ALOGV("%s: offloaded output offload_info version %04x bit rate %d, %u fragments of %u",
                 __func__, config->offload_info.version,
-                config->offload_info.bit_rate);
+                config->offload_info.bit_rate, out->compr_config.fragments,
+                out->compr_config.fragment_size);
+    } else if ((out->flags & AUDIO_OUTPUT_FLAG_DIRECT) &&
+               audio_channel_count_from_out_mask(config->channel_mask) > 2) {
+        if ((config->channel_mask != AUDIO_CHANNEL_OUT_5POINT1 &&
+                config->channel_mask != AUDIO_CHANNEL_OUT_7POINT1) ||
+                config->format != AUDIO_FORMAT_PCM_16_BIT) {
+            ALOGE("%s: Unsupported multichannel config %#x format %#x", __func__,
+                  config->channel_mask, config->format);
+            ret = -EINVAL;
+            goto error_open;
+        }
+        out->usecase = USECASE_AUDIO_PLAYBACK_MULTI_CH;
+        out->channel_mask = config->channel_mask;
+        out->supported_channel_masks[0] = AUDIO_CHANNEL_OUT_5POINT1;
+        out->supported_channel_masks[1] = AUDIO_CHANNEL_OUT_7POINT1;
+        out->config = pcm_config_hdmi_multi;
+        out->config.channels = get_multi_channel_pcm_channels(adev, devices,
+                                    audio_channel_count_from_out_mask(out->channel_mask));
+        out->sample_rate = out->config.rate;
+        ALOGV("%s: use AUDIO_PLAYBACK_MULTI_CH, %d channels to %u", __func__,
+              audio_channel_count_from_out_mask(out->channel_mask), out->config.channels);
     } else if (out->flags & (AUDIO_OUTPUT_FLAG_DEEP_BUFFER)) {
         out->usecase = USECASE_AUDIO_PLAYBACK_DEEP_BUFFER;
         out->config = pcm_config_deep_buffer;
@@ -3974,6 +7104,13 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
         out->sample_rate = out->config.rate;
     }
 
+    if (out->usecase == USECASE_AUDIO_PLAYBACK || out->usecase == USECASE_AUDIO_PLAYBACK_DEEP_BUFFER) {
+        if (!is_supported_pcm_output_format(out->format))
+            out->format = AUDIO_FORMAT_PCM_16_BIT;
+        for (i = 0; i < 4; i++)
+            out->dither_state[i] = (uint32_t)i * 0x9E3779B9u + 1;
+    }
+
     if (flags & AUDIO_OUTPUT_FLAG_PRIMARY) {
         if (adev->primary_output == NULL)
             adev->primary_output = out;
@@ -4027,6 +7164,11 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 
     out->is_fastmixer_affinity_set = false;
 
+    if (out->usecase == USECASE_AUDIO_PLAYBACK ||
+            out->usecase == USECASE_AUDIO_PLAYBACK_DEEP_BUFFER ||
+            out->usecase == USECASE_AUDIO_PLAYBACK_MULTI_CH)
+        create_out_standby_thread(out);
+
     *stream_out = &out->stream;
     ALOGV("%s: exit", __func__);
     return 0;
@@ -4046,13 +7188,23 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
     (void)dev;
 
     ALOGV("%s: enter", __func__);
-    out_standby(&stream->common);
+    /* no delayed standby on close, outputs in warm standby must be closed too */
+    destroy_out_standby_thread(out);
+    lock_output_stream(out);
+    if (!out->standby) {
+        pthread_mutex_lock(&adev->lock);
+        do_out_standby_l(out);
+        pthread_mutex_unlock(&adev->lock);
+    }
+    pthread_mutex_unlock(&out->lock);
     if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD) {
         destroy_offload_callback_thread(out);
 
         if (out->compr_config.codec != NULL)
             free(out->compr_config.codec);
     }
+    free(out->downmix_buf);
+    free(out->convert_buf);
     pthread_cond_destroy(&out->cond);
     pthread_mutex_destroy(&out->lock);
     free(stream);
@@ -4064,7 +7216,7 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
     struct audio_device *adev = (struct audio_device *)dev;
     struct str_parms *parms;
     char *str;
-    char value[32];
+    char value[128];
     int val;
     int ret;
 
@@ -4086,13 +7238,17 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
         else
             return -EINVAL;
 
+        uint32_t route_seq = 0;
+
         pthread_mutex_lock(&adev->lock);
         if (tty_mode != adev->tty_mode) {
             adev->tty_mode = tty_mode;
             if (adev->in_call)
-                select_devices(adev, USECASE_VOICE_CALL);
+                route_seq = route_cmd_post(adev, ROUTE_CMD_SELECT_DEVICES, USECASE_VOICE_CALL, 0);
         }
         pthread_mutex_unlock(&adev->lock);
+        if (route_seq != 0)
+            route_cmd_wait(adev, route_seq);
     }
 
     ret = str_parms_get_str(parms, AUDIO_PARAMETER_KEY_BT_NREC, value, sizeof(value));
@@ -4106,6 +7262,13 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
             adev->bluetooth_nrec = false;
     }
 
+    ret = str_parms_get_str(parms, AUDIO_PARAMETER_KEY_BT_SCO_WB, value, sizeof(value));
+    if (ret >= 0) {
+        pthread_mutex_lock(&adev->lock);
+        sco_set_rate(adev, strcmp(value, AUDIO_PARAMETER_VALUE_ON) == 0);
+        pthread_mutex_unlock(&adev->lock);
+    }
+
     ret = str_parms_get_str(parms, "screen_state", value, sizeof(value));
     if (ret >= 0) {
         if (strcmp(value, AUDIO_PARAMETER_VALUE_ON) == 0)
@@ -4114,6 +7277,14 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
             adev->screen_off = true;
     }
 
+    ret = str_parms_get_int(parms, "latency_test", &val);
+    if (ret >= 0)
+        latency_test_set(adev, val);
+
+    ret = str_parms_get_str(parms, "pcm_tap", value, sizeof(value));
+    if (ret >= 0)
+        pcm_tap_set(adev, value);
+
     ret = str_parms_get_int(parms, "rotation", &val);
     if (ret >= 0) {
         bool reverse_speakers = false;
@@ -4131,6 +7302,8 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
         default:
             ALOGE("%s: unexpected rotation of %d", __func__, val);
         }
+        uint32_t route_seq = 0;
+
         pthread_mutex_lock(&adev->lock);
         if (adev->speaker_lr_swap != reverse_speakers) {
             adev->speaker_lr_swap = reverse_speakers;
@@ -4140,14 +7313,16 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
             list_for_each(node, &adev->usecase_list) {
                 usecase = node_to_item(node, struct audio_usecase, adev_list_node);
                 if (usecase->type == PCM_PLAYBACK) {
-                    select_devices(adev, usecase->id);
-                    if (adev->htc_acoustic_spk_reverse)
-                        adev->htc_acoustic_spk_reverse(adev->speaker_lr_swap);
+                    route_cmd_post(adev, ROUTE_CMD_SELECT_DEVICES, usecase->id, 0);
+                    route_seq = route_cmd_post(adev, ROUTE_CMD_SPK_REVERSE,
+                                               adev->speaker_lr_swap, 0);
                     break;
                 }
             }
         }
         pthread_mutex_unlock(&adev->lock);
+        if (route_seq != 0)
+            route_cmd_wait(adev, route_seq);
     }
 
     str_parms_destroy(parms);
@@ -4162,10 +7337,21 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 static char* adev_get_parameters(const struct audio_hw_device *dev,
                                  const char *keys)
 {
-    (void)dev;
-    (void)keys;
+    struct audio_device *adev = (struct audio_device *)dev;
+    struct str_parms *query = str_parms_create_str(keys);
+    struct str_parms *reply;
+    char *str;
 
-    return strdup("");
+    if (str_parms_has_key(query, "latency_test")) {
+        reply = str_parms_create();
+        latency_test_get_results(adev, reply);
+        str = str_parms_to_str(reply);
+        str_parms_destroy(reply);
+    } else {
+        str = strdup("");
+    }
+    str_parms_destroy(query);
+    return str;
 }
 
 static int adev_init_check(const struct audio_hw_device *dev)
@@ -4223,13 +7409,27 @@ static int adev_get_master_mute(struct audio_hw_device *dev, bool *muted)
 static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
 {
     struct audio_device *adev = (struct audio_device *)dev;
+    struct audio_usecase *usecase;
+    struct stream_out *out;
+    struct listnode *node;
 
     pthread_mutex_lock(&adev->lock);
     if (adev->mode != mode) {
         ALOGI("%s mode = %d", __func__, mode);
         adev->mode = mode;
+        /* outputs in warm standby keep the routes of the previous mode: close them now */
+        android_atomic_inc(&adev->standby_flush);
+        list_for_each(node, &adev->usecase_list) {
+            usecase = node_to_item(node, struct audio_usecase, adev_list_node);
+            if (usecase->type != PCM_PLAYBACK || usecase->stream == NULL)
+                continue;
+            out = (struct stream_out *)usecase->stream;
+            if (out->standby_thread != 0)
+                pthread_cond_signal(&out->standby_cond);
+        }
         pthread_mutex_lock(&adev->tfa9895_lock);
         adev->tfa9895_mode_change |= 0x1;
+        adev->tfa9895_config_failures = 0;
         pthread_mutex_unlock(&adev->tfa9895_lock);
     }
     pthread_mutex_unlock(&adev->lock);
@@ -4382,20 +7582,17 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
         in->read_buf = NULL;
     }
 
-    if (in->proc_buf_in) {
-        free(in->proc_buf_in);
-        in->proc_buf_in = NULL;
-    }
+    frame_ring_free(&in->proc_ring);
 
     if (in->proc_buf_out) {
         free(in->proc_buf_out);
         in->proc_buf_out = NULL;
     }
 
-    if (in->ref_buf) {
-        free(in->ref_buf);
-        in->ref_buf = NULL;
-    }
+    frame_ring_free(&in->ref_ring);
+    free(in->pipe_buf[0]);
+    free(in->pipe_buf[1]);
+    in->pipe_buf[0] = in->pipe_buf[1] = NULL;
 
     if (in->resampler) {
         release_resampler(in->resampler);
@@ -4413,181 +7610,375 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
 
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
-    (void)device;
-    (void)fd;
+    struct audio_device *adev = (struct audio_device *)device;
+    struct snd_device_transition *t;
+    int from, to;
+    int64_t now_ns;
+    int32_t mixer_ops;
+
+    pthread_mutex_lock(&adev->route_lock);
+    dprintf(fd, "  Routing worker: %u commands, max latency %lld us, "
+            "max adev lock hold %lld us (worker) %lld us (set_parameters)\n",
+            adev->route_cmd_count, (long long)(adev->route_latency_max_ns / 1000),
+            (long long)(adev->route_lock_max_ns / 1000),
+            (long long)(adev->route_caller_lock_max_ns / 1000));
+    dprintf(fd, "  Amp: %u rt5506/speaker reverse calls\n", adev->route_amp_count);
+    now_ns = get_time_ns();
+    mixer_ops = android_atomic_acquire_load(&adev->mixer_ops);
+    if (adev->mixer_ops_dump_ns != 0 && now_ns > adev->mixer_ops_dump_ns)
+        dprintf(fd, "  Mixer: %d operations, %lld per second since last dump\n", mixer_ops,
+                (long long)(mixer_ops - adev->mixer_ops_dump) * 1000000000LL /
+                    (now_ns - adev->mixer_ops_dump_ns));
+    else
+        dprintf(fd, "  Mixer: %d operations\n", mixer_ops);
+    adev->mixer_ops_dump = mixer_ops;
+    adev->mixer_ops_dump_ns = now_ns;
+    pthread_mutex_unlock(&adev->route_lock);
+
+    if (adev->tfa9895_config_thread) {
+        pthread_mutex_lock(&adev->tfa9895_config_lock);
+        dprintf(fd, "  TFA9895: config state %d, consecutive failures %d, mode change %#x\n",
+                adev->tfa9895_config_state, adev->tfa9895_config_failures,
+                adev->tfa9895_mode_change);
+        pthread_mutex_unlock(&adev->tfa9895_config_lock);
+    }
+
+    thread_policy_dump(adev, fd);
+    pcm_tap_dump(adev, fd);
+#ifdef PREPROCESSING_ENABLED
+    dprintf(fd, "  Echo reference ring: %s, %u slots pushed, %d overruns\n",
+            adev->echo_ref_ring.active ? "active" : "idle", adev->echo_ref_ring.pushed,
+            android_atomic_acquire_load(&adev->echo_ref_ring.overruns));
+#endif
+
+    pthread_mutex_lock(&adev->lock);
+    dprintf(fd, "  Sound device transitions:\n");
+    for (from = SND_DEVICE_NONE; from < SND_DEVICE_MAX; from++) {
+        for (to = SND_DEVICE_NONE; to < SND_DEVICE_MAX; to++) {
+            t = &adev->snd_dev_transitions[from * SND_DEVICE_MAX + to];
+            if (t->count == 0)
+                continue;
+            dprintf(fd, "    %s -> %s: count %u, mixer updates %u, avg %llu us, max %u us\n",
+                    device_table[from], device_table[to], t->count, t->mixer_updates,
+                    (unsigned long long)(t->total_us / t->count), t->max_us);
+        }
+    }
+    pthread_mutex_unlock(&adev->lock);
 
     return 0;
 }
 
+/*
+ * Amp and codec GPIO configuration needing I2C and an I2S clock is done here
+ * so that adev_open() does not wait for it. Output streams and the tfa9895
+ * worker wait for it to complete in adev_init_wait() before using the playback
+ * PCM this thread gives to the dummybuf thread. Later dummybuf runs of the
+ * worker are serialized with the streams under adev->lock, see
+ * tfa9895_start_dummybuf().
+ */
+static void *adev_init_thread(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    int64_t start_ns = get_time_ns();
+    int64_t amp_ns, hs_gpio_ns;
+
+    thread_policy_apply(adev, THREAD_ROLE_INIT);
+    prctl(PR_SET_NAME, (unsigned long)"Audio Init", 0, 0, 0);
+
+    if (adev->htc_acoustic_init_rt5506 != NULL)
+        adev->htc_acoustic_init_rt5506();
+    amp_ns = get_time_ns();
+
+    if (adev->init_hs_gpio) {
+        /* For HS GPIO initial config */
+        adev->dummybuf_thread_devices = AUDIO_DEVICE_OUT_WIRED_HEADPHONE;
+        dummybuf_thread_open(adev);
+        if (!dummybuf_thread_wait_active(adev, RETRY_NUMBER * 10))
+            ALOGW("%s: dummybuf thread not active for HS GPIO config", __func__);
+        dummybuf_thread_close(adev);
+    }
+    hs_gpio_ns = get_time_ns();
+
+    pthread_mutex_lock(&adev->init_lock);
+    adev->init_done = true;
+    pthread_cond_broadcast(&adev->init_cond);
+    pthread_mutex_unlock(&adev->init_lock);
+
+    /* For NXP DSP config: done asynchronously by the tfa9895 worker */
+    if (adev->init_hs_gpio && adev->tfa9895_config_thread)
+        tfa9895_config_request(adev);
+
+    ALOGI("%s: done in %lld us (rt5506 %lld us, HS GPIO %lld us)", __func__,
+          (long long)((hs_gpio_ns - start_ns) / 1000), (long long)((amp_ns - start_ns) / 1000),
+          (long long)((hs_gpio_ns - amp_ns) / 1000));
+    return NULL;
+}
+
+static void adev_init_thread_open(struct audio_device *adev)
+{
+    pthread_mutex_init(&adev->init_lock, (const pthread_mutexattr_t *) NULL);
+    pthread_cond_init(&adev->init_cond, (const pthread_condattr_t *) NULL);
+    adev->init_done = false;
+    if (pthread_create(&adev->init_thread, (const pthread_attr_t *) NULL,
+                       adev_init_thread, adev) != 0) {
+        ALOGE("%s: init thread create fail, initializing synchronously", __func__);
+        adev->init_thread = 0;
+        adev_init_thread(adev);
+    }
+}
+
+static void adev_init_thread_close(struct audio_device *adev)
+{
+    if (adev->init_thread)
+        pthread_join(adev->init_thread, (void **) NULL);
+    adev->init_thread = 0;
+    pthread_cond_destroy(&adev->init_cond);
+    pthread_mutex_destroy(&adev->init_lock);
+}
+
+/* Waits for adev_init_thread() to complete. May be called with adev->lock held. */
+static void adev_init_wait(struct audio_device *adev)
+{
+    pthread_mutex_lock(&adev->init_lock);
+    while (!adev->init_done)
+        pthread_cond_wait(&adev->init_cond, &adev->init_lock);
+    pthread_mutex_unlock(&adev->init_lock);
+}
+
 static int adev_close(hw_device_t *device)
 {
     struct audio_device *adev = (struct audio_device *)device;
     audio_device_ref_count--;
+    destroy_route_thread(adev);
+    adev_init_thread_close(adev);
+    tfa9895_config_thread_close(adev);
+    dummybuf_thread_close(adev);
+    pcm_tap_close(adev);
+    latency_test_close(adev);
+#ifdef PREPROCESSING_ENABLED
+    free(adev->echo_ref_ring.data);
+#endif
     free(adev->snd_dev_ref_cnt);
+    free(adev->snd_dev_transitions);
     free_mixer_list(adev);
     free(device);
     return 0;
 }
 
+static int dummybuf_set_switches(struct audio_device *adev, int card,
+                                 audio_devices_t devices, int value)
+{
+    static const int hp_ctls[] = {
+        MIXER_CTL_ID_HEADPHONE_JACK_SWITCH,
+        MIXER_CTL_ID_CODEC_VMIXER_CODEC_SWITCH,
+    };
+    static const int spk_ctls[] = {
+        MIXER_CTL_ID_SPK_VMIXER_SPK_SWITCH,
+    };
+    const int *ids = hp_ctls;
+    size_t count = ARRAY_SIZE(hp_ctls);
+    struct mixer_ctl *ctl;
+    size_t i;
+    int ret = 0;
+
+    if (devices != AUDIO_DEVICE_OUT_WIRED_HEADPHONE) {
+        ids = spk_ctls;
+        count = ARRAY_SIZE(spk_ctls);
+    }
+    for (i = 0; i < count; i++) {
+        ctl = adev_get_mixer_ctl(adev, card, ids[i]);
+        if (ctl == NULL) {
+            ret = -EINVAL;
+            if (value)
+                break;
+            continue;
+        }
+        mixer_ctl_set_value(ctl, 0, value);
+        android_atomic_inc(&adev->mixer_ops);
+    }
+    return ret;
+}
+
+/*
+ * Plays silence on the playback PCM to provide an I2S clock to the codec and
+ * amplifiers while they are being configured. Writes are blocking so silence is
+ * only produced as fast as the PCM consumes it. dummybuf_thread_active is
+ * raised (and dummybuf_thread_cond broadcast) once the first period has been
+ * accepted by the driver. dummybuf_thread_close() stops the PCM to unblock a
+ * pending write so that cancellation does not wait for a period to elapse.
+ */
 static void *dummybuf_thread(void *context)
 {
-    ALOGV("%s: enter", __func__);
-    pthread_detach(pthread_self());
     struct audio_device *adev = (struct audio_device *)context;
     struct pcm_config config;
-    struct mixer *mixer = NULL;
-    struct mixer_ctl *ctl;
     unsigned char *data = NULL;
     struct pcm *pcm = NULL;
-    struct pcm_device_profile *profile = NULL;
+    struct pcm_device_profile *profile = &pcm_device_playback;
     audio_devices_t dummybuf_thread_devices = adev->dummybuf_thread_devices;
+    size_t data_size;
+    int64_t deadline_ns;
+    int retry_count = RETRY_NUMBER;
+    int ret;
 
-    pthread_mutex_lock(&adev->dummybuf_thread_lock);
-
-    memset(&config, 0, sizeof(struct pcm_config));
-
-    profile = &pcm_device_playback;
+    ALOGV("%s: enter", __func__);
+    thread_policy_apply(adev, THREAD_ROLE_DUMMYBUF);
+    prctl(PR_SET_NAME, (unsigned long)"Dummybuf", 0, 0, 0);
 
     memcpy(&config, &profile->config, sizeof(struct pcm_config));
     /* Use large value for stop_threshold so that automatic
        trigger for stop is avoided, when this thread fails to write data */
     config.stop_threshold = INT_MAX/2;
-    pcm = pcm_open(profile->card, profile->id,
-                   (PCM_OUT | PCM_MONOTONIC), &config);
-    if (pcm != NULL && !pcm_is_ready(pcm)) {
-        ALOGE("pcm_open: card=%d, id=%d is not ready", profile->card, profile->id);
-        pcm_close(pcm);
-        pcm = NULL;
-    } else {
-        ALOGV("pcm_open: card=%d, id=%d", profile->card, profile->id);
-    }
 
-    mixer = mixer_open(profile->card);
-    if (mixer) {
-        if (dummybuf_thread_devices == AUDIO_DEVICE_OUT_WIRED_HEADPHONE) {
-            ctl = mixer_get_ctl_by_name(mixer, MIXER_CTL_HEADPHONE_JACK_SWITCH);
-            if (ctl != NULL)
-                mixer_ctl_set_value(ctl, 0, 1);
-            else {
-                ALOGE("Invalid mixer control: name(%s): skip dummy thread", MIXER_CTL_HEADPHONE_JACK_SWITCH);
-                goto exit;
-            }
+    data_size = config.period_size * config.channels * sizeof(int16_t);
+    data = (unsigned char *)calloc(data_size, sizeof(unsigned char));
 
-            ctl = mixer_get_ctl_by_name(mixer, MIXER_CTL_CODEC_VMIXER_CODEC_SWITCH);
-            if (ctl != NULL)
-                mixer_ctl_set_value(ctl, 0, 1);
-            else {
-                ALOGE("Invalid mixer control: name(%s): skip dummy thread", MIXER_CTL_CODEC_VMIXER_CODEC_SWITCH);
-                goto exit;
-            }
-        } else {
-            ctl = mixer_get_ctl_by_name(mixer, MIXER_CTL_SPK_VMIXER_SPK_SWITCH);
-            if (ctl != NULL)
-                mixer_ctl_set_value(ctl, 0, 1);
-            else {
-                ALOGE("Invalid mixer control: name(%s): skip dummy thread", MIXER_CTL_SPK_VMIXER_SPK_SWITCH);
-                goto exit;
-            }
-        }
+    if (dummybuf_set_switches(adev, profile->card, dummybuf_thread_devices, 1) != 0) {
+        ALOGE("%s: skip dummy thread", __func__);
+        goto exit;
     }
 
-    while (1) {
-        if (pcm) {
-            if (data == NULL)
-                data = (unsigned char *)calloc(DEEP_BUFFER_OUTPUT_PERIOD_SIZE * 8,
-                            sizeof(unsigned char));
-            if (data) {
-                pcm_write(pcm, (void *)data, DEEP_BUFFER_OUTPUT_PERIOD_SIZE * 8);
-                adev->dummybuf_thread_active = 1;
-            } else {
-                ALOGV("%s: cant open a buffer, retry to open it", __func__);
-            }
-        } else {
-            ALOGV("%s: cant open a output deep stream, retry to open it", __func__);
-            pcm = pcm_open(profile->card, profile->id,
-                   (PCM_OUT | PCM_MONOTONIC), &config);
+    pthread_mutex_lock(&adev->dummybuf_thread_lock);
+    deadline_ns = get_time_ns() + (int64_t)adev->dummybuf_thread_timeout * 1000000LL;
+    while (data != NULL && !adev->dummybuf_thread_cancel) {
+        if (pcm == NULL) {
+            pthread_mutex_unlock(&adev->dummybuf_thread_lock);
+            pcm = pcm_open(profile->card, profile->id, (PCM_OUT | PCM_MONOTONIC), &config);
             if (pcm != NULL && !pcm_is_ready(pcm)) {
                 ALOGE("pcm_open: card=%d, id=%d is not ready", profile->card, profile->id);
                 pcm_close(pcm);
                 pcm = NULL;
-            } else {
-                ALOGV("pcm_open: card=%d, id=%d", profile->card, profile->id);
             }
-        }
+            pthread_mutex_lock(&adev->dummybuf_thread_lock);
+            if (pcm == NULL) {
+                struct timespec ts;
 
-        if (adev->dummybuf_thread_cancel || adev->dummybuf_thread_timeout-- <= 0) {
-            adev->dummybuf_thread_cancel = 0;
-            break;
+                if (--retry_count <= 0)
+                    break;
+                ALOGV("%s: cant open a output deep stream, retry to open it", __func__);
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                ts.tv_nsec += 10000000;
+                if (ts.tv_nsec >= 1000000000) {
+                    ts.tv_nsec -= 1000000000;
+                    ts.tv_sec++;
+                }
+                pthread_cond_timedwait(&adev->dummybuf_thread_cond,
+                                       &adev->dummybuf_thread_lock, &ts);
+                continue;
+            }
+            ALOGV("pcm_open: card=%d, id=%d", profile->card, profile->id);
+            adev->dummybuf_thread_pcm = pcm;
+            continue;
         }
 
         pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-        usleep(3000);
+        ret = pcm_write(pcm, (void *)data, data_size);
         pthread_mutex_lock(&adev->dummybuf_thread_lock);
-    }
 
-exit:
-    adev->dummybuf_thread_active = 0;
-    if (mixer) {
-        if (dummybuf_thread_devices == AUDIO_DEVICE_OUT_WIRED_HEADPHONE) {
-            ctl = mixer_get_ctl_by_name(mixer, MIXER_CTL_HEADPHONE_JACK_SWITCH);
-            if (ctl != NULL)
-                mixer_ctl_set_value(ctl, 0, 0);
-            ctl = mixer_get_ctl_by_name(mixer, MIXER_CTL_CODEC_VMIXER_CODEC_SWITCH);
-            if (ctl != NULL)
-                mixer_ctl_set_value(ctl, 0, 0);
-        } else {
-            ctl = mixer_get_ctl_by_name(mixer, MIXER_CTL_SPK_VMIXER_SPK_SWITCH);
-            if (ctl != NULL)
-                mixer_ctl_set_value(ctl, 0, 0);
+        if (ret == 0) {
+            if (!adev->dummybuf_thread_active) {
+                adev->dummybuf_thread_active = 1;
+                pthread_cond_broadcast(&adev->dummybuf_thread_cond);
+            }
+        } else if (!adev->dummybuf_thread_cancel && --retry_count <= 0) {
+            ALOGE("%s: pcm_write error %d - %s", __func__, ret, pcm_get_error(pcm));
+            break;
         }
-        mixer_close(mixer);
+        if (get_time_ns() >= deadline_ns)
+            break;
     }
+    adev->dummybuf_thread_pcm = NULL;
+    pthread_mutex_unlock(&adev->dummybuf_thread_lock);
+
+exit:
+    dummybuf_set_switches(adev, profile->card, dummybuf_thread_devices, 0);
     if (pcm) {
         pcm_close(pcm);
         pcm = NULL;
     }
-    pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-
     if (data)
         free(data);
 
+    pthread_mutex_lock(&adev->dummybuf_thread_lock);
+    adev->dummybuf_thread_active = 0;
+    adev->dummybuf_thread_exited = true;
+    pthread_cond_broadcast(&adev->dummybuf_thread_cond);
+    pthread_mutex_unlock(&adev->dummybuf_thread_lock);
+
+    ALOGV("%s: exit", __func__);
     return NULL;
 }
 
 static void dummybuf_thread_open(struct audio_device *adev)
 {
-    adev->dummybuf_thread_timeout = 6000; /* in 18 sec */
+    pthread_condattr_t attr;
+
+    if (adev->dummybuf_thread)
+        return;
+
+    adev->dummybuf_thread_timeout = 18000; /* in ms */
     adev->dummybuf_thread_cancel = 0;
     adev->dummybuf_thread_active = 0;
+    adev->dummybuf_thread_exited = false;
+    adev->dummybuf_thread_pcm = NULL;
     pthread_mutex_init(&adev->dummybuf_thread_lock, (const pthread_mutexattr_t *) NULL);
-    if (!adev->dummybuf_thread)
-        pthread_create(&adev->dummybuf_thread, (const pthread_attr_t *) NULL, dummybuf_thread, adev);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&adev->dummybuf_thread_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&adev->dummybuf_thread, (const pthread_attr_t *) NULL,
+                       dummybuf_thread, adev) != 0) {
+        ALOGE("%s: dummybuf thread create fail", __func__);
+        pthread_cond_destroy(&adev->dummybuf_thread_cond);
+        pthread_mutex_destroy(&adev->dummybuf_thread_lock);
+        adev->dummybuf_thread = 0;
+    }
+}
+
+/* Wait until the dummybuf thread clocks the PCM. Returns false on timeout or failure. */
+static bool dummybuf_thread_wait_active(struct audio_device *adev, int timeout_ms)
+{
+    struct timespec ts;
+    bool active;
+
+    if (adev->dummybuf_thread == 0)
+        return false;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_nsec -= 1000000000;
+        ts.tv_sec++;
+    }
+
+    pthread_mutex_lock(&adev->dummybuf_thread_lock);
+    while (!adev->dummybuf_thread_active && !adev->dummybuf_thread_exited) {
+        if (pthread_cond_timedwait(&adev->dummybuf_thread_cond,
+                                   &adev->dummybuf_thread_lock, &ts) == ETIMEDOUT)
+            break;
+    }
+    active = adev->dummybuf_thread_active;
+    pthread_mutex_unlock(&adev->dummybuf_thread_lock);
+    return active;
 }
 
 static void dummybuf_thread_close(struct audio_device *adev)
 {
     ALOGV("%s: enter", __func__);
-    int retry_cnt = 20;
 
     if (adev->dummybuf_thread == 0)
         return;
 
     pthread_mutex_lock(&adev->dummybuf_thread_lock);
     adev->dummybuf_thread_cancel = 1;
+    /* unblock a pending pcm_write() */
+    if (adev->dummybuf_thread_pcm != NULL)
+        pcm_stop(adev->dummybuf_thread_pcm);
+    pthread_cond_broadcast(&adev->dummybuf_thread_cond);
     pthread_mutex_unlock(&adev->dummybuf_thread_lock);
 
-    while (retry_cnt > 0) {
-        pthread_mutex_lock(&adev->dummybuf_thread_lock);
-        if (adev->dummybuf_thread_active == 0) {
-            pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-            break;
-        }
-        pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-        retry_cnt--;
-        usleep(1000);
-    }
-
     pthread_join(adev->dummybuf_thread, (void **) NULL);
+    pthread_cond_destroy(&adev->dummybuf_thread_cond);
     pthread_mutex_destroy(&adev->dummybuf_thread_lock);
     adev->dummybuf_thread = 0;
 }
@@ -4614,7 +8005,9 @@ static int adev_open(const hw_module_t *module, const char *name,
                      hw_device_t **device)
 {
     struct audio_device *adev;
-    int retry_count = 0;
+    char value[PROPERTY_VALUE_MAX];
+    int64_t start_ns = get_time_ns();
+    int64_t mixer_ns, libs_ns, end_ns;
 
     ALOGV("%s: enter", __func__);
     if (strcmp(name, AUDIO_HARDWARE_INTERFACE) != 0) return -EINVAL;
@@ -4654,34 +8047,38 @@ static int adev_open(const hw_module_t *module, const char *name,
     adev->in_call = false;
     /* adev->cur_hdmi_channels = 0;  by calloc() */
     adev->snd_dev_ref_cnt = calloc(SND_DEVICE_MAX, sizeof(int));
+    adev->snd_dev_transitions = calloc(SND_DEVICE_MAX * SND_DEVICE_MAX,
+                                       sizeof(struct snd_device_transition));
 
     adev->dualmic_config = DUALMIC_CONFIG_NONE;
     adev->ns_in_voice_rec = false;
 
     list_init(&adev->usecase_list);
+    thread_policy_init(adev);
+    latency_test_init(adev);
+#ifdef PREPROCESSING_ENABLED
+    echo_ref_ring_init(adev);
+#endif
+    pcm_tap_init(adev);
 
     if (mixer_init(adev) != 0) {
         free(adev->snd_dev_ref_cnt);
+        free(adev->snd_dev_transitions);
         free(adev);
         ALOGE("%s: Failed to init, aborting.", __func__);
         *device = NULL;
         return -EINVAL;
     }
 
-    if (access(OFFLOAD_FX_LIBRARY_PATH, R_OK) == 0) {
-        adev->offload_fx_lib = dlopen(OFFLOAD_FX_LIBRARY_PATH, RTLD_NOW);
-        if (adev->offload_fx_lib == NULL) {
-            ALOGE("%s: DLOPEN failed for %s", __func__, OFFLOAD_FX_LIBRARY_PATH);
-        } else {
-            ALOGV("%s: DLOPEN successful for %s", __func__, OFFLOAD_FX_LIBRARY_PATH);
-            adev->offload_fx_start_output =
-                        (int (*)(audio_io_handle_t))dlsym(adev->offload_fx_lib,
-                                                        "visualizer_hal_start_output");
-            adev->offload_fx_stop_output =
-                        (int (*)(audio_io_handle_t))dlsym(adev->offload_fx_lib,
-                                                        "visualizer_hal_stop_output");
-        }
+    if (create_route_thread(adev) != 0) {
+        free_mixer_list(adev);
+        free(adev->snd_dev_ref_cnt);
+        free(adev->snd_dev_transitions);
+        free(adev);
+        *device = NULL;
+        return -ENOMEM;
     }
+    mixer_ns = get_time_ns();
 
     if (access(HTC_ACOUSTIC_LIBRARY_PATH, R_OK) == 0) {
         adev->htc_acoustic_lib = dlopen(HTC_ACOUSTIC_LIBRARY_PATH, RTLD_NOW);
@@ -4706,83 +8103,28 @@ static int adev_open(const hw_module_t *module, const char *name,
         }
     }
 
-    if (access(SOUND_TRIGGER_HAL_LIBRARY_PATH, R_OK) == 0) {
-        adev->sound_trigger_lib = dlopen(SOUND_TRIGGER_HAL_LIBRARY_PATH, RTLD_NOW);
-        if (adev->sound_trigger_lib == NULL) {
-            ALOGE("%s: DLOPEN failed for %s", __func__, SOUND_TRIGGER_HAL_LIBRARY_PATH);
-        } else {
-            ALOGV("%s: DLOPEN successful for %s", __func__, SOUND_TRIGGER_HAL_LIBRARY_PATH);
-            adev->sound_trigger_open_for_streaming =
-                        (int (*)(void))dlsym(adev->sound_trigger_lib,
-                                                        "sound_trigger_open_for_streaming");
-            adev->sound_trigger_read_samples =
-                        (size_t (*)(int, void *, size_t))dlsym(adev->sound_trigger_lib,
-                                                        "sound_trigger_read_samples");
-            adev->sound_trigger_close_for_streaming =
-                        (int (*)(int))dlsym(adev->sound_trigger_lib,
-                                                        "sound_trigger_close_for_streaming");
-            if (!adev->sound_trigger_open_for_streaming ||
-                !adev->sound_trigger_read_samples ||
-                !adev->sound_trigger_close_for_streaming) {
-
-                ALOGE("%s: Error grabbing functions in %s", __func__, SOUND_TRIGGER_HAL_LIBRARY_PATH);
-                adev->sound_trigger_open_for_streaming = 0;
-                adev->sound_trigger_read_samples = 0;
-                adev->sound_trigger_close_for_streaming = 0;
-            }
-        }
+    adev->standby_delay_ms = OUT_STANDBY_DELAY_MS;
+    adev->standby_delay_screen_off_ms = OUT_STANDBY_DELAY_SCREEN_OFF_MS;
+    if (property_get("audio_hal.standby_delay_ms", value, NULL) > 0) {
+        if (atoi(value) >= 0)
+            adev->standby_delay_ms = atoi(value);
+        else
+            ALOGW("%s: ignoring negative audio_hal.standby_delay_ms %s", __func__, value);
     }
-
-
-    *device = &adev->device.common;
-
-    if (adev->htc_acoustic_init_rt5506 != NULL)
-        adev->htc_acoustic_init_rt5506();
-
-    if (audio_device_ref_count == 0) {
-        /* For HS GPIO initial config */
-        adev->dummybuf_thread_devices = AUDIO_DEVICE_OUT_WIRED_HEADPHONE;
-        dummybuf_thread_open(adev);
-        retry_count = RETRY_NUMBER;
-        while (retry_count-- > 0) {
-            pthread_mutex_lock(&adev->dummybuf_thread_lock);
-            if (adev->dummybuf_thread_active != 0) {
-                pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-                break;
-            }
-            pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-            usleep(10000);
-        }
-        dummybuf_thread_close(adev);
-
-        /* For NXP DSP config */
-        if (adev->htc_acoustic_set_amp_mode) {
-            pthread_t th;
-            adev->dummybuf_thread_devices = AUDIO_DEVICE_OUT_SPEAKER;
-            dummybuf_thread_open(adev);
-            pthread_mutex_lock(&adev->dummybuf_thread_lock);
-            retry_count = RETRY_NUMBER;
-            while (retry_count-- > 0) {
-                if (adev->dummybuf_thread_active) {
-                    break;
-                }
-                pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-                usleep(10000);
-                pthread_mutex_lock(&adev->dummybuf_thread_lock);
-            }
-            if (adev->dummybuf_thread_active) {
-                usleep(10000); /* tfa9895 spk amp need more than 1ms i2s signal before giving dsp related i2c commands*/
-                if (pthread_create(&th, NULL, tfa9895_config_thread, (void* )adev) != 0) {
-                    ALOGE("@@##THREAD_FADE_IN_UPPER_SPEAKER thread create fail");
-                }
-            }
-            pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-            /* Then, dummybuf_thread_close() is called by tfa9895_config_thread() */
-        }
+    if (property_get("audio_hal.standby_delay_screen_off_ms", value, NULL) > 0) {
+        if (atoi(value) >= 0)
+            adev->standby_delay_screen_off_ms = atoi(value);
+        else
+            ALOGW("%s: ignoring negative audio_hal.standby_delay_screen_off_ms %s",
+                  __func__, value);
     }
-    audio_device_ref_count++;
 
-    char value[PROPERTY_VALUE_MAX];
+    /* mmap on the low latency profiles, off unless the driver is known to support it */
+    if (property_get("audio_hal.playback_mmap", value, NULL) > 0)
+        pcm_device_playback.mmap = (atoi(value) != 0);
+    if (property_get("audio_hal.capture_mmap", value, NULL) > 0)
+        pcm_device_capture_low_latency.mmap = (atoi(value) != 0);
+
     if (property_get("audio_hal.period_size", value, NULL) > 0) {
         int trial = atoi(value);
         if (period_size_is_plausible_for_low_latency(trial)) {
@@ -4797,6 +8139,21 @@ static int adev_open(const hw_module_t *module, const char *name,
         }
     }
 
+    libs_ns = get_time_ns();
+
+    *device = &adev->device.common;
+
+    if (adev->htc_acoustic_set_amp_mode != NULL)
+        tfa9895_config_thread_open(adev);
+
+    adev->init_hs_gpio = (audio_device_ref_count == 0);
+    adev_init_thread_open(adev);
+    audio_device_ref_count++;
+
+    end_ns = get_time_ns();
+    ALOGI("%s: done in %lld us (mixer %lld us, libraries %lld us, threads %lld us)", __func__,
+          (long long)((end_ns - start_ns) / 1000), (long long)((mixer_ns - start_ns) / 1000),
+          (long long)((libs_ns - mixer_ns) / 1000), (long long)((end_ns - libs_ns) / 1000));
     ALOGV("%s: exit", __func__);
     return 0;
 }
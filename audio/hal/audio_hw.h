@@ -17,6 +17,7 @@
 #ifndef NVIDIA_AUDIO_HW_H
 #define NVIDIA_AUDIO_HW_H
 
+#include <stdio.h>
 #include <cutils/list.h>
 #include <hardware/audio.h>
 
@@ -29,6 +30,7 @@
 /* Retry for delay in FW loading*/
 #define RETRY_NUMBER 10
 #define RETRY_US 500000
+#define MIXER_RETRY_MIN_US 10000
 
 #ifdef __LP64__
 #define OFFLOAD_FX_LIBRARY_PATH "/system/lib64/soundfx/libnvvisualizer.so"
@@ -45,6 +47,13 @@ struct effect_info_s {
     effect_handle_t effect_itfe;
     size_t num_channel_configs;
     channel_config_t *channel_configs;
+    /* pipeline stage accounting */
+    uint32_t calls;
+    uint32_t deferred;      /* process() returned without output, input forwarded */
+    uint64_t frames_in;
+    uint64_t frames_out;
+    uint64_t frames_dropped;
+    int64_t process_ns;
 };
 #endif
 
@@ -144,10 +153,15 @@ enum {
 #define SCO_PERIOD_SIZE 168
 #define SCO_PERIOD_COUNT 2
 #define SCO_DEFAULT_CHANNEL_COUNT 2
+/* the decimator and the resampler fold SCO playback to mono */
+#define SCO_PLAYBACK_CHANNEL_COUNT 1
 #define SCO_DEFAULT_SAMPLING_RATE 8000
+#define SCO_WB_SAMPLING_RATE 16000
 #define SCO_START_THRESHOLD 335
 #define SCO_STOP_THRESHOLD 336
 #define SCO_AVAILABLE_MIN 1
+/* FIR length of the SCO playback decimator is this times the decimation ratio */
+#define SCO_DECIMATOR_TAPS_PER_PHASE 16
 
 #define PLAYBACK_HDMI_MULTI_PERIOD_SIZE  1024
 #define PLAYBACK_HDMI_MULTI_PERIOD_COUNT 4
@@ -160,6 +174,9 @@ enum {
 
 #define PLAYBACK_HDMI_DEFAULT_CHANNEL_COUNT   2
 
+/* -3 dB in Q14, gain of the center and surround channels when downmixing to stereo */
+#define DOWNMIX_SURROUND_GAIN_Q14 11585
+
 #define CAPTURE_PERIOD_SIZE 1024
 #define CAPTURE_PERIOD_SIZE_LOW_LATENCY 256
 #define CAPTURE_PERIOD_COUNT 2
@@ -168,17 +185,64 @@ enum {
 #define CAPTURE_DEFAULT_SAMPLING_RATE 48000
 #define CAPTURE_START_THRESHOLD 1
 
+/*
+ * Hotword capture hands off from the DSP stream to the regular capture PCM once
+ * the DSP history has been drained. The PCM is opened when DSP streaming starts,
+ * its output at the DSP rate is kept for HOTWORD_PCM_HISTORY_FRAMES, and the last
+ * HOTWORD_SPLICE_MATCH_FRAMES read from the DSP are searched for in that history.
+ */
+#define HOTWORD_SAMPLING_RATE 16000
+#define HOTWORD_PCM_PERIOD_COUNT 8
+#define HOTWORD_PCM_HISTORY_FRAMES (HOTWORD_SAMPLING_RATE / 2)
+#define HOTWORD_SPLICE_MATCH_FRAMES (HOTWORD_SAMPLING_RATE / 50)
+/* normalized correlation required to splice, and minimum DSP tail level */
+#define HOTWORD_SPLICE_MIN_SCORE 0.7f
+#define HOTWORD_SPLICE_MIN_RMS 64
+#define HOTWORD_SPLICE_MAX_ATTEMPTS 50
+
 #define COMPRESS_CARD       0
 #define COMPRESS_DEVICE     5
+/* used when the bit rate is unknown, and the smallest fragment otherwise */
 #define COMPRESS_OFFLOAD_FRAGMENT_SIZE (32 * 1024)
 #define COMPRESS_OFFLOAD_NUM_FRAGMENTS 4
+/* fragments are sized to wake up the AP every COMPRESS_OFFLOAD_WAKEUP_MS */
+#define COMPRESS_OFFLOAD_WAKEUP_MS 2000
+#define COMPRESS_OFFLOAD_FRAGMENT_SIZE_MAX (128 * 1024)
+#define COMPRESS_OFFLOAD_FRAGMENT_ALIGN 1024
+#define COMPRESS_OFFLOAD_NUM_FRAGMENTS_MIN 2
+#define COMPRESS_OFFLOAD_NUM_FRAGMENTS_MAX 8
+/* total size of the fragments */
+#define COMPRESS_OFFLOAD_BUFFER_BUDGET (256 * 1024)
 /* ToDo: Check and update a proper value in msec */
 #define COMPRESS_OFFLOAD_PLAYBACK_LATENCY 96
 #define COMPRESS_PLAYBACK_VOLUME_MAX 0x10000 //NV suggested value
+/* volume changes are ramped with at most one mixer write per step */
+#define COMPRESS_VOLUME_RAMP_MS 100
+#define COMPRESS_VOLUME_STEP_MS 20
 
 #define DEEP_BUFFER_OUTPUT_SAMPLING_RATE 48000
-#define DEEP_BUFFER_OUTPUT_PERIOD_SIZE 480
-#define DEEP_BUFFER_OUTPUT_PERIOD_COUNT 8
+/* 40 ms periods: the writer wakes up once per period instead of every 10 ms */
+#define DEEP_BUFFER_OUTPUT_PERIOD_SIZE 1920
+#define DEEP_BUFFER_OUTPUT_PERIOD_COUNT 4
+/* with the screen off, twice the buffering and the writer wakes up every other period */
+#define DEEP_BUFFER_SCREEN_OFF_PERIOD_COUNT 8
+#define DEEP_BUFFER_SCREEN_OFF_AVAIL_MIN (DEEP_BUFFER_OUTPUT_PERIOD_SIZE * 2)
+
+/*
+ * PCM outputs stay open with their routes applied for this long after standby,
+ * so that the next burst of writes does not reopen the PCM. Shorter with the
+ * screen off, where bursts are rare and the codec power matters more. 0 disables.
+ */
+#define OUT_STANDBY_DELAY_MS 2000
+#define OUT_STANDBY_DELAY_SCREEN_OFF_MS 500
+
+/* Playback delay given to the echo reference is re-read from the driver every N periods */
+#define OUT_TIMING_REFRESH_PERIODS 8
+
+/* Playback frames handed over to the echo reference by the capture thread */
+#define ECHO_REF_RING_SLOTS 16
+#define ECHO_REF_SLOT_FRAMES 1024
+#define ECHO_REF_MAX_CHANNELS 2
 
 #define MAX_SUPPORTED_CHANNEL_MASKS 2
 
@@ -222,6 +286,12 @@ enum {
     OFFLOAD_CMD_WAIT_FOR_BUFFER,    /* wait for buffer released by DSP */
 };
 
+/*
+ * at most one of each command is normally pending: a drain and a wait for buffer,
+ * which is coalesced. send_offload_cmd_l() waits for room rather than dropping.
+ */
+#define OFFLOAD_CMD_RING_SIZE 8
+
 enum {
     OFFLOAD_STATE_IDLE,
     OFFLOAD_STATE_PLAYING,
@@ -229,6 +299,24 @@ enum {
     OFFLOAD_STATE_PAUSED_FLUSHED,
 };
 
+enum {
+    TFA9895_CONFIG_IDLE,
+    TFA9895_CONFIG_PENDING,         /* requested, not yet picked up by the worker */
+    TFA9895_CONFIG_RUNNING,         /* worker waiting for I2S lead time or programming the amp */
+};
+
+enum {
+    ROUTE_CMD_EXIT,                 /* exit routing thread loop */
+    ROUTE_CMD_SELECT_DEVICES,       /* select_devices() for usecase data[0] */
+    ROUTE_CMD_UPDATE_VOICE_CALL,    /* start, stop or re-route the voice call per adev->mode */
+    ROUTE_CMD_SET_RT5506_AMP,       /* htc_acoustic_set_rt5506_amp(data[0], data[1]) */
+    ROUTE_CMD_SPK_REVERSE,          /* htc_acoustic_spk_reverse(data[0]) */
+};
+
+/* I2S clock lead time needed by the tfa9895 before DSP related I2C commands */
+#define TFA9895_I2S_LEAD_US 100000
+#define TFA9895_DUMMYBUF_LEAD_US 10000
+
 typedef enum {
     PCM_PLAYBACK = 0x1,
     PCM_CAPTURE = 0x2,
@@ -238,9 +326,16 @@ typedef enum {
 } usecase_type_t;
 
 struct offload_cmd {
+    int             cmd;
+    int64_t         post_ns;
+};
+
+struct route_cmd {
     struct listnode node;
     int             cmd;
-    int             data[];
+    int             data[2];
+    uint32_t        seq;
+    int64_t         post_ns;
 };
 
 struct pcm_device_profile {
@@ -249,6 +344,48 @@ struct pcm_device_profile {
     int               id;
     usecase_type_t    type;
     audio_devices_t   devices;
+    bool              mmap;     /* open with PCM_MMAP|PCM_NOIRQ, falls back to read/write */
+};
+
+/*
+ * Single stage integer ratio low pass decimator folding all input channels to
+ * mono. Buffers are sized for one stream period when the PCM is opened.
+ */
+struct sco_decimator {
+    unsigned int               ratio;
+    unsigned int               channels;     /* input channels */
+    unsigned int               taps;
+    int16_t*                   coefs;        /* Q15 */
+    int16_t*                   hist;         /* mono input not yet consumed */
+    size_t                     hist_frames;
+    size_t                     max_frames;   /* input frames per call hist and out can take */
+    int16_t*                   out;
+    int64_t                    frames_in;
+    int64_t                    process_ns;
+};
+
+/*
+ * Single producer single consumer queue from the primary output to the capture
+ * thread, which writes the slots to the echo reference. A slot with no frames
+ * tells that the output stopped.
+ */
+struct echo_ref_slot {
+    size_t                     frames;
+    struct timespec            time_stamp;
+    int32_t                    delay_ns;     /* render delay of the last frame after time_stamp */
+    int16_t*                   data;
+};
+
+struct echo_ref_ring {
+    volatile int32_t           active;       /* set by the reader when the echo reference exists */
+    volatile int32_t           rd;
+    volatile int32_t           wr;
+    unsigned int               channels;
+    unsigned int               rate;
+    int16_t*                   data;
+    struct echo_ref_slot       slots[ECHO_REF_RING_SLOTS];
+    uint32_t                   pushed;
+    volatile int32_t           overruns;
 };
 
 struct pcm_device {
@@ -260,7 +397,38 @@ struct pcm_device {
     struct resampler_itfe*     resampler;
     int16_t*                   res_buffer;
     size_t                     res_byte_count;
+    unsigned int               res_channels; /* 1 if the stream is folded to mono first */
+    int16_t*                   fold_buffer;
+    size_t                     fold_frames;
+    struct sco_decimator*      decimator;    /* replaces the resampler on SCO playback */
     int                        sound_trigger_handle;
+    bool                       mmap;         /* PCM actually opened in mmap mode */
+    bool                       mmap_started;
+    unsigned int               mmap_appl;    /* frames committed since last prepare, for start */
+    uint32_t                   xruns;        /* underruns seen by pcm_device_write() */
+};
+
+/* Histogram bucket i counts durations below STREAM_STATS_BUCKET_US << i, the last one the rest */
+#define STREAM_STATS_BUCKETS 8
+#define STREAM_STATS_BUCKET_US 500
+
+/*
+ * Per stream telemetry, printed by out_dump()/in_dump(). Written by the stream's
+ * audio thread with atomic increments (standby may be counted from another
+ * thread) and read by the dump hooks without taking any lock.
+ */
+struct stream_stats {
+    volatile int32_t            ops;            /* out_write() or in_read() calls */
+    volatile int32_t            errors;         /* failed pcm_write() or pcm_read() */
+    volatile int32_t            xruns;          /* buffer found empty (out) or full (in) */
+    volatile int32_t            standby;        /* transitions to standby */
+    volatile int32_t            resampled;      /* calls going through a resampler */
+    int64_t                     bytes;
+    int64_t                     duration_max_ns;
+    int64_t                     last_op_ns;     /* start of previous call, 0 after standby */
+    int64_t                     last_op_audio_ns; /* audio duration of previous call */
+    volatile int32_t            duration_hist[STREAM_STATS_BUCKETS];
+    volatile int32_t            jitter_hist[STREAM_STATS_BUCKETS];
 };
 
 struct stream_out {
@@ -290,8 +458,24 @@ struct stream_out {
     int                         offload_state;
     pthread_cond_t              offload_cond;
     pthread_t                   offload_thread;
-    struct listnode             offload_cmd_list;
+    /* pending commands, preallocated ring of OFFLOAD_CMD_RING_SIZE entries */
+    struct offload_cmd          offload_cmd_ring[OFFLOAD_CMD_RING_SIZE];
+    unsigned int                offload_cmd_rd;
+    unsigned int                offload_cmd_pending;
     bool                        offload_thread_blocked;
+    /* offload command stats */
+    uint32_t                    offload_cmd_total;
+    uint32_t                    offload_cmd_coalesced;
+    uint32_t                    offload_cmd_dropped;
+    uint32_t                    offload_cb_count;
+    int64_t                     offload_dispatch_max_ns;
+    int64_t                     offload_cb_latency_sum_ns;
+    int64_t                     offload_cb_latency_max_ns;
+    /* AP wakeups to refill the compress buffer */
+    bool                        offload_buffer_full;
+    uint32_t                    offload_wakeups;
+    uint32_t                    offload_wakeups_per_min;
+    int64_t                     offload_wakeup_window_ns;
 
     stream_callback_t           offload_callback;
     void*                       offload_cookie;
@@ -301,15 +485,77 @@ struct stream_out {
     struct audio_device*        dev;
 
 #ifdef PREPROCESSING_ENABLED
-    struct echo_reference_itfe *echo_reference;
-    // echo_reference_generation indicates if the echo reference used by the output stream is
-    // in sync with the one known by the audio_device. When different from the generation stored
-    // in the audio_device the output stream must release the echo reference.
-    // always modified with audio device and stream mutex locked.
-    int32_t echo_reference_generation;
+    /* playback timing model extrapolated between driver timestamps */
+    bool                        timing_valid;
+    struct timespec             timing_ts;
+    int64_t                     timing_queued_ns;  /* driver queue duration at timing_ts */
+    uint64_t                    timing_anchor;     /* timing_written at timing_ts */
+    uint64_t                    timing_written;    /* frames written */
+    uint32_t                    timing_queries;
+    uint32_t                    timing_estimates;
 #endif
 
     bool                         is_fastmixer_affinity_set;
+    /* worst case out_write() duration since last standby, in ns */
+    int64_t                      write_max_ns;
+    /* offload volume, ramped by volume_thread. volume_lock is a leaf lock */
+    pthread_t                    volume_thread;
+    pthread_mutex_t              volume_lock;
+    pthread_cond_t               volume_cond;
+    bool                         volume_thread_exit;
+    bool                         volume_valid;      /* a volume has been applied */
+    bool                         volume_ramp_active;
+    int                          volume_start[2];
+    int                          volume_target[2];
+    int                          volume_current[2];
+    int64_t                      volume_ramp_start_ns;
+    /* multichannel content downmixed to the PCM channel count */
+    int16_t*                     downmix_buf;
+    size_t                       downmix_buf_size;
+    uint64_t                     downmix_frames;
+    int64_t                      downmix_ns;
+    /* float and 24 bit content converted to the 16 bit PCM format */
+    int16_t*                     convert_buf;
+    size_t                       convert_buf_size;
+    uint32_t                     dither_state[4];
+    uint64_t                     convert_frames;
+    int64_t                      convert_ns;
+    /* writes in the current and the last complete one second window */
+    uint32_t                     writes_window;
+    uint32_t                     writes_per_sec;
+    int64_t                      writes_window_ns;
+    /*
+     * Delayed standby: standby_warm is set while the PCM is stopped but open.
+     * standby_thread closes it once the standby delay has expired. Protected by lock.
+     */
+    pthread_t                    standby_thread;
+    pthread_cond_t               standby_cond;
+    bool                         standby_thread_exit;
+    bool                         standby_warm;
+    int64_t                      standby_start_ns;
+    uint32_t                     standby_expired;
+    int32_t                      standby_flush;  /* adev->standby_flush when going warm */
+    /* first write latency after standby, warm: PCM was kept open */
+    uint32_t                     resume_warm_count;
+    int64_t                      resume_warm_sum_ns;
+    int64_t                      resume_warm_max_ns;
+    uint32_t                     resume_cold_count;
+    int64_t                      resume_cold_sum_ns;
+    int64_t                      resume_cold_max_ns;
+    struct stream_stats          stats;
+};
+
+/*
+ * Ring of interleaved 16 bit frames. Readers and writers access it through
+ * contiguous views (see frame_ring_read_view()/frame_ring_write_view()) so
+ * that frames are produced and consumed in place, without compaction copies.
+ */
+struct frame_ring {
+    int16_t*                            buf;
+    size_t                              size;     /* capacity in frames */
+    size_t                              channels;
+    size_t                              rd;       /* read position in frames */
+    size_t                              frames;   /* frames available to read */
 };
 
 struct stream_in {
@@ -337,16 +583,13 @@ struct stream_in {
     size_t                              read_buf_size;
     size_t                              read_buf_frames;
 
-    int16_t *proc_buf_in;
+    struct frame_ring proc_ring;    /* preprocessing input */
     int16_t *proc_buf_out;
     size_t proc_buf_size;
-    size_t proc_buf_frames;
 
 #ifdef PREPROCESSING_ENABLED
     struct echo_reference_itfe *echo_reference;
-    int16_t *ref_buf;
-    size_t ref_buf_size;
-    size_t ref_buf_frames;
+    struct frame_ring ref_ring;
 
 #ifdef HW_AEC_LOOPBACK
     bool hw_echo_reference;
@@ -356,6 +599,8 @@ struct stream_in {
 
     int num_preprocessors;
     struct effect_info_s preprocessors[MAX_PREPROCESSORS];
+    int16_t *pipe_buf[2];           /* ping-pong buffers between pipeline stages */
+    size_t pipe_buf_size;
 
     bool aux_channels_changed;
     uint32_t aux_channels;
@@ -363,6 +608,45 @@ struct stream_in {
 
     struct audio_device*                dev;
     bool                                is_fastcapture_affinity_set;
+    struct stream_stats                 stats;
+    int64_t                             read_cpu_ns;  /* thread CPU time spent in in_read() */
+
+    /* mmap capture: frames of the current period, read in place from the DMA buffer */
+    int16_t*                            mmap_buf;
+    size_t                              mmap_frames;
+    /* CLOCK_MONOTONIC capture time of the first frame of the last mapped period */
+    int64_t                             capture_time_ns;
+
+    /* hotword handoff from the DSP stream to hotword_pcm, see hotword_read() */
+    int                                 hotword_state;
+    struct pcm*                         hotword_pcm;
+    struct resampler_itfe*              hotword_resampler;
+    snd_device_t                        hotword_snd_device;
+    int16_t*                            hotword_pcm_buf;    /* raw PCM period */
+    int16_t*                            hotword_dsp_tail;   /* last DSP frames */
+    size_t                              hotword_dsp_tail_frames;
+    int16_t*                            hotword_hist;       /* PCM at the DSP rate */
+    size_t                              hotword_hist_frames;
+    size_t                              hotword_hist_rd;
+    uint32_t                            hotword_splice_attempts;
+    size_t                              hotword_splice_offset;
+    float                               hotword_splice_score;
+    uint32_t                            hotword_pcm_overruns;
+};
+
+enum {
+    HOTWORD_STATE_DSP,              /* reading from the DSP, hotword_pcm pre-opened */
+    HOTWORD_STATE_PCM,              /* spliced: reading from hotword_pcm */
+    HOTWORD_STATE_DSP_ONLY,         /* no handoff possible: reading from the DSP */
+};
+
+/* Mixer controls looked up once when the card mixer is opened */
+enum {
+    MIXER_CTL_ID_COMPRESS_PLAYBACK_VOLUME,
+    MIXER_CTL_ID_HEADPHONE_JACK_SWITCH,
+    MIXER_CTL_ID_CODEC_VMIXER_CODEC_SWITCH,
+    MIXER_CTL_ID_SPK_VMIXER_SPK_SWITCH,
+    MIXER_CTL_ID_MAX,
 };
 
 struct mixer_card {
@@ -371,6 +655,32 @@ struct mixer_card {
     int                 card;
     struct mixer*       mixer;
     struct audio_route* audio_route;
+    struct mixer_ctl*   ctls[MIXER_CTL_ID_MAX];     /* NULL if not on this card */
+};
+
+/* Max number of individual snd devices a (combo) snd device expands to */
+#define SND_DEVICE_COMPONENTS_MAX 2
+
+/*
+ * Path changes needed to move a usecase from one snd device to another,
+ * computed on first use and cached in audio_device.snd_dev_transitions.
+ * Components common to both ends are left untouched and components sharing
+ * the same mixer path only move their ref count.
+ */
+struct snd_device_transition {
+    bool                    valid;
+    int8_t                  num_disable;
+    int8_t                  num_enable;
+    int8_t                  num_move;
+    int8_t                  disable[SND_DEVICE_COMPONENTS_MAX];
+    int8_t                  enable[SND_DEVICE_COMPONENTS_MAX];
+    int8_t                  move_from[SND_DEVICE_COMPONENTS_MAX];
+    int8_t                  move_to[SND_DEVICE_COMPONENTS_MAX];
+    /* stats, updated with adev->lock held */
+    uint32_t                count;
+    uint32_t                mixer_updates;
+    uint32_t                max_us;
+    uint64_t                total_us;
 };
 
 struct audio_usecase {
@@ -385,6 +695,108 @@ struct audio_usecase {
 };
 
 
+/* Roles of the threads running HAL code, see thread_role_policies in audio_hw.c */
+enum {
+    THREAD_ROLE_FAST_MIXER,         /* low latency out_write() caller */
+    THREAD_ROLE_FAST_CAPTURE,       /* low latency in_read() caller */
+    THREAD_ROLE_OFFLOAD_CALLBACK,
+    THREAD_ROLE_OFFLOAD_VOLUME,
+    THREAD_ROLE_ROUTING,
+    THREAD_ROLE_TFA9895,
+    THREAD_ROLE_DUMMYBUF,
+    THREAD_ROLE_OUT_STANDBY,
+    THREAD_ROLE_PCM_TAP,
+    THREAD_ROLE_INIT,
+    THREAD_ROLE_LATENCY_TEST,
+    THREAD_ROLE_MAX,
+};
+
+/* Placement requested for the last thread of a role, for adev_dump() */
+struct thread_placement {
+    pid_t                   tid;            /* 0 if no thread had this role yet */
+    int                     cpu;            /* pinned CPU, -1 if not pinned */
+    int                     error;          /* last errno from the sched calls */
+};
+
+#define PROCFS_ROOT_DEFAULT "/proc"
+
+/*
+ * Round trip latency test, started with the "latency_test=<runs>" parameter. Each
+ * run plays a maximum length sequence on the first PCM output written to and looks
+ * for it in what the first PCM input at the same rate returns to its client.
+ */
+#define LATENCY_TEST_MLS_ORDER 10
+#define LATENCY_TEST_MLS_LENGTH ((1 << LATENCY_TEST_MLS_ORDER) - 1)
+#define LATENCY_TEST_LEVEL 8192                 /* -12 dBFS */
+#define LATENCY_TEST_WINDOW_MS 500              /* capture per run, longest latency measurable */
+#define LATENCY_TEST_MAX_RATE 48000
+#define LATENCY_TEST_MAX_RUNS 20
+/* correlation peak over mean correlation for a run to be valid */
+#define LATENCY_TEST_MIN_PEAK_RATIO 8
+
+enum {
+    LATENCY_TEST_IDLE,
+    LATENCY_TEST_ARMED,             /* waiting for a capture to start the run */
+    LATENCY_TEST_RECORDING,         /* capturing, sequence played by the next output write */
+    LATENCY_TEST_ANALYZING,         /* capture window full, handed to the analysis thread */
+};
+
+/*
+ * PCM taps copy audio at a pipeline stage to a WAV file, see pcm_tap_write().
+ * Enabled with the "pcm_tap=<name>[,<name>...]" parameter, "pcm_tap=off" disables.
+ */
+enum {
+    PCM_TAP_PRE_RESAMPLER,          /* capture PCM, at the device rate */
+    PCM_TAP_POST_RESAMPLER,         /* capture at the client rate */
+    PCM_TAP_PRE_PROCESSING,         /* input of the pre processing chain */
+    PCM_TAP_POST_PROCESSING,        /* output of the pre processing chain */
+    PCM_TAP_ECHO_REFERENCE,         /* reference frames passed to the echo canceller */
+    PCM_TAP_HOTWORD_DSP,            /* hotword audio streamed from the DSP */
+    PCM_TAP_MAX,
+};
+
+#define PCM_TAP_RING_SIZE (256 * 1024)          /* bytes, must be a power of 2 */
+#define PCM_TAP_WRITER_PERIOD_MS 100
+#define PCM_TAP_DIR_DEFAULT "/data/misc/audio"
+
+/*
+ * Single producer (the stream thread), single consumer (pcm_tap_thread) ring.
+ * Producers never block: what does not fit is dropped and counted.
+ */
+struct pcm_tap {
+    char*                   ring;               /* allocated by the writer on first use */
+    volatile int32_t        rd;                 /* bytes, written by the writer only */
+    volatile int32_t        wr;                 /* bytes, written by the producer only */
+    volatile int32_t        enabled;            /* set by the writer once ring is ready */
+    volatile int32_t        format;             /* rate * 16 + channels, 0 until the first write */
+    volatile int32_t        frames_dropped;
+    int64_t                 frames_written;
+    FILE*                   file;
+    uint32_t                data_bytes;
+    unsigned int            file_count;
+};
+
+struct latency_test {
+    pthread_mutex_t         lock;               /* leaf lock */
+    pthread_cond_t          cond;               /* signaled when a window is ready to analyze */
+    pthread_t               thread;             /* started by the first latency_test=<runs> */
+    bool                    thread_exit;
+    int                     state;
+    int                     runs_requested;
+    int                     runs_done;
+    int                     runs_failed;
+    unsigned int            rate;
+    int16_t                 mls[LATENCY_TEST_MLS_LENGTH];   /* +1/-1 */
+    int16_t*                capture;            /* channel 0 of the input, per run */
+    size_t                  capture_frames;
+    size_t                  window_frames;
+    size_t                  probe_pos;          /* sequence frames played so far */
+    ssize_t                 probe_capture_frame; /* capture_frames when the sequence started */
+    audio_usecase_t         out_usecase;
+    audio_usecase_t         in_usecase;
+    int32_t                 latency_us[LATENCY_TEST_MAX_RUNS];
+};
+
 struct audio_device {
     struct audio_hw_device  device;
     pthread_mutex_t         lock; /* see note below on mutex acquisition order */
@@ -397,8 +809,13 @@ struct audio_device {
     bool                    mic_mute;
     int                     tty_mode;
     bool                    bluetooth_nrec;
+    bool                    bluetooth_wbs;
     bool                    screen_off;
+    unsigned int            standby_delay_ms;
+    unsigned int            standby_delay_screen_off_ms;
+    volatile int32_t        standby_flush;   /* bumped to close outputs in warm standby */
     int*                    snd_dev_ref_cnt;
+    struct snd_device_transition* snd_dev_transitions; /* [SND_DEVICE_MAX][SND_DEVICE_MAX] */
     struct listnode         usecase_list;
     bool                    speaker_lr_swap;
     unsigned int            cur_hdmi_channels;
@@ -406,17 +823,14 @@ struct audio_device {
     bool                    ns_in_voice_rec;
 
     void*                   offload_fx_lib;
+    bool                    offload_fx_lib_loaded; /* loaded on first offload start */
     int                     (*offload_fx_start_output)(audio_io_handle_t);
     int                     (*offload_fx_stop_output)(audio_io_handle_t);
 
 #ifdef PREPROCESSING_ENABLED
+    /* only used by the capture thread, created and released with audio device mutex locked */
     struct echo_reference_itfe* echo_reference;
-    // echo_reference_generation indicates if the echo reference used by the output stream is
-    // in sync with the one known by the audio_device.
-    // incremented atomically with a memory barrier and audio device mutex locked but WITHOUT
-    // stream mutex locked: the stream will load it atomically with a barrier and re-read it
-    // with audio device mutex if needed
-    volatile int32_t        echo_reference_generation;
+    struct echo_ref_ring    echo_ref_ring;
 #endif
 
     void*                   htc_acoustic_lib;
@@ -426,6 +840,7 @@ struct audio_device {
     int                     (*htc_acoustic_spk_reverse)(bool);
 
     void*                   sound_trigger_lib;
+    bool                    sound_trigger_lib_loaded; /* loaded on first hotword capture */
     int                     (*sound_trigger_open_for_streaming)();
     size_t                  (*sound_trigger_read_samples)(int, void*, size_t);
     int                     (*sound_trigger_close_for_streaming)(int);
@@ -433,14 +848,68 @@ struct audio_device {
     int                     tfa9895_init;
     int                     tfa9895_mode_change;
     pthread_mutex_t         tfa9895_lock;
-
-    int                     dummybuf_thread_timeout;
+    int                     tfa9895_config_state;
+    int                     tfa9895_config_failures;
+    bool                    tfa9895_config_exit;
+    pthread_t               tfa9895_config_thread;
+    pthread_cond_t          tfa9895_config_cond;
+    pthread_mutex_t         tfa9895_config_lock;
+    bool                    tfa9895_owns_playback_pcm; /* dummybuf runs for it, under adev->lock */
+
+    int                     dummybuf_thread_timeout; /* in ms */
     int                     dummybuf_thread_cancel;
     int                     dummybuf_thread_active;
+    bool                    dummybuf_thread_exited;
     audio_devices_t         dummybuf_thread_devices;
+    struct pcm*             dummybuf_thread_pcm;
     pthread_mutex_t         dummybuf_thread_lock;
+    pthread_cond_t          dummybuf_thread_cond;
     pthread_t               dummybuf_thread;
 
+    /* amp and codec init done after adev_open() returns, see adev_init_thread() */
+    pthread_t               init_thread;
+    pthread_mutex_t         init_lock;
+    pthread_cond_t          init_cond;
+    bool                    init_done;
+    bool                    init_hs_gpio; /* first device open: HS GPIO and NXP DSP config */
+
+    pthread_t               route_thread;
+    pthread_mutex_t         route_lock;
+    pthread_cond_t          route_cond;      /* signaled when a command is posted */
+    pthread_cond_t          route_done_cond; /* broadcast when a command completes */
+    struct listnode         route_cmd_list;
+    uint32_t                route_seq_posted;
+    uint32_t                route_seq_done;
+    uint32_t                route_amp_seq;   /* last rt5506 command posted, under adev->lock */
+    /* routing stats, protected by route_lock */
+    uint32_t                route_cmd_count;
+    int64_t                 route_latency_max_ns;   /* post to completion */
+    int64_t                 route_lock_max_ns;      /* adev->lock hold time in the worker */
+    int64_t                 route_caller_lock_max_ns; /* adev->lock hold time in set_parameters */
+    uint32_t                route_amp_count;        /* rt5506 and speaker reverse I2C calls */
+
+    /* thread placement. thread_policy_lock is a leaf lock */
+    pthread_mutex_t         thread_policy_lock;
+    char                    procfs_root[PATH_MAX];
+    int                     irq_cpu;                /* -1 until read from procfs */
+    struct thread_placement thread_placement[THREAD_ROLE_MAX];
+
+    struct latency_test     latency_test;
+
+    /* PCM taps, pcm_tap_lock protects the fields below. Leaf lock */
+    pthread_mutex_t         pcm_tap_lock;
+    pthread_cond_t          pcm_tap_cond;
+    pthread_t               pcm_tap_thread;
+    bool                    pcm_tap_exit;
+    uint32_t                pcm_tap_requested;      /* mask of (1 << PCM_TAP_*) */
+    char                    pcm_tap_dir[PATH_MAX];
+    struct pcm_tap          pcm_taps[PCM_TAP_MAX];
+
+    /* mixer control writes and audio route updates, see adev_dump() */
+    volatile int32_t        mixer_ops;
+    int32_t                 mixer_ops_dump;
+    int64_t                 mixer_ops_dump_ns;
+
     pthread_mutex_t         lock_inputs; /* see note below on mutex acquisition order */
 };
 
@@ -449,7 +918,12 @@ struct audio_device {
  * lock_inputs, stream_in, stream_out, audio_device, then tfa9895 mutex.
  * stream_in mutex must always be before stream_out mutex
  * if both have to be taken (see get_echo_reference(), put_echo_reference()...)
- * dummybuf_thread mutex is not related to the other mutexes with respect to order.
+ * the primary output feeds the echo reference through echo_ref_ring without any lock.
+ * dummybuf_thread mutex comes after audio_device mutex, see tfa9895_preempt_dummybuf_l().
+ * tfa9895_config mutex is a leaf: no other mutex is acquired while holding it.
+ * init mutex is a leaf.
+ * route mutex is a leaf. The routing worker takes audio_device mutex only, so
+ * route_cmd_wait() must not be called with a stream or audio_device mutex held.
  * lock_inputs must be held in order to either close the input stream, or prevent closure.
  */
 
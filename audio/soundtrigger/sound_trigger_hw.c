@@ -24,6 +24,7 @@
 #include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/prctl.h>
+#include <cutils/atomic.h>
 #include <cutils/log.h>
 #include <cutils/uevent.h>
 
@@ -41,6 +42,8 @@
 #define FLOUNDER_STREAMING_DELAY_USEC	1000
 #define FLOUNDER_STREAMING_READ_RETRY_ATTEMPTS	30
 #define FLOUNDER_STREAMING_BUFFER_SIZE	(16 * 1024)
+/* 2 s of 16 kHz mono 16 bit audio, must be a power of 2 */
+#define FLOUNDER_STREAMING_RING_SIZE	(64 * 1024)
 
 static const struct sound_trigger_properties hw_properties = {
     "The Android Open Source Project", // implementor
@@ -76,8 +79,28 @@ struct flounder_sound_trigger_device {
     int is_streaming;
     int opened;
     char *streaming_buf;
-    size_t streaming_buf_read;
-    size_t streaming_buf_len;
+    /*
+     * Prefetch ring, filled from the DSP by prefetch_thread while streaming and
+     * drained by sound_trigger_read_samples(). Single producer, single consumer:
+     * ring_wr is only written by prefetch_thread and ring_rd by the reader, which
+     * holds lock while it copies so that the ring cannot be restarted or freed.
+     */
+    char *ring;
+    volatile int32_t ring_rd;
+    volatile int32_t ring_wr;
+    volatile int32_t prefetch_exit;
+    volatile int32_t prefetch_error;
+    pthread_t prefetch_thread;
+    bool prefetch_running;
+    /* wakes up a reader waiting on an empty ring */
+    pthread_mutex_t ring_lock;
+    pthread_cond_t ring_cond;
+    /* streaming stats, see stdev_prefetch_stop() */
+    volatile int32_t reads;
+    volatile int32_t stalls;
+    volatile int32_t dsp_overruns;
+    volatile int32_t ring_overruns;
+    volatile int32_t bytes_dropped;
 };
 
 struct rt_codec_cmd {
@@ -92,14 +115,19 @@ enum {
 
 // Since there's only ever one sound_trigger_device, keep it as a global so that other people can
 // dlopen this lib to get at the streaming audio.
-static struct flounder_sound_trigger_device g_stdev = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static struct flounder_sound_trigger_device g_stdev = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ring_lock = PTHREAD_MUTEX_INITIALIZER,
+    .ring_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void stdev_prefetch_stop(struct flounder_sound_trigger_device *stdev);
 
 static void stdev_dsp_set_power(struct flounder_sound_trigger_device *stdev,
                                 int val)
 {
+    stdev_prefetch_stop(stdev);
     stdev->is_streaming = 0;
-    stdev->streaming_buf_read = 0;
-    stdev->streaming_buf_len = 0;
     mixer_ctl_set_value(stdev->ctl_dsp, 0, val);
 }
 
@@ -216,35 +244,103 @@ static char *sound_trigger_event_alloc(struct flounder_sound_trigger_device *
     return data;
 }
 
-// The stdev should be locked when you call this function.
-static int fetch_streaming_buffer(struct flounder_sound_trigger_device * stdev)
+/*
+ * Drains the DSP into the ring for as long as streaming is active, so that the
+ * DSP buffer does not overrun while the reader is busy. Does not take stdev->lock.
+ */
+static void *prefetch_thread_loop(void *context)
 {
+    struct flounder_sound_trigger_device *stdev =
+               (struct flounder_sound_trigger_device *)context;
     struct rt_codec_cmd cmd;
-    int ret = 0;
-    int i;
+    int32_t wr, space;
+    size_t len, offset, count;
+    int ret;
+
+    prctl(PR_SET_NAME, (unsigned long)"sound trigger prefetch", 0, 0, 0);
 
     cmd.number = FLOUNDER_STREAMING_BUFFER_SIZE / sizeof(int);
-    cmd.buf = (int*) stdev->streaming_buf;
+    cmd.buf = (int *)stdev->streaming_buf;
 
-    ALOGV("%s: Fetching bytes", __func__);
-    for (i = 0; i < FLOUNDER_STREAMING_READ_RETRY_ATTEMPTS; i++) {
+    while (!android_atomic_acquire_load(&stdev->prefetch_exit)) {
         ret = ioctl(stdev->vad_fd, RT_READ_CODEC_DSP_IOCTL, &cmd);
         if (ret == 0) {
             usleep(FLOUNDER_STREAMING_DELAY_USEC);
+            continue;
         } else if (ret < 0) {
             ALOGV("%s: IOCTL failed with code %d", __func__, ret);
-            return ret;
-        } else {
-            // The IOCTL returns the number of int16 samples that were read, so we need to multipy
-            // it by 2 .
-            ALOGV("%s: IOCTL captured %d samples", __func__, ret);
-            stdev->streaming_buf_read = 0;
-            stdev->streaming_buf_len = ret << 1;
-            return 0;
+            android_atomic_release_store(ret, &stdev->prefetch_error);
+            break;
+        }
+        // The IOCTL returns the number of int16 samples that were read, so we need to multipy
+        // it by 2 .
+        len = ret << 1;
+        ALOGV("%s: IOCTL captured %d samples", __func__, ret);
+        // A full read means the DSP had at least that much queued: it may have wrapped.
+        if (len >= FLOUNDER_STREAMING_BUFFER_SIZE)
+            android_atomic_inc(&stdev->dsp_overruns);
+
+        wr = stdev->ring_wr;
+        space = FLOUNDER_STREAMING_RING_SIZE - (wr - android_atomic_acquire_load(&stdev->ring_rd));
+        if (len > (size_t)space) {
+            // The reader is not keeping up: keep the oldest audio, it is what it reads next.
+            android_atomic_inc(&stdev->ring_overruns);
+            android_atomic_add(len - space, &stdev->bytes_dropped);
+            len = space;
         }
+        offset = wr & (FLOUNDER_STREAMING_RING_SIZE - 1);
+        count = FLOUNDER_STREAMING_RING_SIZE - offset;
+        if (count > len)
+            count = len;
+        memcpy(stdev->ring + offset, stdev->streaming_buf, count);
+        memcpy(stdev->ring, stdev->streaming_buf + count, len - count);
+        android_atomic_release_store(wr + len, &stdev->ring_wr);
+
+        pthread_mutex_lock(&stdev->ring_lock);
+        pthread_cond_signal(&stdev->ring_cond);
+        pthread_mutex_unlock(&stdev->ring_lock);
     }
-    ALOGV("%s: Timeout waiting for data from dsp", __func__);
-    return 0;
+    pthread_mutex_lock(&stdev->ring_lock);
+    pthread_cond_signal(&stdev->ring_cond);
+    pthread_mutex_unlock(&stdev->ring_lock);
+    return NULL;
+}
+
+// The stdev should be locked when you call this function.
+static void stdev_prefetch_start(struct flounder_sound_trigger_device *stdev)
+{
+    if (stdev->prefetch_running)
+        return;
+
+    // Empty the ring but keep both indices monotonic.
+    android_atomic_release_store(stdev->ring_rd, &stdev->ring_wr);
+    stdev->prefetch_exit = 0;
+    stdev->prefetch_error = 0;
+    stdev->reads = 0;
+    stdev->stalls = 0;
+    stdev->dsp_overruns = 0;
+    stdev->ring_overruns = 0;
+    stdev->bytes_dropped = 0;
+    if (pthread_create(&stdev->prefetch_thread, (const pthread_attr_t *) NULL,
+                       prefetch_thread_loop, stdev) != 0) {
+        ALOGE("%s: Error creating prefetch thread", __func__);
+        return;
+    }
+    stdev->prefetch_running = true;
+}
+
+// The stdev should be locked when you call this function.
+static void stdev_prefetch_stop(struct flounder_sound_trigger_device *stdev)
+{
+    if (!stdev->prefetch_running)
+        return;
+
+    android_atomic_release_store(1, &stdev->prefetch_exit);
+    pthread_join(stdev->prefetch_thread, (void **) NULL);
+    stdev->prefetch_running = false;
+    ALOGI("%s: %d reads, %d stalls, %d DSP overruns, %d ring overruns (%d bytes dropped)",
+          __func__, stdev->reads, stdev->stalls, stdev->dsp_overruns, stdev->ring_overruns,
+          stdev->bytes_dropped);
 }
 
 static void *callback_thread_loop(void *context)
@@ -320,7 +416,7 @@ static void *callback_thread_loop(void *context)
                         free(event);
                         // Start reading data from the DSP while the upper levels do their thing.
                         if (stdev->config && stdev->config->capture_requested) {
-                            fetch_streaming_buffer(stdev);
+                            stdev_prefetch_start(stdev);
                         }
                     }
                     goto found;
@@ -546,11 +642,25 @@ exit:
     return ret;
 }
 
+// Bytes the reader may consume from rd, clamped to what the ring can hold.
+static int32_t ring_avail(struct flounder_sound_trigger_device *stdev, int32_t rd)
+{
+    int32_t avail = android_atomic_acquire_load(&stdev->ring_wr) - rd;
+
+    if (avail < 0)
+        return 0;
+    if (avail > FLOUNDER_STREAMING_RING_SIZE)
+        return FLOUNDER_STREAMING_RING_SIZE;
+    return avail;
+}
+
 __attribute__ ((visibility ("default")))
 size_t sound_trigger_read_samples(int audio_handle, void *buffer, size_t  buffer_len)
 {
     struct flounder_sound_trigger_device *stdev = &g_stdev;
-    int i;
+    struct timespec ts;
+    int32_t rd, avail;
+    size_t offset, count;
     size_t ret = 0;
 
     if (audio_handle <= 0) {
@@ -570,19 +680,58 @@ size_t sound_trigger_read_samples(int audio_handle, void *buffer, size_t  buffer
         ret = -EINVAL;
         goto exit;
     }
-
-    if (stdev->streaming_buf_read == stdev->streaming_buf_len) {
-        ret = fetch_streaming_buffer(stdev);
+    // Streaming was requested by the audio HAL without a capture request from the framework.
+    stdev_prefetch_start(stdev);
+
+    android_atomic_inc(&stdev->reads);
+    rd = stdev->ring_rd;
+    avail = ring_avail(stdev, rd);
+    if (avail == 0) {
+        // Nothing prefetched: wait as long as the DSP used to be polled for.
+        android_atomic_inc(&stdev->stalls);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += FLOUNDER_STREAMING_DELAY_USEC * FLOUNDER_STREAMING_READ_RETRY_ATTEMPTS * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_nsec -= 1000000000;
+            ts.tv_sec++;
+        }
+        // Only the wait runs unlocked: stopping or closing must not wait for the DSP.
+        pthread_mutex_unlock(&stdev->lock);
+        pthread_mutex_lock(&stdev->ring_lock);
+        while ((avail = ring_avail(stdev, rd)) == 0 &&
+                android_atomic_acquire_load(&stdev->prefetch_error) == 0 &&
+                !android_atomic_acquire_load(&stdev->prefetch_exit)) {
+            if (pthread_cond_timedwait(&stdev->ring_cond, &stdev->ring_lock, &ts) == ETIMEDOUT)
+                break;
+        }
+        pthread_mutex_unlock(&stdev->ring_lock);
+        pthread_mutex_lock(&stdev->lock);
+        if (!stdev->opened) {
+            ALOGE("%s: stdev closed while waiting for data", __func__);
+            ret = -EFAULT;
+            goto exit;
+        }
+        // The ring may have been restarted meanwhile.
+        rd = stdev->ring_rd;
+        avail = ring_avail(stdev, rd);
+        if (avail == 0) {
+            ALOGV("%s: Timeout waiting for data from dsp", __func__);
+            ret = android_atomic_acquire_load(&stdev->prefetch_error);
+            goto exit;
+        }
     }
 
-    if (!ret) {
-        ret = stdev->streaming_buf_len - stdev->streaming_buf_read;
-        if (ret > buffer_len)
-            ret = buffer_len;
-        memcpy(buffer, stdev->streaming_buf + stdev->streaming_buf_read, ret);
-        stdev->streaming_buf_read += ret;
-        ALOGV("%s: Sent %zu bytes to buffer", __func__, ret);
-    }
+    ret = avail;
+    if (ret > buffer_len)
+        ret = buffer_len;
+    offset = rd & (FLOUNDER_STREAMING_RING_SIZE - 1);
+    count = FLOUNDER_STREAMING_RING_SIZE - offset;
+    if (count > ret)
+        count = ret;
+    memcpy(buffer, stdev->ring + offset, count);
+    memcpy((char *)buffer + count, stdev->ring, ret - count);
+    android_atomic_release_store(rd + ret, &stdev->ring_rd);
+    ALOGV("%s: Sent %zu bytes to buffer", __func__, ret);
 
 exit:
     pthread_mutex_unlock(&stdev->lock);
@@ -609,8 +758,10 @@ static int stdev_close(hw_device_t *device)
         ret = -EFAULT;
         goto exit;
     }
-    free(stdev->streaming_buf);
+    // Also stops the prefetch thread, the ring's writer.
     stdev_close_mixer(stdev);
+    free(stdev->streaming_buf);
+    free(stdev->ring);
     stdev->model_handle = 0;
     stdev->send_sock = 0;
     stdev->term_sock = 0;
@@ -640,7 +791,10 @@ static int stdev_open(const hw_module_t *module, const char *name,
     }
 
     stdev->streaming_buf = malloc(FLOUNDER_STREAMING_BUFFER_SIZE);
-    if (!stdev->streaming_buf) {
+    stdev->ring = malloc(FLOUNDER_STREAMING_RING_SIZE);
+    if (!stdev->streaming_buf || !stdev->ring) {
+        free(stdev->streaming_buf);
+        free(stdev->ring);
         ret = -ENOMEM;
         goto exit;
     }
@@ -649,6 +803,7 @@ static int stdev_open(const hw_module_t *module, const char *name,
     if (ret) {
         ALOGE("Error mixer init");
         free(stdev->streaming_buf);
+        free(stdev->ring);
         goto exit;
     }
 
@@ -662,8 +817,6 @@ static int stdev_open(const hw_module_t *module, const char *name,
     stdev->device.start_recognition = stdev_start_recognition;
     stdev->device.stop_recognition = stdev_stop_recognition;
     stdev->send_sock = stdev->term_sock = -1;
-    stdev->streaming_buf_read = 0;
-    stdev->streaming_buf_len = 0;
     stdev->opened = true;
 
     *device = &stdev->device.common; /* same address as stdev */
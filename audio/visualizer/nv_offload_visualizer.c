@@ -23,6 +23,12 @@
 #include <time.h>
 #include <sys/prctl.h>
 
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <cutils/list.h>
 #include <cutils/log.h>
 #include <system/thread_defs.h>
@@ -629,6 +635,133 @@ int visualizer_set_parameter(effect_context_t *context, effect_param_t *p, uint3
     return 0;
 }
 
+/* statistics of one buffer, see pcm_measure_capture() */
+typedef struct pcm_measure_s {
+    int16_t max;
+    int16_t min;
+    uint64_t sum_squares;
+} pcm_measure_t;
+
+/*
+ * One pass over an interleaved stereo 16 bit buffer computing the extrema and the
+ * sum of squares of all samples into m, and the mono 8 bit capture
+ * ((L + R) >> shift) ^ 0x80 into capture. Either output may be NULL. shift must be
+ * at least 1.
+ */
+static void pcm_measure_capture(const int16_t *in, size_t frames, int shift,
+                                uint8_t *capture, pcm_measure_t *m)
+{
+    int16_t max = m ? m->max : 0, min = m ? m->min : 0;
+    uint64_t sum_squares = 0;
+    size_t i = 0;
+    int32_t smp;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    int16x8_t vmax = vdupq_n_s16(max), vmin = vdupq_n_s16(min);
+    int16x8_t vshift = vdupq_n_s16(-(shift - 1));
+    int64x2_t vsum = vdupq_n_s64(0);
+    uint8x8_t vbias = vdup_n_u8(0x80);
+    int16x8x2_t v;
+
+    for (; i + 8 <= frames; i += 8) {
+        v = vld2q_s16(in + 2 * i);
+        if (m) {
+            vmax = vmaxq_s16(vmax, vmaxq_s16(v.val[0], v.val[1]));
+            vmin = vminq_s16(vmin, vminq_s16(v.val[0], v.val[1]));
+            /* a square fits in 31 bits: widen to 64 bits after each product */
+            vsum = vpadalq_s32(vsum, vmull_s16(vget_low_s16(v.val[0]), vget_low_s16(v.val[0])));
+            vsum = vpadalq_s32(vsum, vmull_s16(vget_high_s16(v.val[0]), vget_high_s16(v.val[0])));
+            vsum = vpadalq_s32(vsum, vmull_s16(vget_low_s16(v.val[1]), vget_low_s16(v.val[1])));
+            vsum = vpadalq_s32(vsum, vmull_s16(vget_high_s16(v.val[1]), vget_high_s16(v.val[1])));
+        }
+        if (capture) {
+            /* halving add is (L + R) >> 1 without overflow */
+            int16x8_t mono = vshlq_s16(vhaddq_s16(v.val[0], v.val[1]), vshift);
+            vst1_u8(capture + i, veor_u8(vreinterpret_u8_s8(vmovn_s16(mono)), vbias));
+        }
+    }
+    if (m) {
+        int16x4_t max4 = vmax_s16(vget_low_s16(vmax), vget_high_s16(vmax));
+        int16x4_t min4 = vmin_s16(vget_low_s16(vmin), vget_high_s16(vmin));
+        max4 = vpmax_s16(max4, max4);
+        min4 = vpmin_s16(min4, min4);
+        max4 = vpmax_s16(max4, max4);
+        min4 = vpmin_s16(min4, min4);
+        max = vget_lane_s16(max4, 0);
+        min = vget_lane_s16(min4, 0);
+        sum_squares = (uint64_t)(vgetq_lane_s64(vsum, 0) + vgetq_lane_s64(vsum, 1));
+    }
+#elif defined(__SSE2__)
+    __m128i vmax = _mm_set1_epi16(max), vmin = _mm_set1_epi16(min);
+    __m128i vshift = _mm_cvtsi32_si128(shift);
+    __m128i vsum = _mm_setzero_si128(), zero = _mm_setzero_si128();
+    __m128i vlow = _mm_set1_epi16(0xff), vbias = _mm_set1_epi8((char)0x80);
+    __m128i a, b, sq;
+    uint64_t lanes[2];
+
+    for (; i + 8 <= frames; i += 8) {
+        a = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+        b = _mm_loadu_si128((const __m128i *)(in + 2 * i + 8));
+        if (m) {
+            vmax = _mm_max_epi16(vmax, _mm_max_epi16(a, b));
+            vmin = _mm_min_epi16(vmin, _mm_min_epi16(a, b));
+            /* a sum of two squares fits in 32 unsigned bits */
+            sq = _mm_madd_epi16(a, a);
+            vsum = _mm_add_epi64(vsum, _mm_add_epi64(_mm_unpacklo_epi32(sq, zero),
+                                                     _mm_unpackhi_epi32(sq, zero)));
+            sq = _mm_madd_epi16(b, b);
+            vsum = _mm_add_epi64(vsum, _mm_add_epi64(_mm_unpacklo_epi32(sq, zero),
+                                                     _mm_unpackhi_epi32(sq, zero)));
+        }
+        if (capture) {
+            /* L + R of 4 frames in 32 bit lanes, then truncated to 8 bits */
+            __m128i mono_a = _mm_add_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+                                           _mm_srai_epi32(a, 16));
+            __m128i mono_b = _mm_add_epi32(_mm_srai_epi32(_mm_slli_epi32(b, 16), 16),
+                                           _mm_srai_epi32(b, 16));
+            __m128i mono = _mm_packs_epi32(_mm_sra_epi32(mono_a, vshift),
+                                           _mm_sra_epi32(mono_b, vshift));
+            mono = _mm_packus_epi16(_mm_and_si128(mono, vlow), zero);
+            _mm_storel_epi64((__m128i *)(capture + i), _mm_xor_si128(mono, vbias));
+        }
+    }
+    if (m) {
+        int16_t lane[8];
+        int j;
+
+        _mm_storeu_si128((__m128i *)lane, vmax);
+        for (j = 0; j < 8; j++)
+            if (lane[j] > max) max = lane[j];
+        _mm_storeu_si128((__m128i *)lane, vmin);
+        for (j = 0; j < 8; j++)
+            if (lane[j] < min) min = lane[j];
+        _mm_storeu_si128((__m128i *)lanes, vsum);
+        sum_squares = lanes[0] + lanes[1];
+    }
+#endif
+
+    for (; i < frames; i++) {
+        if (m) {
+            if (in[2 * i] > max) max = in[2 * i];
+            if (in[2 * i] < min) min = in[2 * i];
+            if (in[2 * i + 1] > max) max = in[2 * i + 1];
+            if (in[2 * i + 1] < min) min = in[2 * i + 1];
+            sum_squares += (uint32_t)(in[2 * i] * in[2 * i]) +
+                           (uint32_t)(in[2 * i + 1] * in[2 * i + 1]);
+        }
+        if (capture) {
+            smp = (in[2 * i] + in[2 * i + 1]) >> shift;
+            capture[i] = ((uint8_t)smp)^0x80;
+        }
+    }
+
+    if (m) {
+        m->max = max;
+        m->min = min;
+        m->sum_squares += sum_squares;
+    }
+}
+
 /* Real process function called from capture thread. Called with lock held */
 int visualizer_process(effect_context_t *context,
                        audio_buffer_t *inBuffer,
@@ -646,45 +779,19 @@ int visualizer_process(effect_context_t *context,
         return -EINVAL;
     }
 
-    // perform measurements if needed
-    if (visu_ctxt->meas_mode & MEASUREMENT_MODE_PEAK_RMS) {
-        // find the peak and RMS squared for the new buffer
-        uint32_t inIdx;
-        int16_t max_sample = 0;
-        float rms_squared_acc = 0;
-        for (inIdx = 0 ; inIdx < inBuffer->frameCount * visu_ctxt->channel_count ; inIdx++) {
-            if (inBuffer->s16[inIdx] > max_sample) {
-                max_sample = inBuffer->s16[inIdx];
-            } else if (-inBuffer->s16[inIdx] > max_sample) {
-                max_sample = -inBuffer->s16[inIdx];
-            }
-            rms_squared_acc += (inBuffer->s16[inIdx] * inBuffer->s16[inIdx]);
-        }
-        // store the measurement
-        visu_ctxt->past_meas[visu_ctxt->meas_buffer_idx].peak_u16 = (uint16_t)max_sample;
-        visu_ctxt->past_meas[visu_ctxt->meas_buffer_idx].rms_squared =
-                rms_squared_acc / (inBuffer->frameCount * visu_ctxt->channel_count);
-        visu_ctxt->past_meas[visu_ctxt->meas_buffer_idx].is_valid = true;
-        if (++visu_ctxt->meas_buffer_idx >= visu_ctxt->meas_wndw_size_in_buffers) {
-            visu_ctxt->meas_buffer_idx = 0;
-        }
-    }
-
     /* all code below assumes stereo 16 bit PCM output and input */
     int32_t shift;
+    pcm_measure_t meas = { 0, 0, 0 };
+    bool measure = visu_ctxt->meas_mode & MEASUREMENT_MODE_PEAK_RMS;
 
     if (visu_ctxt->scaling_mode == VISUALIZER_SCALING_MODE_NORMALIZED) {
         /* derive capture scaling factor from peak value in current buffer
-         * this gives more interesting captures for display. */
-        shift = 32;
-        int len = inBuffer->frameCount * 2;
-        int i;
-        for (i = 0; i < len; i++) {
-            int32_t smp = inBuffer->s16[i];
-            if (smp < 0) smp = -smp - 1; /* take care to keep the max negative in range */
-            int32_t clz = __builtin_clz(smp);
-            if (shift > clz) shift = clz;
-        }
+         * this gives more interesting captures for display. The peak is needed
+         * before converting so this takes a second pass over the buffer. */
+        pcm_measure_capture(inBuffer->s16, inBuffer->frameCount, 1, NULL, &meas);
+        /* take care to keep the max negative in range: -smp - 1 is ~smp */
+        uint32_t max_mag = meas.max > ~meas.min ? meas.max : ~meas.min;
+        shift = max_mag == 0 ? 32 : __builtin_clz(max_mag);
         /* A maximum amplitude signal will have 17 leading zeros, which we want to
          * translate to a shift of 8 (for converting 16 bit to 8 bit) */
         shift = 25 - shift;
@@ -700,19 +807,35 @@ int visualizer_process(effect_context_t *context,
         shift = 9;
     }
 
-    uint32_t capt_idx;
+    uint32_t capt_idx = visu_ctxt->capture_idx;
     uint32_t in_idx;
-    uint8_t *buf = visu_ctxt->capture_buf;
-    for (in_idx = 0, capt_idx = visu_ctxt->capture_idx;
-         in_idx < inBuffer->frameCount;
-         in_idx++, capt_idx++) {
+    uint32_t count;
+    for (in_idx = 0; in_idx < inBuffer->frameCount; in_idx += count) {
         if (capt_idx >= CAPTURE_BUF_SIZE) {
             /* wrap around */
             capt_idx = 0;
         }
-        int32_t smp = inBuffer->s16[2 * in_idx] + inBuffer->s16[2 * in_idx + 1];
-        smp = smp >> shift;
-        buf[capt_idx] = ((uint8_t)smp)^0x80;
+        count = inBuffer->frameCount - in_idx;
+        if (count > CAPTURE_BUF_SIZE - capt_idx)
+            count = CAPTURE_BUF_SIZE - capt_idx;
+        /* measurements are already done in normalized mode */
+        pcm_measure_capture(inBuffer->s16 + 2 * in_idx, count, shift,
+                            visu_ctxt->capture_buf + capt_idx,
+                            measure && visu_ctxt->scaling_mode != VISUALIZER_SCALING_MODE_NORMALIZED ?
+                                    &meas : NULL);
+        capt_idx += count;
+    }
+
+    // store the measurements if needed
+    if (measure) {
+        int32_t peak = meas.max > -meas.min ? meas.max : -meas.min;
+        visu_ctxt->past_meas[visu_ctxt->meas_buffer_idx].peak_u16 = (uint16_t)peak;
+        visu_ctxt->past_meas[visu_ctxt->meas_buffer_idx].rms_squared =
+                (double)meas.sum_squares / (inBuffer->frameCount * visu_ctxt->channel_count);
+        visu_ctxt->past_meas[visu_ctxt->meas_buffer_idx].is_valid = true;
+        if (++visu_ctxt->meas_buffer_idx >= visu_ctxt->meas_wndw_size_in_buffers) {
+            visu_ctxt->meas_buffer_idx = 0;
+        }
     }
 
     /* XXX the following two should really be atomic, though it probably doesn't